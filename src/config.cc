@@ -27,6 +27,7 @@
 #include <cstring>
 #include <cstdlib>
 #include "numbers.h"
+#include "missing.h"
 
 extern "C" {
 #include <openssl/ec.h>
@@ -39,6 +40,7 @@ namespace config {
 
 int dh_plen = DEFAULT_DH_PLEN;
 int rsa_len = DEFAULT_RSA_LEN;
+int rsa_primes = DEFAULT_RSA_PRIMES;
 int new_dh_keys = DEFAULT_NEW_DH_KEYS;
 
 int native_crypt = 0;
@@ -51,6 +53,12 @@ unsigned int peer_isolation = 0;
 
 std::string rsa_e = "65537";
 
+// RFC 7919 named DH group for new RSA personas, empty for generated DH params
+std::string dh_group = "";
+
+// key type for new Ed personas
+std::string ed_curve = "ed25519";
+
 std::string calgo = "aes128gcm";
 std::string phash = "sha256";
 std::string shash = "sha256";
@@ -70,6 +78,33 @@ bool nodos2unix = 0;
 
 bool ecdh_rsa = 0;
 
+// use on-disk fixed-base tables for DH keygen
+bool dh_precompute = 0;
+
+// per-peer double ratchet sessions instead of a Kex per message
+bool ratchet = 0;
+
+// cache message keys of decrypted messages, for re-opening them
+bool keycache = 0;
+
+// days after which cached message keys are dropped
+unsigned int keycache_expire = DEFAULT_KEYCACHE_EXPIRE;
+
+// store new (EC)DH keys in a single kex.pack file per persona
+bool kexpack = 0;
+
+// keep DER copies of PEM keys to skip PEM decoding on load
+bool dercache = 0;
+
+// keep persona dirs (and Kex dirs inside them) as ab/cd/<id> instead of flat
+bool shard = 0, shard_kex = 0;
+
+// chunk size for tree-hashed detached signatures, 0 means plain file hash
+unsigned int treehash = 0;
+
+// days after which imported Kex ids are dropped from the index, 0 means never
+unsigned int imported_expire = 0;
+
 std::string cfgbase = ".opmsg";
 
 }
@@ -122,6 +157,10 @@ int parse_config(const string &cfgbase)
 			config::rsa_len = strtoul(sline.substr(8).c_str(), nullptr, 0);
 			if (config::rsa_len < MIN_RSA_LEN || config::rsa_len > MAX_RSA_LEN)
 				config::rsa_len = DEFAULT_RSA_LEN;
+		} else if (sline.find("rsa_primes=") == 0) {
+			config::rsa_primes = strtoul(sline.substr(11).c_str(), nullptr, 0);
+			if (config::rsa_primes < MIN_RSA_PRIMES || config::rsa_primes > MAX_RSA_PRIMES)
+				config::rsa_primes = DEFAULT_RSA_PRIMES;
 		} else if (sline.find("dh_plen=") == 0) {
 			config::dh_plen = strtoul(sline.substr(8).c_str(), nullptr, 0);
 			if (config::dh_plen < MIN_DH_PLEN || config::dh_plen > MAX_DH_PLEN)
@@ -146,6 +185,42 @@ int parse_config(const string &cfgbase)
 			config::version = 3;
 		else if (sline == "ecdh-rsa")
 			config::ecdh_rsa = 1;
+		else if (sline == "dh_group=ffdhe2048" || sline == "dh_group=ffdhe3072" || sline == "dh_group=ffdhe4096" ||
+		         sline == "dh_group=ffdhe6144" || sline == "dh_group=ffdhe8192")
+			config::dh_group = sline.substr(9);
+		else if (sline == "ed_curve=ed25519" || sline == "ed_curve=ed448")
+			config::ed_curve = sline.substr(9);
+		else if (sline == "dh_precompute")
+			config::dh_precompute = 1;
+#ifdef HAVE_X25519
+		else if (sline == "ratchet")
+			config::ratchet = 1;
+#endif
+		else if (sline == "keycache")
+			config::keycache = 1;
+		else if (sline.find("keycache_expire=") == 0) {
+			config::keycache_expire = strtoul(sline.substr(16).c_str(), nullptr, 0);
+			if (config::keycache_expire == 0 || config::keycache_expire > MAX_KEYCACHE_EXPIRE)
+				config::keycache_expire = DEFAULT_KEYCACHE_EXPIRE;
+		} else if (sline == "kexpack")
+			config::kexpack = 1;
+		else if (sline == "dercache")
+			config::dercache = 1;
+		else if (sline == "shard")
+			config::shard = 1;
+		else if (sline == "shard_kex")
+			config::shard_kex = 1;
+		else if (sline == "treehash")
+			config::treehash = DEFAULT_TREEHASH_CHUNK;
+		else if (sline.find("treehash=") == 0) {
+			config::treehash = strtoul(sline.substr(9).c_str(), nullptr, 0);
+			if (config::treehash < MIN_TREEHASH_CHUNK || config::treehash > MAX_TREEHASH_CHUNK)
+				config::treehash = DEFAULT_TREEHASH_CHUNK;
+		} else if (sline.find("imported_expire=") == 0) {
+			config::imported_expire = strtoul(sline.substr(16).c_str(), nullptr, 0);
+			if (config::imported_expire > MAX_IMPORTED_EXPIRE)
+				config::imported_expire = 0;
+		}
 		else if (sline == "curve=secp521r1") {
 			if (seen_ec.count(sline) > 0)
 				continue;
@@ -240,6 +315,21 @@ int parse_config(const string &cfgbase)
 			config::curves.push_back("secp256k1");
 			config::curve_nids.push_back(NID_secp256k1);
 			seen_ec[sline] = 1;
+#ifdef HAVE_X25519
+		// kex only; EC personas still need one of the above curves
+		} else if (sline == "curve=x25519") {
+			if (seen_ec.count(sline) > 0)
+				continue;
+			config::curves.push_back("x25519");
+			config::curve_nids.push_back(NID_X25519);
+			seen_ec[sline] = 1;
+		} else if (sline == "curve=x448") {
+			if (seen_ec.count(sline) > 0)
+				continue;
+			config::curves.push_back("x448");
+			config::curve_nids.push_back(NID_X448);
+			seen_ec[sline] = 1;
+#endif
 		}
 	}
 
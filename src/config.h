@@ -29,12 +29,12 @@ namespace opmsg {
 
 namespace config {
 
-extern int dh_plen, rsa_len, new_dh_keys, native_crypt, deniable;
+extern int dh_plen, rsa_len, rsa_primes, new_dh_keys, native_crypt, deniable;
 
 extern std::vector<int> curve_nids;
 extern std::vector<std::string> curves;
 
-extern std::string rsa_e;
+extern std::string rsa_e, dh_group, ed_curve;
 
 extern std::string infile, outfile, calgo, idformat, my_id;
 extern std::string phash, shash, khash, cfgbase;
@@ -49,6 +49,26 @@ extern bool nodos2unix;
 
 extern bool ecdh_rsa;
 
+extern bool dh_precompute;
+
+extern bool ratchet;
+
+extern bool keycache;
+
+extern unsigned int keycache_expire;
+
+extern bool kexpack;
+
+extern bool dercache;
+
+extern bool shard;
+
+extern bool shard_kex;
+
+extern unsigned int treehash;
+
+extern unsigned int imported_expire;
+
 }
 
 int parse_config(const std::string &);
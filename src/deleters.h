@@ -52,6 +52,8 @@ extern "C" typedef void (*BN_CTX_del)(BN_CTX *);
 
 extern "C" typedef void (*BN_GENCB_del)(BN_GENCB *);
 
+extern "C" typedef void (*BN_MONT_CTX_del)(BN_MONT_CTX *);
+
 extern "C" typedef void (*EC_GROUP_del)(EC_GROUP *);
 
 extern "C" typedef void (*EC_KEY_del)(EC_KEY *);
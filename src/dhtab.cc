@@ -0,0 +1,287 @@
+/*
+ * This file is part of the opmsg crypto message framework.
+ *
+ * (C) 2015-2018 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * opmsg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * opmsg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with opmsg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+extern "C" {
+#include <openssl/dh.h>
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+}
+
+#include "missing.h"
+#include "deleters.h"
+#include "numbers.h"
+#include "dhtab.h"
+
+
+namespace opmsg {
+
+using namespace std;
+
+
+/* Fixed-base precomputation for g^x mod p. Since g and p of a persona never change,
+ * we store g^(d * 16^i) (Montgomery form) for each 4-bit digit d != 0 of the
+ * exponent at every position i. A DH key then costs one Montgomery multiplication per
+ * digit and no squarings at all. The table only holds public values.
+ */
+
+enum {
+	DHTAB_WINDOW	= 4,
+	DHTAB_DIGITS	= (1<<DHTAB_WINDOW) - 1	// digit 0 is not stored
+};
+
+struct dhtab_hdr {
+	char magic[8];
+	uint32_t window, positions, entry_len, pad;
+	unsigned char pg_hash[SHA256_DIGEST_LENGTH];
+};
+
+static const char dhtab_magic[8] = {'o', 'p', 'd', 'h', 't', 'a', 'b', '1'};
+
+
+class dhtab_map {
+
+	void *d_ptr{MAP_FAILED};
+	size_t d_len{0};
+
+public:
+
+	~dhtab_map()
+	{
+		if (d_ptr != MAP_FAILED)
+			munmap(d_ptr, d_len);
+	}
+
+	int map(int fd, size_t len)
+	{
+		d_len = len;
+#ifdef MAP_POPULATE
+		int flags = MAP_SHARED|MAP_POPULATE;
+#else
+		int flags = MAP_SHARED;
+#endif
+		if ((d_ptr = mmap(nullptr, len, PROT_READ, flags, fd, 0)) == MAP_FAILED)
+			return -1;
+		return 0;
+	}
+
+	const unsigned char *data()
+	{
+		return reinterpret_cast<const unsigned char *>(d_ptr);
+	}
+};
+
+
+static int pg_hash(const BIGNUM *p, const BIGNUM *g, unsigned char *h)
+{
+	size_t plen = BN_num_bytes(p);
+	unique_ptr<unsigned char[]> bin(new (nothrow) unsigned char[2*plen]);
+	if (!bin.get())
+		return -1;
+	if (BN_bn2binpad(p, bin.get(), plen) < 0 || BN_bn2binpad(g, bin.get() + plen, plen) < 0)
+		return -1;
+	SHA256(bin.get(), 2*plen, h);
+	return 0;
+}
+
+
+// build table into a temp file and move it into place, so concurrent users always see complete tables
+static int build_tab(const string &file, const dhtab_hdr &hdr, const BIGNUM *g, BN_MONT_CTX *mont, BN_CTX *ctx)
+{
+	unique_ptr<BIGNUM, BIGNUM_del> base(BN_new(), BN_free), e(BN_new(), BN_free);
+	unique_ptr<unsigned char[]> row(new (nothrow) unsigned char[DHTAB_DIGITS * hdr.entry_len]);
+	if (!base.get() || !e.get() || !row.get())
+		return -1;
+
+	if (BN_to_montgomery(base.get(), g, mont, ctx) != 1)
+		return -1;
+
+	string tmp = file + ".tmp." + to_string(getpid());
+	int fd = open(tmp.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0)
+		return -1;
+
+	bool ok = (write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr));
+
+	// row i: base^1 .. base^15 with base = g^(16^i); next base = base^16
+	for (uint32_t i = 0; ok && i < hdr.positions; ++i) {
+		if (BN_copy(e.get(), base.get()) == nullptr)
+			ok = 0;
+		for (uint32_t d = 0; ok && d < DHTAB_DIGITS; ++d) {
+			if (d > 0 && BN_mod_mul_montgomery(e.get(), e.get(), base.get(), mont, ctx) != 1)
+				ok = 0;
+			else if (BN_bn2binpad(e.get(), row.get() + d * hdr.entry_len, hdr.entry_len) < 0)
+				ok = 0;
+		}
+		if (ok && BN_mod_mul_montgomery(base.get(), e.get(), base.get(), mont, ctx) != 1)
+			ok = 0;
+		if (ok && write(fd, row.get(), DHTAB_DIGITS * hdr.entry_len) != (ssize_t)(DHTAB_DIGITS * hdr.entry_len))
+			ok = 0;
+	}
+
+	close(fd);
+	if (!ok || rename(tmp.c_str(), file.c_str()) < 0) {
+		unlink(tmp.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Generate a DH key for the params of dh, using (and if necessary creating) the
+ * precomputed table in file. Returns 1 on success and 0 if the params are not
+ * suitable for a table, in which case the caller should use DH_generate_key().
+ * Returns -1 on error. DH_check() is expensive compared to the key itself, so
+ * the params are checked once before a table is built for them. A table whose
+ * p/g hash matches stands for checked params, and callers only need to check
+ * the new public key.
+ */
+int dh_generate_key_tab(DH *dh, const string &file)
+{
+	const BIGNUM *p = nullptr, *q = nullptr, *g = nullptr;
+	struct stat st;
+	dhtab_hdr hdr, fhdr;
+
+	opmsg::DH_get0_pqg(dh, &p, &q, &g);
+
+	// only safe-prime params without q, as generated by new_dh_params()
+	if (!p || !g || q || BN_num_bits(p) > MAX_DHTAB_PLEN)
+		return 0;
+
+	// same private key length as DH_generate_key() uses
+	int xbits = DH_get_length(dh);
+	if (xbits <= 0 || xbits >= BN_num_bits(p))
+		xbits = BN_num_bits(p) - 1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, dhtab_magic, sizeof(hdr.magic));
+	hdr.window = DHTAB_WINDOW;
+	hdr.positions = BN_num_bits(p)/DHTAB_WINDOW + 1;
+	hdr.entry_len = (BN_num_bytes(p) + 7) & ~7;	// whole 64bit words for the lookup
+	if (pg_hash(p, g, hdr.pg_hash) < 0)
+		return -1;
+
+	size_t tab_len = sizeof(hdr) + (size_t)hdr.positions * DHTAB_DIGITS * hdr.entry_len;
+
+	unique_ptr<BN_CTX, BN_CTX_del> ctx(BN_CTX_new(), BN_CTX_free);
+	unique_ptr<BN_MONT_CTX, BN_MONT_CTX_del> mont(BN_MONT_CTX_new(), BN_MONT_CTX_free);
+	if (!ctx.get() || !mont.get() || BN_MONT_CTX_set(mont.get(), p, ctx.get()) != 1)
+		return -1;
+
+	for (int tries = 0;; ++tries) {
+		int fd = open(file.c_str(), O_RDONLY);
+		if (fd >= 0) {
+			bool ok = (fstat(fd, &st) == 0 && (size_t)st.st_size == tab_len && read(fd, &fhdr, sizeof(fhdr)) == (ssize_t)sizeof(fhdr) &&
+			           memcmp(&fhdr, &hdr, sizeof(hdr)) == 0);
+			close(fd);
+			if (ok)
+				break;
+		}
+		if (tries > 0)
+			return 0;
+		int ecode = 0;
+		if (DH_check(dh, &ecode) != 1)
+			return -1;
+		if (build_tab(file, hdr, g, mont.get(), ctx.get()) < 0)
+			return 0;
+	}
+
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return 0;
+	dhtab_map tab;
+	int r = tab.map(fd, tab_len);
+	close(fd);
+	if (r < 0)
+		return 0;
+
+	uint32_t words = hdr.entry_len/sizeof(uint64_t);
+#ifdef HAVE_BN_PRIV_RAND
+	BIGNUM *xp = BN_secure_new();
+#else
+	BIGNUM *xp = BN_new();
+#endif
+	unique_ptr<BIGNUM, BIGNUM_del> x(xp, BN_clear_free), acc(BN_new(), BN_free), sel(BN_new(), BN_free), pub(BN_new(), BN_free);
+	unique_ptr<uint64_t[]> one(new (nothrow) uint64_t[words]), sel_bin(new (nothrow) uint64_t[words]);
+	if (!x.get() || !acc.get() || !sel.get() || !pub.get() || !one.get() || !sel_bin.get())
+		return -1;
+
+	BN_set_flags(x.get(), BN_FLG_CONSTTIME);
+#ifdef HAVE_BN_PRIV_RAND
+	if (BN_priv_rand(x.get(), xbits, BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ANY) != 1)
+		return -1;
+#else
+	// top bit set, any bottom bit
+	if (BN_rand(x.get(), xbits, 0, 0) != 1)
+		return -1;
+#endif
+
+	// Montgomery form of 1, used for digit 0
+	if (BN_to_montgomery(acc.get(), BN_value_one(), mont.get(), ctx.get()) != 1 ||
+	    BN_bn2binpad(acc.get(), reinterpret_cast<unsigned char *>(one.get()), hdr.entry_len) < 0)
+		return -1;
+
+	// header and entries are a multiple of 8 bytes, and mmap is page aligned
+	const uint64_t *rows = reinterpret_cast<const uint64_t *>(tab.data() + sizeof(hdr));
+	uint32_t positions = (xbits + DHTAB_WINDOW - 1)/DHTAB_WINDOW;
+	for (uint32_t i = 0; i < positions; ++i) {
+		uint64_t digit = 0;
+		for (int b = 0; b < DHTAB_WINDOW; ++b)
+			digit |= (BN_is_bit_set(x.get(), i*DHTAB_WINDOW + b) ? 1 : 0)<<b;
+
+		// constant time lookup: touch every entry of the row
+		uint64_t m = 0 - ((digit - 1) >> 63);
+		for (uint32_t k = 0; k < words; ++k)
+			sel_bin[k] = one[k] & m;
+		const uint64_t *row = rows + (size_t)i * DHTAB_DIGITS * words;
+		for (uint64_t d = 1; d <= DHTAB_DIGITS; ++d) {
+			m = 0 - (((digit ^ d) - 1) >> 63);
+			const uint64_t *entry = row + (d - 1) * words;
+			for (uint32_t k = 0; k < words; ++k)
+				sel_bin[k] |= entry[k] & m;
+		}
+
+		if (!BN_bin2bn(reinterpret_cast<unsigned char *>(sel_bin.get()), hdr.entry_len, sel.get()))
+			return -1;
+		if (BN_mod_mul_montgomery(acc.get(), acc.get(), sel.get(), mont.get(), ctx.get()) != 1)
+			return -1;
+	}
+	OPENSSL_cleanse(sel_bin.get(), hdr.entry_len);
+
+	if (BN_from_montgomery(pub.get(), acc.get(), mont.get(), ctx.get()) != 1)
+		return -1;
+
+	opmsg::DH_set0_key(dh, pub.release(), x.release());
+	return 1;
+}
+
+
+}
+
@@ -0,0 +1,38 @@
+/*
+ * This file is part of the opmsg crypto message framework.
+ *
+ * (C) 2015-2018 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * opmsg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * opmsg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with opmsg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef opmsg_dhtab_h
+#define opmsg_dhtab_h
+
+#include <string>
+
+extern "C" {
+#include <openssl/dh.h>
+}
+
+
+namespace opmsg {
+
+int dh_generate_key_tab(DH *, const std::string &);
+
+}
+
+#endif
+
@@ -0,0 +1,384 @@
+/*
+ * This file is part of the opmsg crypto message framework.
+ *
+ * (C) 2015-2018 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * opmsg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * opmsg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with opmsg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <algorithm>
+
+extern "C" {
+#include <openssl/evp.h>
+}
+
+#include "missing.h"
+#include "deleters.h"
+#include "filehash.h"
+#include "misc.h"
+
+
+namespace opmsg {
+
+using namespace std;
+
+
+// read buffer size for streaming hashes
+static const size_t read_chunk = 0x100000;
+
+
+// "/dev/stdin" is handled as fd 0, as in read_msg()
+static int open_input(const string &path)
+{
+	if (path == "/dev/stdin")
+		return 0;
+	return open(path.c_str(), O_RDONLY);
+}
+
+
+static void close_input(int fd)
+{
+	if (fd > 0)
+		close(fd);
+}
+
+
+// read until buf is full or EOF
+static ssize_t read_full(int fd, unsigned char *buf, size_t len)
+{
+	size_t n = 0;
+	ssize_t r = 0;
+
+	while (n < len) {
+		if ((r = read(fd, buf + n, len - n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		n += r;
+	}
+	return n;
+}
+
+
+// pread() until buf is full or EOF
+static ssize_t pread_full(int fd, unsigned char *buf, size_t len, off_t off)
+{
+	size_t n = 0;
+	ssize_t r = 0;
+
+	while (n < len) {
+		if ((r = pread(fd, buf + n, len - n, off + n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		n += r;
+	}
+	return n;
+}
+
+
+static int digest(const EVP_MD *md, EVP_MD_CTX *md_ctx, const unsigned char *buf, size_t len, unsigned char *h, unsigned int &hlen)
+{
+	if (EVP_DigestInit_ex(md_ctx, md, nullptr) != 1)
+		return -1;
+	if (EVP_DigestUpdate(md_ctx, buf, len) != 1)
+		return -1;
+	if (EVP_DigestFinal_ex(md_ctx, h, &hlen) != 1)
+		return -1;
+	return 0;
+}
+
+
+// hash a file of any size in constant memory
+int file2hexhash(const EVP_MD *md, const string &path, string &hexhash)
+{
+	hexhash = "";
+
+	unique_ptr<unsigned char[]> buf(new (nothrow) unsigned char[read_chunk]);
+	if (!buf.get())
+		return -1;
+
+	int fd = open_input(path);
+	if (fd < 0)
+		return -1;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	unsigned int hlen = 0;
+	unsigned char h[EVP_MAX_MD_SIZE];	// 64 which matches sha512
+	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(md_ctx_new(), md_ctx_free);
+	if (!md_ctx.get() || EVP_DigestInit_ex(md_ctx.get(), md, nullptr) != 1) {
+		close_input(fd);
+		return -1;
+	}
+
+	ssize_t r = 0;
+	for (;;) {
+		if ((r = read_full(fd, buf.get(), read_chunk)) <= 0)
+			break;
+		if (EVP_DigestUpdate(md_ctx.get(), buf.get(), r) != 1) {
+			r = -1;
+			break;
+		}
+	}
+	close_input(fd);
+
+	if (r < 0 || EVP_DigestFinal_ex(md_ctx.get(), h, &hlen) != 1)
+		return -1;
+
+	blob2hex(string(reinterpret_cast<char *>(h), hlen), hexhash);
+	return 0;
+}
+
+
+/* Hash one leaf of up to len bytes at off, streamed through buf in blocks of
+ * at most blen bytes. For pipes (off < 0) it reads sequentially. Returns the
+ * number of bytes hashed or -1.
+ */
+static ssize_t leaf_hash(const EVP_MD *md, EVP_MD_CTX *md_ctx, int fd, off_t off, size_t len,
+                         unsigned char *buf, size_t blen, unsigned char *h, unsigned int &hlen)
+{
+	size_t n = 0;
+
+	if (EVP_DigestInit_ex(md_ctx, md, nullptr) != 1)
+		return -1;
+	while (n < len) {
+		size_t want = min(blen, len - n);
+		ssize_t r = off < 0 ? read_full(fd, buf, want) : pread_full(fd, buf, want, off + n);
+		if (r < 0 || EVP_DigestUpdate(md_ctx, buf, r) != 1)
+			return -1;
+		n += r;
+		if ((size_t)r < want)
+			break;
+	}
+	if (EVP_DigestFinal_ex(md_ctx, h, &hlen) != 1)
+		return -1;
+	return n;
+}
+
+
+/* Two level tree hash: each chunk of the file is hashed on its own (leaf), and
+ * the result is the hash across all leaf digests. Leafs of seekable files are hashed
+ * in parallel. Pipes are hashed sequentially, yielding the same result. Input shorter
+ * than one chunk (or empty) is a single leaf either way. Leafs are streamed in
+ * read_chunk blocks, so memory use does not depend on the chunk size.
+ */
+int file2treehash(const EVP_MD *md, const string &path, size_t chunk, string &hexhash)
+{
+	struct stat st;
+	unsigned char h[EVP_MAX_MD_SIZE];
+	unsigned int hlen = EVP_MD_size(md);
+	size_t blen = min(chunk, read_chunk);
+
+	hexhash = "";
+
+	if (chunk < MIN_TREEHASH_CHUNK || chunk > MAX_TREEHASH_CHUNK)
+		return -1;
+
+	int fd = open_input(path);
+	if (fd < 0)
+		return -1;
+
+	string leafs = "";
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+
+		size_t nleafs = (st.st_size + chunk - 1)/chunk;
+		if (nleafs == 0)
+			nleafs = 1;
+
+		leafs.resize(nleafs * hlen);
+
+		unsigned int nthreads = max_threads();
+		if (nthreads > nleafs)
+			nthreads = nleafs;
+
+		atomic<size_t> next{0};
+		atomic<bool> failed{false};
+
+		auto worker = [&]{
+			unsigned char lh[EVP_MAX_MD_SIZE];
+			unsigned int lhlen = 0;
+
+			unique_ptr<unsigned char[]> buf(new (nothrow) unsigned char[blen]);
+			unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(md_ctx_new(), md_ctx_free);
+			if (!buf.get() || !md_ctx.get()) {
+				failed = 1;
+				return;
+			}
+
+			for (size_t i = next++; i < nleafs && !failed; i = next++) {
+				if (leaf_hash(md, md_ctx.get(), fd, (off_t)i * chunk, chunk, buf.get(), blen, lh, lhlen) < 0 || lhlen != hlen) {
+					failed = 1;
+					return;
+				}
+				memcpy(&leafs[i * hlen], lh, hlen);
+			}
+		};
+
+		vector<thread> workers;
+		for (unsigned int i = 1; i < nthreads; ++i)
+			workers.push_back(thread(worker));
+		worker();
+		for (auto &t : workers)
+			t.join();
+
+		if (failed) {
+			close_input(fd);
+			return -1;
+		}
+	} else {
+		unique_ptr<unsigned char[]> buf(new (nothrow) unsigned char[blen]);
+		unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(md_ctx_new(), md_ctx_free);
+		if (!buf.get() || !md_ctx.get()) {
+			close_input(fd);
+			return -1;
+		}
+
+		ssize_t r = 0;
+		do {
+			if ((r = leaf_hash(md, md_ctx.get(), fd, -1, chunk, buf.get(), blen, h, hlen)) < 0) {
+				close_input(fd);
+				return -1;
+			}
+			// an empty file still has one (empty) leaf, like above
+			if (r > 0 || leafs.empty())
+				leafs += string(reinterpret_cast<char *>(h), hlen);
+		} while (r == (ssize_t)chunk);
+	}
+	close_input(fd);
+
+	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(md_ctx_new(), md_ctx_free);
+	if (!md_ctx.get())
+		return -1;
+	if (digest(md, md_ctx.get(), reinterpret_cast<const unsigned char *>(leafs.c_str()), leafs.size(), h, hlen) < 0)
+		return -1;
+
+	blob2hex(string(reinterpret_cast<char *>(h), hlen), hexhash);
+	return 0;
+}
+
+
+/* Hash a list of files in parallel. Each thread picks the next file from the
+ * list. Returns the number of files that could not be hashed; their entry
+ * in hexhashes is left empty and, if asked for, errnos holds why.
+ */
+int files2hexhash(const EVP_MD *md, const vector<string> &paths, vector<string> &hexhashes, vector<int> *errnos)
+{
+	hexhashes.clear();
+	hexhashes.resize(paths.size());
+	if (errnos) {
+		errnos->clear();
+		errnos->resize(paths.size());
+	}
+
+	unsigned int nthreads = max_threads();
+	if (nthreads > paths.size())
+		nthreads = paths.size();
+
+	atomic<size_t> next{0};
+	atomic<int> failed{0};
+
+	auto worker = [&]{
+		for (size_t i = next++; i < paths.size(); i = next++) {
+			errno = 0;
+			if (file2hexhash(md, paths[i], hexhashes[i]) < 0) {
+				hexhashes[i] = "";
+				if (errnos)
+					(*errnos)[i] = errno;
+				++failed;
+			}
+		}
+	};
+
+	vector<thread> workers;
+	for (unsigned int i = 1; i < nthreads; ++i)
+		workers.push_back(thread(worker));
+	worker();
+	for (auto &t : workers)
+		t.join();
+
+	return failed;
+}
+
+
+/* Recursively collect all regular files below dir, sorted. Symlinks are not
+ * followed; they and other special files go to skipped.
+ */
+int dir2files(const string &dir, vector<string> &files, vector<string> &skipped)
+{
+	struct stat st;
+	string path = "";
+	vector<string> subdirs;
+
+	DIR *d = opendir(dir.c_str());
+	if (!d)
+		return -1;
+
+	dirent *de = nullptr;
+	for (;;) {
+		if ((de = readdir(d)) == nullptr)
+			break;
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		path = dir;
+		if (path.empty() || path[path.size() - 1] != '/')
+			path += "/";
+		path += de->d_name;
+
+		if (lstat(path.c_str(), &st) < 0)
+			continue;
+		if (S_ISREG(st.st_mode))
+			files.push_back(path);
+		else if (S_ISDIR(st.st_mode))
+			subdirs.push_back(path);
+		else
+			skipped.push_back(path);
+	}
+	closedir(d);
+
+	for (auto &sd : subdirs) {
+		if (dir2files(sd, files, skipped) < 0)
+			return -1;
+	}
+
+	sort(files.begin(), files.end());
+	return 0;
+}
+
+
+}
+
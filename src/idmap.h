@@ -0,0 +1,207 @@
+/*
+ * This file is part of the opmsg crypto message framework.
+ *
+ * (C) 2015-2018 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * opmsg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * opmsg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with opmsg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef opmsg_idmap_h
+#define opmsg_idmap_h
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstring>
+
+#include "numbers.h"
+
+
+namespace opmsg {
+
+
+/* A persona or Kex id as the binary digest its lowercase hex string spells,
+ * kept inline. Orders the same as the hex strings do. Invalid hex yields
+ * an empty id.
+ */
+class bin_id {
+
+	unsigned char d_len{0};
+	unsigned char d_id[MAX_ID_BYTES];
+
+	static int nibble(char c)
+	{
+		if (c >= '0' && c <= '9')
+			return c - '0';
+		if (c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		return -1;
+	}
+
+public:
+
+	bin_id()
+	{
+	}
+
+	bin_id(const std::string &hex)
+	{
+		if (hex.size() % 2 != 0 || hex.size() > 2*MAX_ID_BYTES)
+			return;
+		for (std::string::size_type i = 0; i < hex.size(); i += 2) {
+			int h = nibble(hex[i]), l = nibble(hex[i + 1]);
+			if (h < 0 || l < 0)
+				return;
+			d_id[i/2] = (h<<4)|l;
+		}
+		d_len = hex.size()/2;
+	}
+
+	bin_id(const unsigned char *id, size_t len)
+	{
+		if (len > MAX_ID_BYTES)
+			return;
+		memcpy(d_id, id, len);
+		d_len = len;
+	}
+
+	const unsigned char *data() const
+	{
+		return d_id;
+	}
+
+	unsigned int size() const
+	{
+		return d_len;
+	}
+
+	std::string hex() const
+	{
+		static const char digits[] = "0123456789abcdef";
+		std::string s(2*d_len, 0);
+		for (unsigned int i = 0; i < d_len; ++i) {
+			s[2*i] = digits[d_id[i]>>4];
+			s[2*i + 1] = digits[d_id[i]&0xf];
+		}
+		return s;
+	}
+
+	bool has_prefix(const bin_id &p) const
+	{
+		return p.d_len <= d_len && memcmp(d_id, p.d_id, p.d_len) == 0;
+	}
+
+	bool operator<(const bin_id &o) const
+	{
+		int r = memcmp(d_id, o.d_id, d_len < o.d_len ? d_len : o.d_len);
+		return r < 0 || (r == 0 && d_len < o.d_len);
+	}
+
+	bool operator==(const bin_id &o) const
+	{
+		return d_len == o.d_len && memcmp(d_id, o.d_id, d_len) == 0;
+	}
+};
+
+
+/* The part of std::map<std::string, V> that keystore and persona need, as one sorted
+ * vector of (binary id, value) pairs. Lookups are binary searches over contiguous
+ * memory and no entry needs an allocation of its own. Inserts move the tail, which
+ * is cheap as ids mostly arrive in order from storage. Like vector iterators,
+ * iterators and references are invalidated by insert and erase.
+ */
+template<class V>
+class id_map {
+
+	typedef std::pair<bin_id, V> entry;
+
+	std::vector<entry> d_v;
+
+	static bool less(const entry &e, const bin_id &id)
+	{
+		return e.first < id;
+	}
+
+public:
+
+	typedef typename std::vector<entry>::iterator iterator;
+
+	iterator begin()
+	{
+		return d_v.begin();
+	}
+
+	iterator end()
+	{
+		return d_v.end();
+	}
+
+	size_t size() const
+	{
+		return d_v.size();
+	}
+
+	iterator lower_bound(const bin_id &id)
+	{
+		return std::lower_bound(d_v.begin(), d_v.end(), id, less);
+	}
+
+	iterator find(const bin_id &id)
+	{
+		auto i = lower_bound(id);
+		if (i != d_v.end() && i->first == id)
+			return i;
+		return d_v.end();
+	}
+
+	size_t count(const bin_id &id)
+	{
+		return find(id) != d_v.end();
+	}
+
+	V &operator[](const bin_id &id)
+	{
+		if (d_v.empty() || d_v.back().first < id) {
+			d_v.emplace_back(id, V());
+			return d_v.back().second;
+		}
+		auto i = lower_bound(id);
+		if (i == d_v.end() || !(i->first == id))
+			i = d_v.insert(i, entry(id, V()));
+		return i->second;
+	}
+
+	void erase(const bin_id &id)
+	{
+		auto i = find(id);
+		if (i != d_v.end())
+			d_v.erase(i);
+	}
+
+	// take over unordered entries at once; for duplicate ids the first one wins
+	void assign(std::vector<entry> &v)
+	{
+		std::stable_sort(v.begin(), v.end(), [](const entry &a, const entry &b) { return a.first < b.first; });
+		v.erase(std::unique(v.begin(), v.end(), [](const entry &a, const entry &b) { return a.first == b.first; }), v.end());
+		d_v.swap(v);
+	}
+};
+
+
+}
+
+#endif
+
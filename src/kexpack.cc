@@ -0,0 +1,512 @@
+/*
+ * This file is part of the opmsg crypto message framework.
+ *
+ * (C) 2015-2018 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * opmsg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * opmsg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with opmsg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <vector>
+#include <string>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "deleters.h"
+#include "numbers.h"
+#include "misc.h"
+#include "kexpack.h"
+
+
+namespace opmsg {
+
+using namespace std;
+
+
+/* The pack is a magic line followed by records of the form
+ *
+ * <op> <kex id> <n> <len>\n<len bytes payload>
+ *
+ * with op being one of
+ *
+ * pub, priv	n-th (per curve) PEM of the Kex id
+ * peer		designated peer id
+ * used, unused	used flag
+ * delpub	tombstone for all pub PEMs
+ * delpriv	tombstone for all priv PEMs, peer and used flag (the PEMs are wiped in place)
+ * del		tombstone for the whole Kex id
+ *
+ * Later records override earlier ones. A torn record at the end (crash during
+ * append) is ignored and cut off with the next append.
+ */
+
+static const string magic = "opmsg kexpack 1\n";
+
+
+static string record(const string &op, const string &hex, unsigned int n, const string &payload)
+{
+	return op + " " + hex + " " + to_string(n) + " " + to_string(payload.size()) + "\n" + payload;
+}
+
+
+kexpack::kexpack(const string &dir)
+{
+	d_file = dir + "/kex.pack";
+}
+
+
+// scan records from offset 'from' (0 means whole pack) and update index. If 'out' is given,
+// also collect the payloads of (Kex id 'hex' or all). Returns offset of end of last complete record.
+off_t kexpack::scan(FILE *f, off_t from, map<string, kex_data> *out, const string &hex)
+{
+	struct stat st;
+	if (fstat(fileno(f), &st) < 0)
+		return build_error("scan::fstat:", -1);
+
+	char buf[256], op[16], id[160];
+	memset(buf, 0, sizeof(buf));
+
+	if (from == 0) {
+		d_index.clear();
+		d_deleted.clear();
+		d_end = 0;
+		d_ino = st.st_ino;
+		if (st.st_size == 0) {
+			errno = 0;
+			return 0;
+		}
+		if (fseeko(f, 0, SEEK_SET) < 0 || !fgets(buf, sizeof(buf), f) || magic != buf) {
+			errno = 0;
+			return build_error("scan: Not a Kex pack: " + d_file, -1);
+		}
+		from = magic.size();
+	} else if (fseeko(f, from, SEEK_SET) < 0)
+		return build_error("scan::fseeko:", -1);
+
+	unsigned int n = 0;
+	size_t len = 0;
+	off_t end = from, off = 0;
+	string o = "", k = "", payload = "";
+
+	auto drop = [](vector<rec> &v, const string &what) {
+		v.erase(remove_if(v.begin(), v.end(), [&](const rec &r) { return r.op == what; }), v.end());
+	};
+
+	for (;;) {
+		if (!fgets(buf, sizeof(buf), f))
+			break;
+		size_t blen = strlen(buf);
+		if (blen == 0 || buf[blen - 1] != '\n')
+			break;
+		memset(op, 0, sizeof(op));
+		memset(id, 0, sizeof(id));
+		if (sscanf(buf, "%15[a-z] %128[0-9a-f] %u %zu", op, id, &n, &len) != 4 || n > 2 || len > MAX_KEXPACK_RECORD)
+			break;
+		off = end + blen;
+		if (off + (off_t)len > st.st_size)
+			break;
+
+		o = op;
+		k = id;
+		if (!is_hex_hash(k))
+			break;
+
+		bool want = out && (hex.empty() || hex == k);
+		if (want && (o == "pub" || o == "priv" || o == "peer")) {
+			payload.resize(len);
+			if (len > 0 && fread(&payload[0], 1, len, f) != len)
+				break;
+		} else if (fseeko(f, off + len, SEEK_SET) < 0)
+			break;
+		end = off + len;
+
+		rec r;
+		r.op = o;
+		r.n = n;
+		r.off = off;
+		r.len = len;
+
+		vector<rec> &v = d_index[k];
+		kex_data *kx = want ? &(*out)[k] : nullptr;
+
+		if (o == "pub" || o == "priv") {
+			d_deleted.erase(k);
+			v.push_back(r);
+			if (kx) {
+				vector<string> &pems = (o == "pub" ? kx->pub : kx->priv);
+				if (pems.size() <= n)
+					pems.resize(n + 1);
+				pems[n] = payload;
+			}
+		} else if (o == "peer") {
+			drop(v, o);
+			v.push_back(r);
+			if (kx)
+				kx->peer = payload;
+		} else if (o == "used") {
+			drop(v, o);
+			v.push_back(r);
+			if (kx)
+				kx->used = 1;
+		} else if (o == "unused") {
+			drop(v, "used");
+			if (kx)
+				kx->used = 0;
+		} else if (o == "delpub") {
+			drop(v, "pub");
+			if (kx)
+				kx->pub.clear();
+		} else if (o == "delpriv") {
+			drop(v, "priv");
+			drop(v, "peer");
+			drop(v, "used");
+			if (kx) {
+				kx->priv.clear();
+				kx->peer = "";
+				kx->used = 0;
+			}
+		} else if (o == "del") {
+			d_index.erase(k);
+			d_deleted.insert(k);
+			if (want)
+				out->erase(k);
+		}
+		// unknown ops are skipped, for newer versions adding some
+	}
+
+	d_end = end;
+	errno = 0;
+	return end;
+}
+
+
+// bring index up to date with the locked pack, only scanning what was appended meanwhile
+off_t kexpack::sync_index(FILE *f)
+{
+	struct stat st;
+	if (fstat(fileno(f), &st) < 0)
+		return build_error("sync_index::fstat:", -1);
+
+	if (d_end > 0 && st.st_ino == d_ino && st.st_size >= d_end) {
+		if (st.st_size == d_end)
+			return d_end;
+		return scan(f, d_end, nullptr);
+	}
+	return scan(f, 0, nullptr);
+}
+
+
+// open and write-lock the pack. A compact() may have replaced it while we waited for the lock.
+// Returns nullptr with errno == ENOENT if there is no pack and create is false.
+FILE *kexpack::open_locked(bool create)
+{
+	struct stat st1, st2;
+
+	for (;;) {
+		int fd = open(d_file.c_str(), create ? O_RDWR|O_CREAT : O_RDWR, 0600);
+		if (fd < 0) {
+			if (errno == ENOENT && !create)
+				return nullptr;
+			return build_error("open_locked::open:", nullptr);
+		}
+		wlockf(fd);
+		if (fstat(fd, &st1) == 0 && stat(d_file.c_str(), &st2) == 0 && st1.st_ino == st2.st_ino && st1.st_dev == st2.st_dev) {
+			FILE *f = fdopen(fd, "r+");
+			if (!f) {
+				close(fd);
+				return build_error("open_locked::fdopen:", nullptr);
+			}
+			return f;
+		}
+		close(fd);
+	}
+}
+
+
+// append records to the locked pack, cutting off any torn record after 'end'
+int kexpack::append(FILE *f, off_t end, const string &recs)
+{
+	string s = recs;
+	if (end == 0)
+		s = magic + recs;
+
+	if (ftruncate(fileno(f), end) < 0)
+		return build_error("append::ftruncate:", -1);
+	if (fseeko(f, end, SEEK_SET) < 0)
+		return build_error("append::fseeko:", -1);
+	if (fwrite(s.c_str(), s.size(), 1, f) != 1 || fflush(f) != 0)
+		return build_error("append::fwrite:", -1);
+
+	if (scan(f, end, nullptr) < 0)
+		return -1;
+	return 0;
+}
+
+
+// one sequential read of the whole pack, collecting the keys of 'hex' or all
+int kexpack::load(map<string, kex_data> &out, const string &hex)
+{
+	unique_ptr<FILE, FILE_del> f(fopen(d_file.c_str(), "r"), ffclose);
+	if (!f.get()) {
+		if (errno == ENOENT) {
+			errno = 0;
+			return 0;
+		}
+		return build_error("load::fopen:", -1);
+	}
+	setvbuf(f.get(), nullptr, _IOFBF, 0x100000);
+
+	rlockf(f.get());
+	if (scan(f.get(), 0, &out, hex) < 0)
+		return -1;
+	return 0;
+}
+
+
+int kexpack::exists(const string &hex)
+{
+	unique_ptr<FILE, FILE_del> f(fopen(d_file.c_str(), "r"), ffclose);
+	if (!f.get()) {
+		if (errno == ENOENT) {
+			errno = 0;
+			return 0;
+		}
+		return build_error("exists::fopen:", -1);
+	}
+
+	rlockf(f.get());
+	if (sync_index(f.get()) < 0)
+		return -1;
+	return d_index.count(hex) > 0 || d_deleted.count(hex) > 0;
+}
+
+
+int kexpack::add(const string &hex, const kex_data &k)
+{
+	unique_ptr<FILE, FILE_del> f(open_locked(1), ffclose);
+	if (!f.get())
+		return -1;
+	off_t end = sync_index(f.get());
+	if (end < 0)
+		return -1;
+	if (d_index.count(hex) > 0 || d_deleted.count(hex) > 0) {
+		errno = 0;
+		return build_error("add: Kex id already exist(ed) " + hex, -1);
+	}
+
+	string recs = "";
+	for (unsigned int i = 0; i < k.pub.size(); ++i) {
+		if (k.pub[i].size() > 0)
+			recs += record("pub", hex, i, k.pub[i]);
+	}
+	for (unsigned int i = 0; i < k.priv.size(); ++i) {
+		if (k.priv[i].size() > 0)
+			recs += record("priv", hex, i, k.priv[i]);
+	}
+	if (k.peer.size() > 0)
+		recs += record("peer", hex, 0, k.peer);
+	if (k.used)
+		recs += record("used", hex, 0, "");
+
+	return append(f.get(), end, recs);
+}
+
+
+int kexpack::used(const string &hex, bool u)
+{
+	unique_ptr<FILE, FILE_del> f(open_locked(0), ffclose);
+	if (!f.get()) {
+		if (errno != ENOENT)
+			return -1;
+		errno = 0;
+		return 0;
+	}
+	off_t end = sync_index(f.get());
+	if (end < 0)
+		return -1;
+	if (d_index.count(hex) == 0)
+		return 0;
+	if (append(f.get(), end, record(u ? "used" : "unused", hex, 0, "")) < 0)
+		return -1;
+	return 1;
+}
+
+
+int kexpack::del_pub(const string &hex)
+{
+	unique_ptr<FILE, FILE_del> f(open_locked(0), ffclose);
+	if (!f.get()) {
+		if (errno != ENOENT)
+			return -1;
+		errno = 0;
+		return 0;
+	}
+	off_t end = sync_index(f.get());
+	if (end < 0)
+		return -1;
+	if (d_index.count(hex) == 0)
+		return 0;
+	if (append(f.get(), end, record("delpub", hex, 0, "")) < 0)
+		return -1;
+	return 1;
+}
+
+
+// The mutators below return 1 if hex was found in the pack, 0 if not (so its kept in
+// a directory) and -1 on error.
+
+
+// tombstone first, so the key is gone even if wiping is interrupted
+int kexpack::del_priv(const string &hex)
+{
+	unique_ptr<FILE, FILE_del> f(open_locked(0), ffclose);
+	if (!f.get()) {
+		if (errno != ENOENT)
+			return -1;
+		errno = 0;
+		return 0;
+	}
+	off_t end = sync_index(f.get());
+	if (end < 0)
+		return -1;
+	if (d_index.count(hex) == 0)
+		return 0;
+
+	vector<rec> privs;
+	for (auto &r : d_index[hex]) {
+		if (r.op == "priv")
+			privs.push_back(r);
+	}
+
+	if (append(f.get(), end, record("delpriv", hex, 0, "")) < 0)
+		return -1;
+
+	// one write per PEM and a flush of just the pack
+	for (auto &r : privs) {
+		string zeros(r.len, 0);
+		if (fseeko(f.get(), r.off, SEEK_SET) < 0)
+			return build_error("del_priv::fseeko:", -1);
+		if (r.len > 0 && fwrite(zeros.c_str(), r.len, 1, f.get()) != 1)
+			return build_error("del_priv::fwrite: Unable to wipe key.", -1);
+	}
+	if (fflush(f.get()) != 0 || fdatasync(fileno(f.get())) < 0)
+		return build_error("del_priv::fdatasync:", -1);
+
+	return 1;
+}
+
+
+int kexpack::del_id(const string &hex)
+{
+	unique_ptr<FILE, FILE_del> f(open_locked(0), ffclose);
+	if (!f.get()) {
+		if (errno != ENOENT)
+			return -1;
+		errno = 0;
+		return 0;
+	}
+	off_t end = sync_index(f.get());
+	if (end < 0)
+		return -1;
+	if (d_index.count(hex) == 0)
+		return 0;
+	if (append(f.get(), end, record("del", hex, 0, "")) < 0)
+		return -1;
+	return 1;
+}
+
+
+// rewrite pack with only the live records, and the tombstones of deleted Kex ids
+int kexpack::compact()
+{
+	unique_ptr<FILE, FILE_del> f(open_locked(0), ffclose);
+	if (!f.get()) {
+		if (errno != ENOENT)
+			return -1;
+		errno = 0;
+		return 0;
+	}
+	if (scan(f.get(), 0, nullptr) < 0)
+		return -1;
+
+	// keep order of records
+	vector<pair<string, rec>> live;
+	for (auto &it : d_index) {
+		for (auto &r : it.second)
+			live.push_back(make_pair(it.first, r));
+	}
+	sort(live.begin(), live.end(), [](const pair<string, rec> &a, const pair<string, rec> &b) { return a.second.off < b.second.off; });
+
+	string tmp = d_file + "." + to_string(getpid());
+	int fd = open(tmp.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0)
+		return build_error("compact::open:", -1);
+	unique_ptr<FILE, FILE_del> f2(fdopen(fd, "w"), ffclose);
+	if (!f2.get()) {
+		close(fd);
+		unlink(tmp.c_str());
+		return build_error("compact::fdopen:", -1);
+	}
+
+	bool ok = fwrite(magic.c_str(), magic.size(), 1, f2.get()) == 1;
+	string payload = "", s = "";
+	for (auto &hex : d_deleted) {
+		if (!ok)
+			break;
+		s = record("del", hex, 0, "");
+		ok = fwrite(s.c_str(), s.size(), 1, f2.get()) == 1;
+	}
+	for (auto &it : live) {
+		if (!ok)
+			break;
+		payload.resize(it.second.len);
+		if (it.second.len > 0) {
+			if (fseeko(f.get(), it.second.off, SEEK_SET) < 0 || fread(&payload[0], 1, it.second.len, f.get()) != it.second.len) {
+				ok = 0;
+				break;
+			}
+		}
+		s = record(it.second.op, it.first, it.second.n, payload);
+		ok = fwrite(s.c_str(), s.size(), 1, f2.get()) == 1;
+	}
+	if (ok)
+		ok = (fflush(f2.get()) == 0 && fsync(fileno(f2.get())) == 0);
+	f2.reset();
+
+	if (!ok || rename(tmp.c_str(), d_file.c_str()) < 0) {
+		unlink(tmp.c_str());
+		return build_error("compact: Error writing " + tmp, -1);
+	}
+
+	// next access rescans the new pack
+	d_index.clear();
+	d_deleted.clear();
+	d_end = 0;
+	d_ino = 0;
+	errno = 0;
+	return 0;
+}
+
+
+}
+
@@ -0,0 +1,123 @@
+/*
+ * This file is part of the opmsg crypto message framework.
+ *
+ * (C) 2015-2018 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * opmsg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * opmsg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with opmsg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef opmsg_kexpack_h
+#define opmsg_kexpack_h
+
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <sys/types.h>
+
+extern "C" {
+#include <openssl/err.h>
+}
+
+#include "storage.h"
+
+
+namespace opmsg {
+
+// All (EC)DH Kex keys of a persona in one append-only file kex.pack in the persona dir,
+// instead of one directory per Kex id. Deletions are appended as tombstones
+// (private keys are wiped in place right away) and compact() rewrites the file
+// with only the live records and the tombstones of deleted Kex ids.
+class kexpack {
+
+	// position of a record's payload inside the pack
+	struct rec {
+		std::string op{""};
+		unsigned int n{0};
+		off_t off{0};
+		size_t len{0};
+	};
+
+	std::string d_file{""}, d_err{""};
+
+	// live records by Kex id, as of the last scan up to d_end of inode d_ino
+	std::map<std::string, std::vector<rec>> d_index;
+
+	// Kex ids deleted as a whole, which must never be added again
+	std::set<std::string> d_deleted;
+	off_t d_end{0};
+	ino_t d_ino{0};
+
+	template<class T>
+	T build_error(const std::string &msg, T r)
+	{
+		int e = 0;
+		d_err = "kexpack::";
+		d_err += msg;
+		if ((e = ERR_get_error())) {
+			ERR_load_crypto_strings();
+			d_err += ":";
+			d_err += ERR_error_string(e, nullptr);
+			ERR_clear_error();
+		} else if (errno) {
+			d_err += ":";
+			d_err += strerror(errno);
+		}
+		return r;
+	}
+
+	off_t scan(FILE *, off_t, std::map<std::string, kex_data> *, const std::string & = "");
+
+	FILE *open_locked(bool);
+
+	off_t sync_index(FILE *);
+
+	int append(FILE *, off_t, const std::string &);
+
+public:
+
+	kexpack(const std::string &);
+
+	int load(std::map<std::string, kex_data> &, const std::string & = "");
+
+	// 1 if the Kex id is in the pack or was deleted from it, 0 if not
+	int exists(const std::string &);
+
+	int add(const std::string &, const kex_data &);
+
+	int used(const std::string &, bool);
+
+	int del_pub(const std::string &);
+
+	int del_priv(const std::string &);
+
+	int del_id(const std::string &);
+
+	int compact();
+
+	const char *why()
+	{
+		return d_err.c_str();
+	}
+};
+
+
+}
+
+#endif
+
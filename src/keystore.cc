@@ -20,10 +20,15 @@
 
 #include <string>
 #include <cstring>
+#include <ctime>
 #include <vector>
 #include <memory>
 #include <utility>
 #include <algorithm>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -48,32 +53,14 @@ extern "C" {
 #include "keystore.h"
 #include "config.h"
 #include "misc.h"
+#include "dhtab.h"
+#include "numbers.h"
 
 namespace opmsg {
 
 using namespace std;
 
 
-static int mkdir_helper(const string &base, string &result)
-{
-	char unique[256];
-	timeval tv;
-
-	result = "";
-
-	gettimeofday(&tv, NULL);
-	snprintf(unique, sizeof(unique), "/%zx.%zx.%d", (size_t)tv.tv_sec, (size_t)tv.tv_usec, getpid());
-
-	string file = base + string(unique);
-
-	if (mkdir(file.c_str(), 0700) < 0)
-		return -1;
-
-	result = file;
-	return 0;
-}
-
-
 static int bn2hexhash(const EVP_MD *mdtype, const BIGNUM *bn, string &result)
 {
 	result = "";
@@ -93,7 +80,7 @@ static int bn2hexhash(const EVP_MD *mdtype, const BIGNUM *bn, string &result)
 		return -1;
 	BN_bn2bin(bn, bin.get());
 
-	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(EVP_MD_CTX_create(), EVP_MD_CTX_delete);
+	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(md_ctx_new(), md_ctx_free);
 	if (!md_ctx.get())
 		return -1;
 	if (EVP_DigestInit_ex(md_ctx.get(), mdtype, nullptr) != 1)
@@ -134,7 +121,7 @@ int normalize_and_hexhash(const EVP_MD *mdtype, string &s, string &result)
 	// one single newline after we truncated anything after end-marker which does not contain \n
 	s += "\n";
 
-	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(EVP_MD_CTX_create(), EVP_MD_CTX_delete);
+	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(md_ctx_new(), md_ctx_free);
 	if (!md_ctx.get())
 		return -1;
 	if (EVP_DigestInit_ex(md_ctx.get(), mdtype, nullptr) != 1)
@@ -165,6 +152,76 @@ static int key_cb(int a1, int a2, BN_GENCB *a3)
 }
 
 
+struct gen_racer {
+	std::atomic<int> *winner;
+	int idx;
+};
+
+
+// abort the search if another thread already won. Only the first racer shows progress
+static int race_cb(int a1, int a2, BN_GENCB *a3)
+{
+#if HAVE_BN_GENCB_NEW
+	gen_racer *r = static_cast<gen_racer *>(BN_GENCB_get_arg(a3));
+#else
+	gen_racer *r = static_cast<gen_racer *>(a3->arg);
+#endif
+	if (*r->winner >= 0)
+		return 0;
+	if (r->idx == 0)
+		return key_cb(a1, a2, a3);
+	return 1;
+}
+
+
+/* Run gen() in as many threads as we have cores, each with its own BN_GENCB.
+ * Candidate searches race against each other and the first one returning 1
+ * wins; the others are aborted through their callback. Each thread uses its own
+ * RNG stream of libcrypto. Returns the index of the winning thread or -1.
+ */
+static int gen_race(const function<int(unsigned int, BN_GENCB *)> &gen)
+{
+	unsigned int n = max_threads();
+	atomic<int> winner{-1};
+	vector<gen_racer> racers(n);
+
+	auto worker = [&](unsigned int i) {
+		BN_GENCB *cb_ptr = nullptr;
+
+// In OpenSSL 1.1.0, static decl of BN_GENCB disappeared and before BN_GENCB_new was not there!
+#if HAVE_BN_GENCB_NEW
+		unique_ptr<BN_GENCB, BN_GENCB_del> cb(BN_GENCB_new(), BN_GENCB_free);
+		if (!(cb_ptr = cb.get()))
+			return;
+#else
+		BN_GENCB cb_s;
+		cb_ptr = &cb_s;
+#endif
+		racers[i].winner = &winner;
+		racers[i].idx = i;
+		BN_GENCB_set(cb_ptr, race_cb, &racers[i]);
+
+		if (gen(i, cb_ptr) == 1) {
+			int none = -1;
+			winner.compare_exchange_strong(none, i);
+		}
+	};
+
+	vector<thread> workers;
+	for (unsigned int i = 1; i < n; ++i)
+		workers.push_back(thread(worker, i));
+	worker(0);
+	for (auto &t : workers)
+		t.join();
+
+	// aborted searches of the main thread leave errors behind
+	if (winner != 0)
+		ERR_clear_error();
+
+	return winner;
+}
+
+
 int keystore::load(const string &hex, uint32_t how)
 {
 	if (hex.size() > 0) {
@@ -179,7 +236,7 @@ int keystore::load(const string &hex, uint32_t how)
 		if (d_personas.count(hex) > 0)
 			return 0;
 
-		unique_ptr<persona> p(new (nothrow) persona(d_cfgbase, hex));
+		unique_ptr<persona> p(new (nothrow) persona(d_store, hex));
 		if (!p.get())
 			return build_error("keystore::load:: OOM", -1);
 		if (p->load("", how) < 0)
@@ -189,19 +246,18 @@ int keystore::load(const string &hex, uint32_t how)
 	}
 
 	persona *p = nullptr;
-	string dhex = "";
 
-	DIR *d = opendir(d_cfgbase.c_str());
-	if (!d)
-		return build_error("load::opendir:", -1);
+	// a short id only needs to look into its own shard
+	vector<string> ids;
+	if (d_store->personas(ids, hex) < 0) {
+		errno = 0;
+		return build_error("load::" + string(d_store->why()), -1);
+	}
 
-	dirent *de = nullptr;
-	for (;;) {
-		if ((de = readdir(d)) == nullptr)
-			break;
-		dhex = de->d_name;
-		if (!is_hex_hash(dhex))
-			continue;
+	if (hex.empty())
+		return load_all(ids, how);
+
+	for (const string &dhex : ids) {
 
 		// short id form as a filter given?
 		if (hex.size() == 16 && dhex.find(hex) != 0)
@@ -210,7 +266,7 @@ int keystore::load(const string &hex, uint32_t how)
 		if (d_personas.count(dhex) > 0)
 			continue;
 
-		p = new (nothrow) persona(d_cfgbase, dhex);
+		p = new (nothrow) persona(d_store, dhex);
 		if (!p)
 			break;
 
@@ -225,27 +281,323 @@ int keystore::load(const string &hex, uint32_t how)
 		if (hex.size() == 16)
 			break;
 	}
-	closedir(d);
 
 	errno = 0;
 	return 0;
 }
 
 
-/* global version, as its needed by persona and keystore class */
-int gen_ec(string &pub, string &priv, int nid, string &err)
+/* Load all personas of ids which are not yet loaded. Personas are independent of
+ * each other, so each thread picks the next id and parses it into its own slot.
+ * The results are merged in id order afterwards. As with single loads, personas
+ * that fail to load are skipped.
+ */
+int keystore::load_all(const vector<string> &ids, uint32_t how)
+{
+	vector<persona *> loaded(ids.size(), nullptr);
+
+	unsigned int nthreads = max_threads();
+	if (nthreads > ids.size())
+		nthreads = ids.size();
+
+	atomic<size_t> next{0};
+
+	auto worker = [&]{
+		for (size_t i = next++; i < ids.size(); i = next++) {
+			if (d_personas.count(ids[i]) > 0)
+				continue;
+
+			persona *p = new (nothrow) persona(d_store, ids[i]);
+			if (!p)
+				continue;
+
+			d_store->busy(ids[i], 1);
+			int r = p->load("", how);
+			d_store->busy(ids[i], 0);
+
+			// might have stale DH keys or so, so dont abort on -1
+			if (r < 0) {
+				delete p;
+				continue;
+			}
+			loaded[i] = p;
+		}
+	};
+
+	vector<thread> workers;
+	for (unsigned int i = 1; i < nthreads; ++i)
+		workers.push_back(thread(worker));
+	worker();
+	for (auto &t : workers)
+		t.join();
+
+	for (size_t i = 0; i < ids.size(); ++i) {
+		if (loaded[i])
+			d_personas[ids[i]] = loaded[i];
+	}
+
+	errno = 0;
+	return 0;
+}
+
+
+// RFC 7919 group name to NID, NID_undef if unknown or not supported by libcrypto
+int dh_group_nid(const string &name)
+{
+#ifdef NID_ffdhe2048
+	if (name == "ffdhe2048")
+		return NID_ffdhe2048;
+	else if (name == "ffdhe3072")
+		return NID_ffdhe3072;
+	else if (name == "ffdhe4096")
+		return NID_ffdhe4096;
+	else if (name == "ffdhe6144")
+		return NID_ffdhe6144;
+	else if (name == "ffdhe8192")
+		return NID_ffdhe8192;
+#endif
+	return NID_undef;
+}
+
+
+// NID of the named group whose p and g match the ones of dh, or NID_undef
+int dh_group_nid(const DH *dh)
+{
+#ifdef NID_ffdhe2048
+	return DH_get_nid(dh);
+#else
+	return NID_undef;
+#endif
+}
+
+
+/* Returns a fresh copy of the params of a named group. Named groups are fixed
+ * and known to be good, so they are created once per process and dont need
+ * DH_check().
+ */
+DH *dh_group_params(int nid)
+{
+#ifdef NID_ffdhe2048
+	static mutex mtx;
+	static map<int, DH *> groups;
+
+	lock_guard<mutex> guard(mtx);
+
+	auto it = groups.find(nid);
+	if (it == groups.end()) {
+		DH *dh = DH_new_by_nid(nid);
+		if (!dh)
+			return nullptr;
+		it = groups.insert(make_pair(nid, dh)).first;
+	}
+	return DHparams_dup(it->second);
+#else
+	return nullptr;
+#endif
+}
+
+
+/* The curves dont change during a run, so each EC_GROUP is built once, along with
+ * the precomputed multiples of its generator, and then shared by keygen and kex.
+ * Returns nullptr if the curve is unknown.
+ */
+const EC_GROUP *ec_group(int nid)
+{
+	static mutex mtx;
+	static map<int, EC_GROUP *> groups;
+
+	lock_guard<mutex> guard(mtx);
+
+	auto it = groups.find(nid);
+	if (it != groups.end())
+		return it->second;
+
+	EC_GROUP *grp = EC_GROUP_new_by_curve_name(nid);
+	if (!grp)
+		return nullptr;
+	if (EC_GROUP_precompute_mult(grp, nullptr) != 1)
+		ERR_clear_error();	// only an optimization
+	groups[nid] = grp;
+	return grp;
+}
+
+
+// X25519 and X448 kex keys; curve NIDs equal their EVP_PKEY types
+bool is_xdh(int nid)
+{
+#ifdef HAVE_X25519
+	return nid == NID_X25519 || nid == NID_X448;
+#else
+	return false;
+#endif
+}
+
+
+#ifdef HAVE_X25519
+
+// keys of the types that only exist via the raw key API: X25519, X448, Ed25519, Ed448
+static int gen_raw(string &pub, string &priv, int nid, string &err, EVP_PKEY **evp_pub, EVP_PKEY **evp_priv)
+{
+	char *ptr = nullptr;
+
+	unique_ptr<EVP_PKEY_CTX, EVP_PKEY_CTX_del> ctx(EVP_PKEY_CTX_new_id(nid, nullptr), EVP_PKEY_CTX_free);
+	if (!ctx.get() || EVP_PKEY_keygen_init(ctx.get()) != 1) {
+		err += build_error("gen_raw::EVP_PKEY_keygen_init:");
+		return -1;
+	}
+
+	EVP_PKEY *key = nullptr;
+	if (EVP_PKEY_keygen(ctx.get(), &key) != 1) {
+		err += build_error("gen_raw::EVP_PKEY_keygen:");
+		return -1;
+	}
+	unique_ptr<EVP_PKEY, EVP_PKEY_del> evp(key, EVP_PKEY_free);
+
+	unique_ptr<BIO, BIO_del> bio(BIO_new(BIO_s_mem()), BIO_free);
+	if (!bio.get()) {
+		err += build_error("gen_raw: OOM");
+		return -1;
+	}
+	if (PEM_write_bio_PUBKEY(bio.get(), evp.get()) != 1) {
+		err += build_error("gen_raw::PEM_write_bio_PUBKEY: Error generating key");
+		return -1;
+	}
+	long l = BIO_get_mem_data(bio.get(), &ptr);
+	pub = string(ptr, l);
+
+	bio.reset(BIO_new(BIO_s_mem()));
+	if (!bio.get()) {
+		err += build_error("gen_raw::BIO_new: OOM");
+		return -1;
+	}
+	if (PEM_write_bio_PrivateKey(bio.get(), evp.get(), nullptr, nullptr, 0, nullptr, nullptr) != 1) {
+		err += build_error("gen_raw::PEM_write_bio_PrivateKey: Error generating key");
+		return -1;
+	}
+	l = BIO_get_mem_data(bio.get(), &ptr);
+	priv = string(ptr, l);
+
+	if (evp_pub) {
+		unsigned char raw[64];
+		size_t rawlen = sizeof(raw);
+		if (EVP_PKEY_get_raw_public_key(evp.get(), raw, &rawlen) != 1 ||
+		    !(*evp_pub = EVP_PKEY_new_raw_public_key(nid, nullptr, raw, rawlen))) {
+			err += build_error("gen_raw::EVP_PKEY_new_raw_public_key:");
+			return -1;
+		}
+	}
+	if (evp_priv)
+		*evp_priv = evp.release();
+
+	return 0;
+}
+
+
+/* Map an Ed25519/Ed448 key to the X25519/X448 key of the same secret, so that Ed personas
+ * can do the ECDH fallback kex like EC personas do with their persona key. The public key
+ * is mapped via the birational maps of RFC 7748, u = (1 + y)/(1 - y) for edwards25519 and
+ * u = y^2 * (1 - d*y^2)/(1 - y^2) for edwards448. The private key is the (unclamped) scalar
+ * derived from the Ed seed as per RFC 8032; X25519/X448 clamp it the same way.
+ */
+static EVP_PKEY *ed2x(EVP_PKEY *ed, bool priv)
+{
+	int type = EVP_PKEY_base_id(ed);
+	if (type != EVP_PKEY_ED25519 && type != EVP_PKEY_ED448)
+		return nullptr;
+
+	bool is448 = (type == EVP_PKEY_ED448);
+	size_t xlen = is448 ? 56 : 32;
+	unsigned char raw[114];
+	size_t rawlen = sizeof(raw);
+
+	if (priv) {
+		if (EVP_PKEY_get_raw_private_key(ed, raw, &rawlen) != 1)
+			return nullptr;
+		unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(md_ctx_new(), md_ctx_free);
+		unsigned char h[114];
+		unsigned int hlen = 0;
+		if (!md_ctx.get() || EVP_DigestInit_ex(md_ctx.get(), is448 ? EVP_shake256() : EVP_sha512(), nullptr) != 1 ||
+		    EVP_DigestUpdate(md_ctx.get(), raw, rawlen) != 1)
+			return nullptr;
+		if (is448) {
+			if (EVP_DigestFinalXOF(md_ctx.get(), h, sizeof(h)) != 1)
+				return nullptr;
+		} else if (EVP_DigestFinal_ex(md_ctx.get(), h, &hlen) != 1)
+			return nullptr;
+		EVP_PKEY *x = EVP_PKEY_new_raw_private_key(is448 ? EVP_PKEY_X448 : EVP_PKEY_X25519, nullptr, h, xlen);
+		OPENSSL_cleanse(h, sizeof(h));
+		OPENSSL_cleanse(raw, sizeof(raw));
+		return x;
+	}
+
+	if (EVP_PKEY_get_raw_public_key(ed, raw, &rawlen) != 1 || rawlen < xlen)
+		return nullptr;
+	if (!is448)
+		raw[31] &= 0x7f;	// sign of x
+
+	unique_ptr<BN_CTX, BN_CTX_del> bctx(BN_CTX_new(), BN_CTX_free);
+	unique_ptr<BIGNUM, BIGNUM_del> p(BN_new(), BN_free), y(BN_lebin2bn(raw, xlen, nullptr), BN_free);
+	unique_ptr<BIGNUM, BIGNUM_del> num(BN_new(), BN_free), den(BN_new(), BN_free), one(BN_new(), BN_free);
+	if (!bctx.get() || !p.get() || !y.get() || !num.get() || !den.get() || !one.get())
+		return nullptr;
+
+	BN_one(one.get());
+	BN_set_bit(p.get(), is448 ? 448 : 255);
+	if (is448) {
+		// p = 2^448 - 2^224 - 1, d = -39081
+		unique_ptr<BIGNUM, BIGNUM_del> t(BN_new(), BN_free), y2(BN_new(), BN_free);
+		if (!t.get() || !y2.get())
+			return nullptr;
+		BN_set_bit(t.get(), 224);
+		BN_sub(p.get(), p.get(), t.get());
+		BN_sub(p.get(), p.get(), one.get());
+		BN_mod_sqr(y2.get(), y.get(), p.get(), bctx.get());
+		// num = y^2 * (1 + 39081*y^2), den = 1 - y^2
+		BN_copy(t.get(), y2.get());
+		BN_mul_word(t.get(), 39081);
+		BN_add(t.get(), t.get(), one.get());
+		BN_mod_mul(num.get(), y2.get(), t.get(), p.get(), bctx.get());
+		BN_mod_sub(den.get(), one.get(), y2.get(), p.get(), bctx.get());
+	} else {
+		// p = 2^255 - 19
+		BN_sub_word(p.get(), 19);
+		BN_mod_add(num.get(), one.get(), y.get(), p.get(), bctx.get());
+		BN_mod_sub(den.get(), one.get(), y.get(), p.get(), bctx.get());
+	}
+	if (!BN_mod_inverse(den.get(), den.get(), p.get(), bctx.get()) ||
+	    BN_mod_mul(num.get(), num.get(), den.get(), p.get(), bctx.get()) != 1)
+		return nullptr;
+
+	unsigned char u[56];
+	if (BN_bn2lebinpad(num.get(), u, xlen) != (int)xlen)
+		return nullptr;
+	return EVP_PKEY_new_raw_public_key(is448 ? EVP_PKEY_X448 : EVP_PKEY_X25519, nullptr, u, xlen);
+}
+
+#endif
+
+
+/* global version, as its needed by persona and keystore class. If evp_pub/evp_priv
+ * are given, they receive the generated keys, so callers dont need to parse the PEMs.
+ */
+int gen_ec(string &pub, string &priv, int nid, string &err, EVP_PKEY **evp_pub = nullptr, EVP_PKEY **evp_priv = nullptr)
 {
 	char *ptr = nullptr;
 
 	pub = "";
 	priv = "";
 
-	if (RAND_load_file("/dev/urandom", 256) != 256)
-		RAND_load_file("/dev/random", 8);
+	seed_rand();
+
+#ifdef HAVE_X25519
+	if (is_xdh(nid))
+		return gen_raw(pub, priv, nid, err, evp_pub, evp_priv);
+#endif
 
-	unique_ptr<EC_KEY, EC_KEY_del> eckey(EC_KEY_new_by_curve_name(nid), EC_KEY_free);
-	if (!eckey.get()) {
-		err += build_error("gen_ec::EC_KEY_new_by_curve_name:");
+	const EC_GROUP *grp = ec_group(nid);
+	unique_ptr<EC_KEY, EC_KEY_del> eckey(EC_KEY_new(), EC_KEY_free);
+	if (!grp || !eckey.get() || EC_KEY_set_group(eckey.get(), grp) != 1) {
+		err += build_error("gen_ec::EC_KEY_set_group:");
 		return -1;
 	}
 
@@ -297,51 +649,116 @@ int gen_ec(string &pub, string &priv, int nid, string &err)
 	l = BIO_get_mem_data(bio.get(), &ptr);
 	priv = string(ptr, l);
 
+	// public-only copy for the PKEYbox, as it would have been read from dh.pub.pem
+	if (evp_pub) {
+		unique_ptr<EC_KEY, EC_KEY_del> pubkey(EC_KEY_new(), EC_KEY_free);
+		unique_ptr<EVP_PKEY, EVP_PKEY_del> evp2(EVP_PKEY_new(), EVP_PKEY_free);
+		if (!pubkey.get() || !evp2.get() || EC_KEY_set_group(pubkey.get(), grp) != 1 ||
+		    EC_KEY_set_public_key(pubkey.get(), EC_KEY_get0_public_key(eckey.get())) != 1 ||
+		    EVP_PKEY_set1_EC_KEY(evp2.get(), pubkey.get()) != 1) {
+			err += build_error("gen_ec::EC_KEY_set_public_key: Error generating EC key");
+			return -1;
+		}
+		*evp_pub = evp2.release();
+	}
+	if (evp_priv)
+		*evp_priv = evp.release();
+
 	return 0;
 }
 
 
 int keystore::gen_ec(string &pub, string &priv, int nid)
 {
+	// persona keys need to sign
+	if (is_xdh(nid))
+		return build_error("gen_ec: X25519/X448 are kex-only curves.", -1);
+
 	d_err = "keystore::";
 	return opmsg::gen_ec(pub, priv, nid, d_err);
 }
 
 
+int keystore::gen_ed(string &pub, string &priv, const string &type)
+{
+#ifdef HAVE_X25519
+	d_err = "keystore::";
+	seed_rand();
+	if (type == marker::ed25519)
+		return gen_raw(pub, priv, EVP_PKEY_ED25519, d_err, nullptr, nullptr);
+	else if (type == marker::ed448)
+		return gen_raw(pub, priv, EVP_PKEY_ED448, d_err, nullptr, nullptr);
+#endif
+	return build_error("gen_ed: Unsupported Ed key type " + type, -1);
+}
+
+
+#ifdef HAVE_RSA_MULTIPRIME
+
+// max number of RSA primes for a modulus size, same limits as libcrypto applies
+static int rsa_max_primes(int bits)
+{
+	if (bits < 1024)
+		return 2;
+	else if (bits < 4096)
+		return 3;
+	else if (bits < 8192)
+		return 4;
+	return MAX_RSA_PRIMES;
+}
+
+#endif
+
+
 int keystore::gen_rsa(string &pub, string &priv)
 {
 	BIGNUM *b = nullptr;
-	BN_GENCB *cb_ptr = nullptr;
 	char *ptr = nullptr;
 
 	pub = "";
 	priv = "";
 
-	if (RAND_load_file("/dev/urandom", 256) != 256)
-		RAND_load_file("/dev/random", 8);
+	seed_rand();
 
 	unique_ptr<BIGNUM, BIGNUM_del> e(nullptr, BN_free);
 	if (BN_dec2bn(&b, config::rsa_e.c_str()) == 0)
 		return build_error("gen_rsa::BN_dec2b: Error generating RSA key", -1);
 	e.reset(b);
 
-// In OpenSSL 1.1.0, static decl of BN_GENCB disappeared and before BN_GENCB_new was not there!
-#if HAVE_BN_GENCB_NEW
-	unique_ptr<BN_GENCB, BN_GENCB_del> cb(BN_GENCB_new(), BN_GENCB_free);
-	if (!(cb_ptr = cb.get()))
-		return build_error("gen_rsa: OOM", -1);
+	// More primes make the CRT private key operation cheaper
+	int primes = config::rsa_primes;
+	if (primes > 2) {
+#ifdef HAVE_RSA_MULTIPRIME
+		if (primes > rsa_max_primes(config::rsa_len)) {
+			errno = 0;
+			return build_error("gen_rsa: Too many RSA primes for key length.", -1);
+		}
 #else
-	BN_GENCB cb_s;
-	cb_ptr = &cb_s;
+		errno = 0;
+		return build_error("gen_rsa: Multi-prime RSA not supported by libcrypto.", -1);
 #endif
-	BN_GENCB_set(cb_ptr, key_cb, nullptr);
+	}
+
+	vector<unique_ptr<RSA, RSA_del>> rsas;
+	for (unsigned int i = 0; i < max_threads(); ++i) {
+		rsas.emplace_back(RSA_new(), RSA_free);
+		if (!rsas[i].get())
+			return build_error("gen_rsa::RSA_new: OOM", -1);
+	}
 
-	unique_ptr<RSA, RSA_del> rsa(RSA_new(), RSA_free);
-	if (!rsa.get())
-		return build_error("gen_rsa::RSA_ne: OOM", -1);
-	if (RSA_generate_key_ex(rsa.get(), config::rsa_len, e.get(), cb_ptr) != 1)
+	int w = gen_race([&](unsigned int i, BN_GENCB *cb_ptr) -> int {
+#ifdef HAVE_RSA_MULTIPRIME
+		if (primes > 2)
+			return RSA_generate_multi_prime_key(rsas[i].get(), config::rsa_len, primes, e.get(), cb_ptr);
+#endif
+		return RSA_generate_key_ex(rsas[i].get(), config::rsa_len, e.get(), cb_ptr);
+	});
+	if (w < 0)
 		return build_error("gen_rsa::RSA_generate_key_ex: Error generating RSA key", -1);
 
+	unique_ptr<RSA, RSA_del> rsa(rsas[w].release(), RSA_free);
+	rsas.clear();
+
 	unique_ptr<EVP_PKEY, EVP_PKEY_del> evp(EVP_PKEY_new(), EVP_PKEY_free);
 	unique_ptr<BIO, BIO_del> bio(BIO_new(BIO_s_mem()), BIO_free);
 	if (!evp.get() || !bio.get())
@@ -378,10 +795,10 @@ persona *keystore::find_persona(const std::string &hex)
 
 	// try to find 64bit shortcuts
 	if (hex.size() == 16) {
-		for (auto i : d_personas) {
-			if (i.first.find(hex) == 0)
-				return i.second;
-		}
+		bin_id prefix(hex);
+		auto i = d_personas.lower_bound(prefix);
+		if (i != d_personas.end() && i->first.has_prefix(prefix))
+			return i->second;
 	}
 
 	auto i = d_personas.find(hex);
@@ -391,11 +808,28 @@ persona *keystore::find_persona(const std::string &hex)
 }
 
 
+// persona type marker for a persona key
+static string persona_type(EVP_PKEY *evp)
+{
+	switch (EVP_PKEY_base_id(evp)) {
+	case EVP_PKEY_EC:
+		return marker::ec;
+	case EVP_PKEY_RSA:
+		return marker::rsa;
+#ifdef HAVE_X25519
+	case EVP_PKEY_ED25519:
+		return marker::ed25519;
+	case EVP_PKEY_ED448:
+		return marker::ed448;
+#endif
+	}
+	return marker::unknown;
+}
+
+
 // new persona
 persona *keystore::add_persona(const string &name, const string &c_pub_pem, const string &priv_pem, const string &dhparams_pem)
 {
-	int fd = -1;
-
 	string type1 = marker::unknown, type2 = marker::unknown;
 
 	// create hash (hex view) of public part and use as a reference
@@ -404,20 +838,11 @@ persona *keystore::add_persona(const string &name, const string &c_pub_pem, cons
 	if (normalize_and_hexhash(d_md, pub_pem, hex) < 0)
 		return build_error("add_persona: Invalid pubkey blob. Missing BEGIN/END markers?", nullptr);
 
-	string tmpdir;
-	if (mkdir_helper(d_cfgbase, tmpdir) < 0)
-		return build_error("add_persona::mkdir:", nullptr);
-
-	if (name.size() > 0) {
-		string nfile = tmpdir + "/name";
-		if ((fd = open(nfile.c_str(), O_CREAT|O_RDWR|O_EXCL, 0600)) < 0)
-			return build_error("add_persona::open:", nullptr);
-		if (write(fd, name.c_str(), name.size()) < 0)
-			return build_error("add_persona::write:", nullptr);
-		if (write(fd, "\n", 1) != 1)
-			return build_error("add_persona::write:", nullptr);;
-		close(fd);
-	}
+	// all files of the new persona, stored at once
+	map<string, string> files;
+
+	if (name.size() > 0)
+		files["name"] = name + "\n";
 
 	unique_ptr<EVP_PKEY, EVP_PKEY_del> evp_pub(nullptr, EVP_PKEY_free);
 	if (pub_pem.size() > 0) {
@@ -430,19 +855,10 @@ persona *keystore::add_persona(const string &name, const string &c_pub_pem, cons
 		if (!evp_pub.get())
 			return build_error("add_persona::PEM_read_bio_PUBKEY: Error reading PEM key", nullptr);
 
-		if (EVP_PKEY_base_id(evp_pub.get()) == EVP_PKEY_EC)
-			type1 = marker::ec;
-		else if (EVP_PKEY_base_id(evp_pub.get()) == EVP_PKEY_RSA)
-			type1 = marker::rsa;
-		else
+		if ((type1 = persona_type(evp_pub.get())) == marker::unknown)
 			return build_error("add_persona: Unknown persona type.", nullptr);
 
-		string rfile = tmpdir + "/" + type1 + ".pub.pem";
-		if ((fd = open(rfile.c_str(), O_CREAT|O_RDWR|O_EXCL, 0600)) < 0)
-			return build_error("add_persona::open:", nullptr);
-		if (write(fd, pub_pem.c_str(), pub_pem.size()) < 0)
-			return build_error("add_persona::write:", nullptr);
-		close(fd);
+		files[type1 + ".pub.pem"] = pub_pem;
 	}
 
 	unique_ptr<EVP_PKEY, EVP_PKEY_del> evp_priv(nullptr, EVP_PKEY_free);
@@ -456,36 +872,21 @@ persona *keystore::add_persona(const string &name, const string &c_pub_pem, cons
 		if (!evp_priv.get())
 			return build_error("add_persona::PEM_read_bio_PrivateKey: Error reading PEM key", nullptr);
 
-		if (EVP_PKEY_base_id(evp_priv.get()) == EVP_PKEY_EC)
-			type2 = marker::ec;
-		else if (EVP_PKEY_base_id(evp_priv.get()) == EVP_PKEY_RSA)
-			type2 = marker::rsa;
-		else
+		if ((type2 = persona_type(evp_priv.get())) == marker::unknown)
 			return build_error("add_persona: Unknown persona type.", nullptr);
 
 		if (type1 != marker::unknown && type1 != type2)
 			return build_error("add_persona: Different persona keytypes " + type1 + " vs. " + type2, nullptr);
 
-		string rfile = tmpdir + "/" + type2 + ".priv.pem";
-		if ((fd = open(rfile.c_str(), O_CREAT|O_RDWR|O_EXCL, 0600)) < 0)
-			return build_error("add_persona::open:", nullptr);
-		if (write(fd, priv_pem.c_str(), priv_pem.size()) < 0)
-			return build_error("add_persona::write:", nullptr);
-		close(fd);
+		files[type2 + ".priv.pem"] = priv_pem;
 	}
 
-	string hexdir = d_cfgbase + "/" + hex;
-	if (rename(tmpdir.c_str(), hexdir.c_str()) < 0) {
-		int saved_errno = errno;
-		unlink(string(tmpdir + "/" + type1 + ".priv.pem").c_str());
-		unlink(string(tmpdir + "/" + type1 + ".pub.pem").c_str());
-		unlink(string(tmpdir + "/name").c_str());
-		rmdir(tmpdir.c_str());
-		errno = saved_errno;
-		return build_error("add_persona::rename: Error creating persona " + hex, nullptr);
+	if (d_store->add_persona(hex, files) < 0) {
+		errno = 0;
+		return build_error("add_persona::" + string(d_store->why()), nullptr);
 	}
 
-	unique_ptr<persona> p(new (nothrow) persona(d_cfgbase, hex, name));
+	unique_ptr<persona> p(new (nothrow) persona(d_store, hex, name));
 	if (!p.get())
 		return build_error("add_persona::OOM", nullptr);
 
@@ -496,7 +897,10 @@ persona *keystore::add_persona(const string &name, const string &c_pub_pem, cons
 
 	if (dhparams_pem.size() > 0 && type1 == marker::rsa) {
 		if (dhparams_pem == "new") {
-			if (p->new_dh_params() == nullptr)
+			if (config::dh_group.size() > 0) {
+				if (p->new_dh_group(config::dh_group) == nullptr)
+					return build_error(p->why(), nullptr);
+			} else if (p->new_dh_params() == nullptr)
 				return build_error(p->why(), nullptr);
 		} else if (p->new_dh_params(dhparams_pem) == nullptr)
 			return build_error(p->why(), nullptr);
@@ -508,19 +912,30 @@ persona *keystore::add_persona(const string &name, const string &c_pub_pem, cons
 }
 
 
-map<string, persona *>::iterator keystore::first_pers()
+// move the keystore into the sharded layout, if configured
+int keystore::shard()
+{
+	if (d_store->shard() < 0) {
+		errno = 0;
+		return build_error("shard::" + string(d_store->why()), -1);
+	}
+	return 0;
+}
+
+
+id_map<persona *>::iterator keystore::first_pers()
 {
 	return d_personas.begin();
 }
 
 
-map<string, persona *>::iterator keystore::end_pers()
+id_map<persona *>::iterator keystore::end_pers()
 {
 	return d_personas.end();
 }
 
 
-map<string, persona *>::iterator keystore::next_pers(const map<string, persona *>::iterator &it)
+id_map<persona *>::iterator keystore::next_pers(const id_map<persona *>::iterator &it)
 {
 	auto it2 = it;
 	return ++it2;
@@ -537,6 +952,25 @@ vector<PKEYbox *> persona::find_dh_key(const string &hex)
 		return v;
 	}
 
+#ifdef HAVE_X25519
+	// Ed personas use the X25519/X448 equivalent of their persona key
+	if (hex == marker::ec_kex_id && (d_ptype == marker::ed25519 || d_ptype == marker::ed448) && d_pkey) {
+		if (!d_xkey) {
+			unique_ptr<EVP_PKEY, EVP_PKEY_del> xpub(ed2x(d_pkey->d_pub, 0), EVP_PKEY_free), xpriv(nullptr, EVP_PKEY_free);
+			if (d_pkey->d_priv)
+				xpriv.reset(ed2x(d_pkey->d_priv, 1));
+			if (!xpub.get() || (d_pkey->d_priv && !xpriv.get()))
+				return build_error("find_dh_key: Cannot convert Ed key.", v);
+			if (!(d_xkey = new (nothrow) PKEYbox(xpub.get(), xpriv.get())))
+				return build_error("find_dh_key: OOM", v);
+			xpub.release();
+			xpriv.release();
+		}
+		v.push_back(d_xkey);
+		return v;
+	}
+#endif
+
 	auto i = d_keys.find(hex);
 	if (i == d_keys.end())
 		return build_error("find_dh_key: No such key.", v);
@@ -544,135 +978,375 @@ vector<PKEYbox *> persona::find_dh_key(const string &hex)
 }
 
 
-map<string, vector<PKEYbox *>>::iterator persona::first_key()
+id_map<vector<PKEYbox *>>::iterator persona::first_key()
 {
 	return d_keys.begin();
 }
 
 
-map<string, vector<PKEYbox *>>::iterator persona::end_key()
+id_map<vector<PKEYbox *>>::iterator persona::end_key()
 {
 	return d_keys.end();
 }
 
 
-map<string, vector<PKEYbox *>>::iterator persona::next_key(const map<string, vector<PKEYbox *>>::iterator &it)
+id_map<vector<PKEYbox *>>::iterator persona::next_key(const id_map<vector<PKEYbox *>>::iterator &it)
 {
 	auto it2 = it;
 	return ++it2;
 }
 
 
-// only load certain DH key. Try to be as relaxed as possible about missing keys,
-// and try to get one part of pub/priv if possible.
-//
-// Note that 'dh' key can also be a EC_KEY for ECDH. Both, DH and EC keys are inside
-// the files named dh.{pub, priv}. This makes sense, as both keytypes are later used
-// for a DH Kex or ECDH Kex.
-//
-int persona::load_dh(const string &hex)
+extern "C" typedef void (*vector_pkeybox_del)(vector<PKEYbox *> *);
+extern "C" void vector_pkeybox_free(vector<PKEYbox *> *v)
 {
-	size_t r = 0;
-	char buf[8192], *fr = nullptr;
+	for (auto it = v->begin(); it != v->end(); ++it)
+		delete *it;
+	delete v;
+}
 
-	if (!is_hex_hash(hex))
-		return build_error("load_dh: Not a valid (EC)DH hex id.", -1);
 
-	if (d_keys.count(hex) > 0)
-		return build_error("load_dh: This key was already loaded.", -1);
+static const string der_magic = "opmsg dercache 1\n";
 
-	string dhfile = "";
-	unique_ptr<FILE, FILE_del> f(nullptr, ffclose);
 
-	// up to 3 session keys per kex-id (kex-id is hexhash of first key)
-	for (int i = 0; i < 3; ++i) {
-		dhfile = "";
+// Parse a PEM key. With dercache, take the DER copy stored under the hash of the
+// PEM instead, which skips Base64 and PEM decoding. PEMs stay the source of truth:
+// if one changes, its hash no longer matches and it is parsed (and cached) anew.
+EVP_PKEY *persona::pem2key(const string &pem, bool priv)
+{
+	if (!config::dercache) {
+		unique_ptr<BIO, BIO_del> bio(BIO_new_mem_buf(const_cast<char *>(pem.c_str()), pem.size()), BIO_free);
+		if (!bio.get())
+			return nullptr;
+		return priv ? PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr) : PEM_read_bio_PUBKEY(bio.get(), nullptr, nullptr, nullptr);
+	}
 
-		// load public part of (EC)DH key
-		dhfile = d_cfgbase + "/" + d_id + "/" + hex;
-		if (i > 0) {
-			char s[32] = {0};
-			snprintf(s, sizeof(s), "/dh.pub.%d.pem", i);
-			dhfile += s;
-		} else
-			dhfile += "/dh.pub.pem";
+	// read cache once
+	if (!d_der_loaded) {
+		d_der_loaded = 1;
+		string blob = "";
+		if (d_store->get(d_id, "keys.der", blob) > 0 && blob.find(der_magic) == 0) {
+			// 64 hex digits of SHA256 plus 'p'riv or 'u'pub
+			char h[66];
+			int type = 0;
+			size_t len = 0;
+			for (string::size_type idx = der_magic.size(); idx < blob.size();) {
+				string::size_type nl = blob.find('\n', idx);
+				if (nl == string::npos)
+					break;
+				memset(h, 0, sizeof(h));
+				if (sscanf(blob.c_str() + idx, "%65[0-9a-fpu] %d %zu", h, &type, &len) != 3)
+					break;
+				if (strlen(h) != sizeof(h) - 1 || nl + 1 + len > blob.size())
+					break;
+				d_der[h] = make_pair(type, blob.substr(nl + 1, len));
+				idx = nl + 1 + len;
+			}
+		}
+	}
 
-		unique_ptr<PKEYbox> pbox(new (nothrow) PKEYbox(nullptr, nullptr));
-		if (!pbox.get())
-			return build_error("load_dh: OOM", -1);
-		pbox->d_hex = hex;
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen = 0;
+	string key = "";
+	if (EVP_Digest(pem.c_str(), pem.size(), md, &mdlen, fetch_md(EVP_sha256()), nullptr) != 1)
+		return nullptr;
+	blob2hex(string(reinterpret_cast<char *>(md), mdlen), key);
+	key += priv ? "p" : "u";
+
+	EVP_PKEY *evp = nullptr;
+	auto it = d_der.find(key);
+	if (it != d_der.end()) {
+		const unsigned char *ptr = reinterpret_cast<const unsigned char *>(it->second.second.c_str());
+		if (priv)
+			evp = d2i_PrivateKey(it->second.first, nullptr, &ptr, it->second.second.size());
+		else
+			evp = d2i_PUBKEY(nullptr, &ptr, it->second.second.size());
+		if (evp) {
+			d_der_used[key] = 1;
+			return evp;
+		}
 
-		f.reset(fopen(dhfile.c_str(), "r"));
+		// broken entry, replace it
+		ERR_clear_error();
+		d_der.erase(it);
+		d_der_dirty = 1;
+	}
 
-		// Do not optimize by leaving the for loop if we dont find a pubkey.
-		// We may nevertheless hold a priv key in case we send test messages to ourselfs.
+	unique_ptr<BIO, BIO_del> bio(BIO_new_mem_buf(const_cast<char *>(pem.c_str()), pem.size()), BIO_free);
+	if (!bio.get())
+		return nullptr;
+	if (!(evp = priv ? PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr) : PEM_read_bio_PUBKEY(bio.get(), nullptr, nullptr, nullptr)))
+		return nullptr;
+
+	unsigned char *der = nullptr;
+	int len = priv ? i2d_PrivateKey(evp, &der) : i2d_PUBKEY(evp, &der);
+	if (len > 0) {
+		d_der[key] = make_pair(EVP_PKEY_base_id(evp), string(reinterpret_cast<char *>(der), len));
+		d_der_used[key] = 1;
+		d_der_dirty = 1;
+	}
+	if (der) {
+		OPENSSL_cleanse(der, len > 0 ? len : 0);
+		OPENSSL_free(der);
+	}
+	ERR_clear_error();
+	return evp;
+}
 
-		do {
-			if (!f.get())
-				break;
-			if ((r = fread(buf, 1, sizeof(buf), f.get())) <= 0)
-				break;
-			rewind(f.get());
-			unique_ptr<EVP_PKEY, EVP_PKEY_del> evp(PEM_read_PUBKEY(f.get(), nullptr, nullptr, nullptr), EVP_PKEY_free);
-			if (!evp.get())
-				break;
-			pbox->d_pub = evp.release();
-			pbox->d_pub_pem = string(buf, r);
-		} while (0);
-
-		// now load private part, if available
-		dhfile = d_cfgbase + "/" + d_id + "/" + hex;
-		if (i > 0) {
-			char s[32] = {0};
-			snprintf(s, sizeof(s), "/dh.priv.%d.pem", i);
-			dhfile += s;
+
+// write back DER cache if it changed. After loading all keys of a persona, entries
+// of keys that are gone are dropped.
+void persona::der_sync(bool all)
+{
+	if (!config::dercache || !d_der_loaded)
+		return;
+
+	if (all) {
+		for (auto it = d_der.begin(); it != d_der.end();) {
+			if (d_der_used.count(it->first) == 0) {
+				OPENSSL_cleanse(&it->second.second[0], it->second.second.size());
+				it = d_der.erase(it);
+				d_der_dirty = 1;
+			} else
+				++it;
+		}
+	}
+
+	if (!d_der_dirty)
+		return;
+
+	string blob = der_magic;
+	for (auto &i : d_der)
+		blob += i.first + " " + to_string(i.second.first) + " " + to_string(i.second.second.size()) + "\n" + i.second.second;
+
+	// cache is optional, errors dont matter
+	d_store->put(d_id, "keys.der", blob);
+	OPENSSL_cleanse(&blob[0], blob.size());
+	d_der_dirty = 0;
+	ERR_clear_error();
+	errno = 0;
+}
+
+
+static const string imported_magic = "opmsg imported 1";
+
+
+// "<hex>:<time>" lines of the imported log. Entries of older versions have time 1.
+static void parse_imported(const string &content, vector<pair<bin_id, unsigned int>> &ids)
+{
+	string::size_type idx = 0, nl = 0;
+	for (; idx < content.size(); idx = nl + 1) {
+		if ((nl = content.find('\n', idx)) == string::npos)
+			nl = content.size();
+		if (content[idx] == '#')
+			continue;
+		string::size_type colon = content.find(':', idx);
+		if (colon != string::npos && colon < nl) {
+			string h = content.substr(idx, colon - idx);
+			unsigned int t = strtoul(content.substr(colon + 1, nl - colon - 1).c_str(), nullptr, 10);
+			if (is_hex_hash(h))
+				ids.push_back(make_pair(bin_id(h), t > 0 ? t : 1));
+		}
+	}
+}
+
+
+// width of the ids, number of records and offset of the first one from imported.idx header
+static bool parse_imported_hdr(const string &hdr, unsigned int &width, unsigned int &n, string::size_type &off)
+{
+	if (hdr.find(imported_magic + " ") != 0 || (off = hdr.find('\n')) == string::npos)
+		return 0;
+	++off;
+	return sscanf(hdr.c_str() + imported_magic.size(), "%u %u", &width, &n) == 2 && width > 0 && width <= MAX_ID_BYTES;
+}
+
+
+/* 1 if key hash hex was imported once, 0 if not. imported.idx is a header line
+ * followed by sorted records of <id><32bit time>. It is binary searched by ranged
+ * reads of one open file, so lookups dont need to read or parse it as a whole and
+ * a compaction meanwhile doesnt mix the old and new index.
+ */
+int persona::imported(const string &hex)
+{
+	bin_id id(hex);
+	if (d_imported.count(id) > 0)
+		return 1;
+
+	bool truncated = 0;
+
+	auto search = [&](off_t size, const storage::reader &rd) -> int {
+		string hdr = "", rec = "";
+		if (rd(0, 128, hdr) < 0)
+			return -1;
+
+		unsigned int width = 0, n = 0;
+		string::size_type off = 0;
+		if (!parse_imported_hdr(hdr, width, n, off) || width != id.size())
+			return 0;
+		if ((off_t)(off + (size_t)n*(width + 4)) > size) {
+			truncated = 1;
+			return -1;
+		}
+
+		for (unsigned int lo = 0, hi = n; lo < hi;) {
+			unsigned int mid = lo + (hi - lo)/2;
+			if (rd(off + (off_t)mid*(width + 4), width, rec) < 0)
+				return -1;
+			if (rec.size() != width) {
+				truncated = 1;
+				return -1;
+			}
+			int c = memcmp(id.data(), rec.c_str(), width);
+			if (c == 0)
+				return 1;
+			if (c < 0)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		return 0;
+	};
+
+	int r = d_store->get(d_id, "imported.idx", search);
+	if (truncated)
+		return build_error("imported: Truncated imported.idx", -1);
+	if (r < 0)
+		return store_error("imported", -1);
+	return r;
+}
+
+
+/* Merge the imported log into imported.idx and empty the log. Hashes older than
+ * config::imported_expire days are dropped; entries of older opmsg versions
+ * count as imported now. It all happens under the lock of the log, so concurrent
+ * imports or compactions dont lose entries. A crash in between only leaves them
+ * in both files.
+ */
+int persona::compact_imported()
+{
+	unsigned int now = time(nullptr), expire = 0;
+	if (config::imported_expire > 0 && now > 86400*config::imported_expire)
+		expire = now - 86400*config::imported_expire;
+
+	vector<pair<bin_id, unsigned int>> rest;
+
+	auto merge = [&](string &log) -> int {
+		string idx = "";
+		if (d_store->get(d_id, "imported.idx", idx) < 0)
+			return -1;
+
+		vector<pair<bin_id, unsigned int>> ids, logged;
+		unsigned int width = 0, n = 0;
+		string::size_type off = 0;
+		if (parse_imported_hdr(idx, width, n, off) && idx.size() >= off + (size_t)n*(width + 4)) {
+			for (unsigned int i = 0; i < n; ++i) {
+				const unsigned char *p = reinterpret_cast<const unsigned char *>(idx.c_str() + off + i*(width + 4));
+				ids.push_back(make_pair(bin_id(p, width), ((uint32_t)p[width]<<24)|((uint32_t)p[width + 1]<<16)|((uint32_t)p[width + 2]<<8)|(uint32_t)p[width + 3]));
+			}
 		} else
-			dhfile += "/dh.priv.pem";
+			width = 0;
+
+		parse_imported(log, logged);
+		if (width == 0 && logged.size() > 0)
+			width = logged[0].first.size();
+
+		// hashes of another size than those in the index stay in the log
+		log = "";
+		rest.clear();
+		for (auto &i : logged) {
+			if (i.first.size() != width) {
+				log += i.first.hex() + ":" + to_string(i.second) + "\n";
+				rest.push_back(i);
+			} else
+				ids.push_back(make_pair(i.first, i.second > 1 ? i.second : now));
+		}
 
-		f.reset(fopen(dhfile.c_str(), "r"));
-		do {
-			if (!f.get())
-				break;
-			if ((r = fread(buf, 1, sizeof(buf), f.get())) <= 0)
-				return build_error("load_dh::fread: invalid (EC)DH privkey " + hex, -1);
-			rewind(f.get());
-			unique_ptr<EVP_PKEY, EVP_PKEY_del> evp(PEM_read_PrivateKey(f.get(), nullptr, nullptr, nullptr), EVP_PKEY_free);
-			if (!evp.get())
-				return build_error("load_dh::PEM_read_PrivateKey: Error reading (EC)DH privkey " + hex, -1);
-			pbox->d_priv = evp.release();
-			pbox->d_priv_pem = string(buf, r);
-		} while (0);
-
-		if (pbox->d_pub || pbox->d_priv)
-			d_keys[hex].push_back(pbox.release());
-		else {
-			// this can happen, as we leave empty dir's for already imported (EC)DH keys, that
-			// are tried to be re-imported from old mails in opmsg versions before using "imported" file
-			if (i == 0) {
-				errno = 0;
-				return 0;
+		id_map<unsigned int> merged;
+		merged.assign(ids);
+
+		string recs = "";
+		n = 0;
+		for (auto i = merged.begin(); i != merged.end(); ++i) {
+			if (i->second < expire)
+				continue;
+			unsigned char t[4] = {(unsigned char)(i->second>>24), (unsigned char)(i->second>>16), (unsigned char)(i->second>>8), (unsigned char)i->second};
+			recs.append(reinterpret_cast<const char *>(i->first.data()), width);
+			recs.append(reinterpret_cast<const char *>(t), sizeof(t));
+			++n;
+		}
+		return d_store->put(d_id, "imported.idx", imported_magic + " " + to_string(width) + " " + to_string(n) + "\n" + recs);
+	};
+
+	if (d_store->update(d_id, "imported", merge) < 0)
+		return store_error("compact_imported", -1);
+
+	d_imported.assign(rest);
+	return 0;
+}
+
+
+// load (EC)DH keys of Kex id hex, or all of them if empty. Keys of other
+// Kex ids that fail to parse are skipped.
+int persona::load_kex(const string &hex)
+{
+	map<string, kex_data> kexes;
+	if (d_store->kex_load(d_id, kexes, hex) < 0)
+		return store_error("load_kex", -1);
+
+	for (auto &it : kexes) {
+		const string &h = it.first;
+		kex_data &k = it.second;
+		if (!is_hex_hash(h) || d_keys.count(h) > 0)
+			continue;
+
+		unique_ptr<vector<PKEYbox *>, vector_pkeybox_del> pboxes(new (nothrow) vector<PKEYbox *>, vector_pkeybox_free);
+		if (!pboxes.get())
+			return build_error("load_kex: OOM", -1);
+
+		bool bad = 0;
+		for (unsigned int i = 0; i < 3 && (i < k.pub.size() || i < k.priv.size()); ++i) {
+			unique_ptr<PKEYbox> pbox(new (nothrow) PKEYbox(nullptr, nullptr));
+			if (!pbox.get())
+				return build_error("load_kex: OOM", -1);
+			pbox->d_hex = h;
+
+			// Kex privkeys are never cached, so burning them leaves no copies behind
+			if (i < k.pub.size() && k.pub[i].size() > 0) {
+				unique_ptr<EVP_PKEY, EVP_PKEY_del> evp(pem2key(k.pub[i], 0), EVP_PKEY_free);
+				if (evp.get()) {
+					pbox->d_pub = evp.release();
+					pbox->d_pub_pem = k.pub[i];
+				}
 			}
 
-			// Can leave for loop if didnt find pub.1 and priv.1 key
-			break;
+			if (i < k.priv.size() && k.priv[i].size() > 0) {
+				unique_ptr<BIO, BIO_del> bio(BIO_new_mem_buf(const_cast<char *>(k.priv[i].c_str()), k.priv[i].size()), BIO_free);
+				unique_ptr<EVP_PKEY, EVP_PKEY_del> evp(bio.get() ? PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr) : nullptr, EVP_PKEY_free);
+				if (!evp.get()) {
+					bad = 1;
+					break;
+				}
+				pbox->d_priv = evp.release();
+				pbox->d_priv_pem = k.priv[i];
+			}
+
+			if (!pbox->d_pub && !pbox->d_priv)
+				break;
+			pboxes->push_back(pbox.release());
 		}
-	}
 
-	// check if there was a designated peer. No problem if there isn't.
-	string peerfile = d_cfgbase + "/" + d_id + "/" + hex + "/peer";
-	f.reset(fopen(peerfile.c_str(), "r"));
-	if (f.get()) {
-		char s[512];
-		memset(s, 0, sizeof(s));
-		fr = fgets(s, sizeof(s) - 1, f.get());
-		size_t slen = strlen(s);
-		if (fr && slen > 0) {
-			if (s[slen - 1] == '\n')
-				s[slen - 1] = 0;
+		if (bad) {
+			if (hex.size() > 0)
+				return build_error("load_kex::PEM_read_bio_PrivateKey: Error reading (EC)DH privkey " + h, -1);
+			ERR_clear_error();
+			continue;
 		}
-		string peer = string(s);
-		if (is_hex_hash(peer))
-			d_keys[hex][0]->set_peer_id(peer);
+
+		if (pboxes->empty())
+			continue;
+		if (is_hex_hash(k.peer))
+			(*pboxes)[0]->set_peer_id(k.peer);
+		d_keys[h].swap(*pboxes);
 	}
 
 	errno = 0;
@@ -680,37 +1354,36 @@ int persona::load_dh(const string &hex)
 }
 
 
+int persona::compact_kex()
+{
+	if (d_store->kex_compact(d_id) < 0)
+		return store_error("compact_kex", -1);
+	return 0;
+}
+
+
 // determine type of a persona
 int persona::check_type()
 {
 	if (!is_hex_hash(d_id))
 		return build_error("check_type: Not a valid persona id", -1);
 
-	string dir = d_cfgbase + "/" + d_id;
-	string rsa = dir + "/rsa.pub.pem";
-	struct stat st;
-	if (stat(rsa.c_str(), &st) == 0) {
-		d_ptype = marker::rsa;
-	} else {
-		string ec = dir + "/ec.pub.pem";
-		if (stat(ec.c_str(), &st) == 0)
-			d_ptype = marker::ec;
-		else
-			return build_error("check_type: Neither RSA nor EC keys found for persona.", -1);
+	for (const string &t : {marker::rsa, marker::ec, marker::ed25519, marker::ed448}) {
+		if (d_store->exists(d_id, t + ".pub.pem")) {
+			d_ptype = t;
+			errno = 0;
+			return 0;
+		}
 	}
 
-	errno = 0;
-	return 0;
+	return build_error("check_type: Neither RSA, EC nor Ed keys found for persona.", -1);
 }
 
 
 int persona::load(const std::string &dh_hex, uint32_t how)
 {
-	size_t r = 0;
-	char buf[8192], *fr = nullptr;
-	string dir = d_cfgbase + "/" + d_id;
-	string file = dir + "/name";
-	string hex = "";
+	string content = "";
+	int r = 0;
 	DH *dhp = nullptr;
 
 	if (!is_hex_hash(d_id))
@@ -725,90 +1398,43 @@ int persona::load(const std::string &dh_hex, uint32_t how)
 	}
 
 	// load name, if any
-	unique_ptr<FILE, FILE_del> f(fopen(file.c_str(), "r"), ffclose);
-	if (f.get()) {
-		char s[512];
-		memset(s, 0, sizeof(s));
-		rlockf(f.get());
-		fr = fgets(s, sizeof(s) - 1, f.get());
-		unlockf(f.get());
-		size_t slen = strlen(s);
-		if (fr && slen > 0) {
-			if (s[slen - 1] == '\n')
-				s[slen - 1] = 0;
-		}
-		d_name = string(s);
-	}
+	if ((r = d_store->get(d_id, "name", content)) < 0)
+		return store_error("load", -1);
+	else if (r > 0)
+		d_name = content.substr(0, content.find_first_of("\r\n"));
 
 	// load default linked src, if any
-	file = dir + "/srclink";
-	f.reset(fopen(file.c_str(), "r"));
-	if (f.get()) {
-		char s[512];
-		memset(s, 0, sizeof(s));
-		rlockf(f.get());
-		fr = fgets(s, sizeof(s) - 1, f.get());
-		unlockf(f.get());
-		size_t slen = strlen(s);
-		if (fr && slen > 0) {
-			if (s[slen - 1] == '\n')
-				s[slen - 1] = 0;
-		}
-		d_link_src = string(s);
-	}
-
-	// load list of hashes of keys that have been imported once
-	file = dir + "/imported";
-	f.reset(fopen(file.c_str(), "r"));
-	if (f.get()) {
-		char s[512];
-		size_t slen = 0;
-		memset(s, 0, sizeof(s));
-		string line = "";
-		rlockf(f.get());
-		while (fgets(s, sizeof(s) - 1, f.get()) != nullptr) {
-			slen = strlen(s);
-			if (slen < 1 || s[0] == '#')
-				continue;
-			line = s;
-			line.erase(remove(line.begin(), line.end(), '\n'), line.end());
-			string::size_type idx = 0;
-			if ((idx = line.find(":")) != string::npos) {
-				string h = line.substr(0, idx);
-				if (is_hex_hash(h))
-					d_imported[h] = 1;	// timestamp not needed yet
-			}
-		}
-		unlockf(f.get());
-	}
+	if ((r = d_store->get(d_id, "srclink", content)) < 0)
+		return store_error("load", -1);
+	else if (r > 0)
+		d_link_src = content.substr(0, content.find_first_of("\r\n"));
+
+	// load hashes of keys that have been imported since the last compaction
+	if ((r = d_store->get(d_id, "imported", content)) < 0)
+		return store_error("load", -1);
+	vector<pair<bin_id, unsigned int>> imported;
+	parse_imported(content, imported);
+	d_imported.assign(imported);
 
 	// load EC/RSA persona key
 	string pub_pem = "", priv_pem = "";
 
-	file = dir + "/" + d_ptype + ".pub.pem";
-	f.reset(fopen(file.c_str(), "r"));
-	if (!f.get())
+	if ((r = d_store->get(d_id, d_ptype + ".pub.pem", pub_pem)) < 0)
+		return store_error("load", -1);
+	else if (r == 0)
 		return build_error("load: Error reading public key file for " + d_id, -1);
 
-	unique_ptr<EVP_PKEY, EVP_PKEY_del> evp_pub(PEM_read_PUBKEY(f.get(), nullptr, nullptr, nullptr), EVP_PKEY_free);
+	unique_ptr<EVP_PKEY, EVP_PKEY_del> evp_pub(pem2key(pub_pem, 0), EVP_PKEY_free);
 	if (!evp_pub.get())
-		return build_error("load::PEM_read_PUBKEY: Error reading public key file for " + d_id, -1);
-	rewind(f.get());
-	if ((r = fread(buf, 1, sizeof(buf), f.get())) <= 0)
-		return build_error("load::fread:", -1);
-	pub_pem = string(buf, r);
-
-	file = dir + "/" + d_ptype + ".priv.pem";
-	f.reset(fopen(file.c_str(), "r"));
+		return build_error("load::PEM_read_bio_PUBKEY: Error reading public key file for " + d_id, -1);
+
+	if ((r = d_store->get(d_id, d_ptype + ".priv.pem", priv_pem)) < 0)
+		return store_error("load", -1);
 	unique_ptr<EVP_PKEY, EVP_PKEY_del> evp_priv(nullptr, EVP_PKEY_free);
-	if (f.get()) {
-		evp_priv.reset(PEM_read_PrivateKey(f.get(), nullptr, nullptr, nullptr));
+	if (r > 0) {
+		evp_priv.reset(pem2key(priv_pem, 1));
 		if (!evp_priv.get())
-			return build_error("load::PEM_read_PrivateKey: Error reading private key file for " + d_id, -1);
-		rewind(f.get());
-		if ((r = fread(buf, 1, sizeof(buf), f.get())) <= 0)
-			return build_error("load::fread:", -1);
-		priv_pem = string(buf, r);
+			return build_error("load::PEM_read_bio_PrivateKey: Error reading private key file for " + d_id, -1);
 	}
 
 	set_pkey(evp_pub.release(), evp_priv.release());
@@ -816,64 +1442,106 @@ int persona::load(const std::string &dh_hex, uint32_t how)
 	d_pkey->d_priv_pem = priv_pem;
 
 	if (d_ptype == marker::rsa) {
-		// load DH params if avail
-		file = dir + "/dhparams.pem";
-		f.reset(fopen(file.c_str(), "r"));
-		if (f.get()) {
-			if (!PEM_read_DHparams(f.get(), &dhp, nullptr, nullptr))
-				return build_error("load::PEM_read_DHparams: Error reading DH params for " + d_id, -1);
+		// load DH params if avail, either as named group or as PEM params
+		if ((r = d_store->get(d_id, "dhgroup", content)) < 0)
+			return store_error("load", -1);
+		if (r > 0) {
+			string group = content.substr(0, content.find_first_of("\r\n"));
+			int nid = dh_group_nid(group);
+			if (nid == NID_undef || !(dhp = dh_group_params(nid)))
+				return build_error("load: Unsupported DH group " + group + " for " + d_id, -1);
 			d_dh_params = new (nothrow) DHbox(dhp, nullptr);
-			// do not free dh
+		} else {
+			if ((r = d_store->get(d_id, "dhparams.pem", content)) < 0)
+				return store_error("load", -1);
+			if (r > 0) {
+				unique_ptr<BIO, BIO_del> bio(BIO_new_mem_buf(const_cast<char *>(content.c_str()), content.size()), BIO_free);
+				if (!bio.get() || !PEM_read_bio_DHparams(bio.get(), &dhp, nullptr, nullptr))
+					return build_error("load::PEM_read_bio_DHparams: Error reading DH params for " + d_id, -1);
+				d_dh_params = new (nothrow) DHbox(dhp, nullptr);
+				// do not free dh
+			}
 		}
 	}
 
 	// if a certain dh_hex was given, only load this one. A dh_hex of special kind, only
 	// make us load persona keys
+	r = 0;
 	if (dh_hex.size() > 0) {
-		if (dh_hex == marker::rsa_kex_id || dh_hex == marker::ec_kex_id)
-			return 0;
-		return this->load_dh(dh_hex);
+		if (dh_hex != marker::rsa_kex_id && dh_hex != marker::ec_kex_id && dh_hex != marker::ratchet_kex_id)
+			r = this->load_kex(dh_hex);
+	} else if (how & LFLAGS_KEX) {
+		// otherwise, add all DH keys that are available
+		r = this->load_kex("");
 	}
 
-	if (!(how & LFLAGS_KEX))
-		return 0;
+	der_sync(r == 0 && dh_hex.empty() && (how & LFLAGS_KEX));
+	return r;
+}
 
-	// otherwise, add all DH keys that are available
-	DIR *d = opendir(dir.c_str());
-	if (!d)
-		return build_error("load_keys::opendir:", -1);
 
-	dirent *de = nullptr;
-	for (;;) {
-		if ((de = readdir(d)) == nullptr)
-			break;
-		hex = de->d_name;
-		if (!is_hex_hash(hex))
-			continue;
-		this->load_dh(hex);
-	}
-	closedir(d);
+PKEYbox *persona::set_pkey(EVP_PKEY *pub, EVP_PKEY *priv)
+{
+	if (d_pkey)
+		delete d_pkey;
+	d_pkey = new (nothrow) PKEYbox(pub, priv);
+	return d_pkey;
+}
 
-	errno = 0;
-	return 0;
+
+// RSA blinding is kept inside the key, no need to set it up for each operation
+static bool rsa_blinding(EVP_PKEY *evp)
+{
+	if (RSA *rsa = EVP_PKEY_get1_RSA(evp)) {
+		RSA_blinding_on(rsa, nullptr);
+		RSA_free(rsa);
+	}
+	ERR_clear_error();
+	return 1;
 }
 
 
-extern "C" typedef void (*vector_pkeybox_del)(vector<PKEYbox *> *);
-extern "C" void vector_pkeybox_free(vector<PKEYbox *> *v)
+// Signing context for the private key and md, initialized once. Callers copy
+// it for each signature via EVP_MD_CTX_copy_ex().
+EVP_MD_CTX *PKEYbox::sign_ctx(const EVP_MD *md)
 {
-	for (auto it = v->begin(); it != v->end(); ++it)
-		delete *it;
-	delete v;
+	if (!d_priv)
+		return nullptr;
+	if (d_sign_ctx && d_sign_md == md)
+		return d_sign_ctx;
+
+	if (!d_blinding)
+		d_blinding = rsa_blinding(d_priv);
+
+	if (!d_sign_ctx && !(d_sign_ctx = EVP_MD_CTX_create()))
+		return nullptr;
+	if (EVP_DigestSignInit(d_sign_ctx, nullptr, md, nullptr, d_priv) != 1) {
+		EVP_MD_CTX_destroy(d_sign_ctx);
+		d_sign_ctx = nullptr;
+		d_sign_md = nullptr;
+		return nullptr;
+	}
+	d_sign_md = md;
+	return d_sign_ctx;
 }
 
 
-PKEYbox *persona::set_pkey(EVP_PKEY *pub, EVP_PKEY *priv)
+// decryption context for the private key, re-usable for any number of EVP_PKEY_decrypt()
+EVP_PKEY_CTX *PKEYbox::decrypt_ctx()
 {
-	if (d_pkey)
-		delete d_pkey;
-	d_pkey = new (nothrow) PKEYbox(pub, priv);
-	return d_pkey;
+	if (d_dec_ctx || !d_priv)
+		return d_dec_ctx;
+
+	if (!d_blinding)
+		d_blinding = rsa_blinding(d_priv);
+
+	unique_ptr<EVP_PKEY_CTX, EVP_PKEY_CTX_del> p_ctx(EVP_PKEY_CTX_new(d_priv, nullptr), EVP_PKEY_CTX_free);
+	if (!p_ctx.get() || EVP_PKEY_decrypt_init(p_ctx.get()) != 1)
+		return nullptr;
+	if (EVP_PKEY_base_id(d_priv) == EVP_PKEY_RSA && EVP_PKEY_CTX_set_rsa_padding(p_ctx.get(), RSA_PKCS1_PADDING) != 1)
+		return nullptr;
+	d_dec_ctx = p_ctx.release();
+	return d_dec_ctx;
 }
 
 
@@ -881,30 +1549,21 @@ PKEYbox *persona::set_pkey(EVP_PKEY *pub, EVP_PKEY *priv)
 DHbox *persona::new_dh_params(const string &pem)
 {
 	DH *dh = nullptr;
-	int fd = -1;
-	string file = d_cfgbase + "/" + d_id + "/dhparams.pem";
-
-	if ((fd = open(file.c_str(), O_CREAT|O_RDWR|O_TRUNC, 0600)) < 0)
-		return build_error("new_dh_params::open: Error opening DH params for " + d_id, nullptr);
-	unique_ptr<FILE, FILE_del> f(fdopen(fd, "r+"), ffclose);
-	if (!f.get()) {
-		close(fd);
-		return build_error("new_dh_params::fdopen:", nullptr);
-	}
-	wlockf(f.get());
-	if (fwrite(pem.c_str(), pem.size(), 1, f.get()) != 1)
-		return build_error("new_dh_params::fwrite:", nullptr);;
-	rewind(f.get());
 
-	if (!PEM_read_DHparams(f.get(), &dh, nullptr, nullptr))
-		return build_error("new_dh_params::PEM_read_DHparams: Error reading DH params for " + d_id, nullptr);
+	unique_ptr<BIO, BIO_del> bio(BIO_new_mem_buf(const_cast<char *>(pem.c_str()), pem.size()), BIO_free);
+	if (!bio.get())
+		return build_error("new_dh_params: OOM", nullptr);
+	if (!PEM_read_bio_DHparams(bio.get(), &dh, nullptr, nullptr))
+		return build_error("new_dh_params::PEM_read_bio_DHparams: Error reading DH params for " + d_id, nullptr);
+	unique_ptr<DH, DH_del> dhp(dh, DH_free);
 
-	f.reset();	// calls unlock
+	if (d_store->remove(d_id, "dhgroup") < 0 || d_store->put(d_id, "dhparams.pem", pem) < 0)
+		return store_error("new_dh_params", nullptr);
 
 	if (d_dh_params)
 		delete d_dh_params;
 
-	d_dh_params = new (nothrow) DHbox(dh, nullptr);
+	d_dh_params = new (nothrow) DHbox(dhp.release(), nullptr);
 	if (!d_dh_params)
 		return build_error("new_dh_params::OOM", nullptr);
 
@@ -916,49 +1575,41 @@ DHbox *persona::new_dh_params(const string &pem)
 
 DHbox *persona::new_dh_params()
 {
-	size_t r = 0;
-	int fd = -1, ecode = 0;
-	BN_GENCB *cb_ptr = nullptr;
-
-	unique_ptr<DH, DH_del> dh(DH_new(), DH_free);
-	if (!dh.get())
-		return build_error("new_dh_params::DH_new: OOM", nullptr);
+	int ecode = 0;
 
-	if (RAND_load_file("/dev/urandom", 256) != 256)
-		RAND_load_file("/dev/random", 8);
+	vector<unique_ptr<DH, DH_del>> dhs;
+	for (unsigned int i = 0; i < max_threads(); ++i) {
+		dhs.emplace_back(DH_new(), DH_free);
+		if (!dhs[i].get())
+			return build_error("new_dh_params::DH_new: OOM", nullptr);
+	}
 
-// In OpenSSL 1.1.0, static decl of BN_GENCB disappeared and before BN_GENCB_new was not there!
-#if HAVE_BN_GENCB_NEW
-	unique_ptr<BN_GENCB, BN_GENCB_del> cb(BN_GENCB_new(), BN_GENCB_free);
-	if (!(cb_ptr = cb.get()))
-		return build_error("new_dh_params: OOM", nullptr);
-#else
-	BN_GENCB cb_s;
-	cb_ptr = &cb_s;
-#endif
+	seed_rand();
 
-	BN_GENCB_set(cb_ptr, key_cb, nullptr);
-	if (DH_generate_parameters_ex(dh.get(), config::dh_plen, 5, cb_ptr) != 1 || DH_check(dh.get(), &ecode) != 1)
+	int w = gen_race([&](unsigned int i, BN_GENCB *cb_ptr) -> int {
+		return DH_generate_parameters_ex(dhs[i].get(), config::dh_plen, 5, cb_ptr);
+	});
+	if (w < 0)
 		return build_error("new_dh_paramms::DH_generate_parameters_ex: Error generating DH params for " + d_id, nullptr);
 
-	string file = d_cfgbase + "/" + d_id + "/dhparams.pem";
-	if ((fd = open(file.c_str(), O_CREAT|O_RDWR|O_TRUNC, 0600)) < 0)
-		return build_error("new_dh_params::open: Error opening DH params for " + d_id, nullptr);
-	unique_ptr<FILE, FILE_del> f(fdopen(fd, "r+"), ffclose);
-	if (!f.get()) {
-		close(fd);
-		return build_error("new_dh_params::fdopen:", nullptr);
-	}
-	wlockf(f.get());
-	if (PEM_write_DHparams(f.get(), dh.get()) != 1)
-		return build_error("new_dh_params::PEM_write_DHparams: Error writing DH params for " + d_id, nullptr);
-	rewind(f.get());
+	unique_ptr<DH, DH_del> dh(dhs[w].release(), DH_free);
+	dhs.clear();
 
-	char buf[8192];
-	if ((r = fread(buf, 1, sizeof(buf), f.get())) <= 0)
-		return build_error("new_dh_params::fread: Error generating DH params for " + d_id, nullptr);
+	if (DH_check(dh.get(), &ecode) != 1)
+		return build_error("new_dh_paramms::DH_check: Error generating DH params for " + d_id, nullptr);
 
-	f.reset();	// calls unlock
+	unique_ptr<BIO, BIO_del> bio(BIO_new(BIO_s_mem()), BIO_free);
+	if (!bio.get())
+		return build_error("new_dh_params: OOM", nullptr);
+	if (PEM_write_bio_DHparams(bio.get(), dh.get()) != 1)
+		return build_error("new_dh_params::PEM_write_bio_DHparams: Error writing DH params for " + d_id, nullptr);
+
+	char *ptr = nullptr;
+	long l = BIO_get_mem_data(bio.get(), &ptr);
+	string pem = string(ptr, l);
+
+	if (d_store->remove(d_id, "dhgroup") < 0 || d_store->put(d_id, "dhparams.pem", pem) < 0)
+		return store_error("new_dh_params", nullptr);
 
 	if (d_dh_params)
 		delete d_dh_params;
@@ -967,7 +1618,7 @@ DHbox *persona::new_dh_params()
 	if (!d_dh_params)
 		return build_error("new_dh_params::OOM", nullptr);
 
-	d_dh_params->d_pub_pem = string(buf, r);
+	d_dh_params->d_pub_pem = pem;
 
 	// do not call DH_free(dh)
 
@@ -985,21 +1636,23 @@ vector<PKEYbox *> persona::gen_kex_key(const string &hash, const string &peer)
 vector<PKEYbox *> persona::gen_kex_key(const EVP_MD *md, const string &peer)
 {
 	string pub_pem = "", priv_pem = "";
-	struct stat st;
-	int fd = -1;
 
 	vector<pair<string, string>> kex_keys;
+	vector<unique_ptr<EVP_PKEY, EVP_PKEY_del>> kex_pubs, kex_privs;
 
 	// v0 empty vector for error return
 	vector<PKEYbox *> v0;
 	string hex = "", h = "";
 
-	if (d_ptype == marker::ec || config::ecdh_rsa) {
+	if (d_ptype != marker::rsa || config::ecdh_rsa) {
 		d_err = "persona::gen_kex_key::";
 		// for each defined curve
 		for (unsigned int i = 0; i < config::curve_nids.size(); ++i) {
-			if (opmsg::gen_ec(pub_pem, priv_pem, config::curve_nids[i], d_err) < 0)
+			EVP_PKEY *evp_pub = nullptr, *evp_priv = nullptr;
+			if (opmsg::gen_ec(pub_pem, priv_pem, config::curve_nids[i], d_err, &evp_pub, &evp_priv) < 0)
 				return v0;
+			kex_pubs.emplace_back(evp_pub, EVP_PKEY_free);
+			kex_privs.emplace_back(evp_priv, EVP_PKEY_free);
 			d_err = "";
 			if (normalize_and_hexhash(md, pub_pem, h) < 0)
 				return build_error("gen_kex_key::normalize_and_hexhash: Cant hash key.", v0);
@@ -1010,8 +1663,11 @@ vector<PKEYbox *> persona::gen_kex_key(const EVP_MD *md, const string &peer)
 		}
 
 	} else {
-		if (this->gen_dh_key(md, pub_pem, priv_pem, hex) < 0)
+		EVP_PKEY *evp_pub = nullptr, *evp_priv = nullptr;
+		if (this->gen_dh_key(md, pub_pem, priv_pem, hex, &evp_pub, &evp_priv) < 0)
 			return v0;
+		kex_pubs.emplace_back(evp_pub, EVP_PKEY_free);
+		kex_privs.emplace_back(evp_priv, EVP_PKEY_free);
 		kex_keys.push_back(make_pair(pub_pem, priv_pem));
 	}
 
@@ -1019,67 +1675,20 @@ vector<PKEYbox *> persona::gen_kex_key(const EVP_MD *md, const string &peer)
 	if (d_keys.count(hex) > 0)
 		return d_keys[hex];
 
-	string hexdir = d_cfgbase + "/" + d_id + "/" + hex;
-	if (stat(hexdir.c_str(), &st) == 0)
+	if (d_store->kex_exists(d_id, hex))
 		return build_error("gen_kex_key: Error storing ECDH keys " + hex, v0);
 
-	string tmpdir = "";
-	if (mkdir_helper(d_cfgbase + "/" + d_id, tmpdir) < 0)
-		return build_error("gen_kex_key::mkdir:", v0);
-
 	unique_ptr<vector<PKEYbox *>, vector_pkeybox_del> pboxes(new (nothrow) vector<PKEYbox *>, vector_pkeybox_free);
+	if (!pboxes.get())
+		return build_error("gen_kex_key: OOM", v0);
+	kex_data kd;
 
 	for (unsigned int i = 0; i < kex_keys.size(); ++i) {
 		pub_pem = kex_keys[i].first;
 		priv_pem = kex_keys[i].second;
 
-		unique_ptr<char, free_del> sdup(strdup(pub_pem.c_str()), free);
-		unique_ptr<BIO, BIO_del> bio(BIO_new_mem_buf(sdup.get(), pub_pem.size()), BIO_free);
-		if (!bio.get())
-			return build_error("gen_kex_key: OOM", v0);
-		unique_ptr<EVP_PKEY, EVP_PKEY_del> evp_pub(PEM_read_bio_PUBKEY(bio.get(), nullptr, nullptr, nullptr), EVP_PKEY_free);
-		if (!evp_pub.get())
-			return build_error("gen_kex_key::PEM_read_bio_PUBKEY: Error reading PEM key", v0);
-
-		sdup.reset(strdup(priv_pem.c_str()));
-		bio.reset(BIO_new_mem_buf(sdup.get(), priv_pem.size()));
-		if (!bio.get())
-			return build_error("gen_kex_key: OOM", v0);
-
-		unique_ptr<EVP_PKEY, EVP_PKEY_del> evp_priv(PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr), EVP_PKEY_free);
-		if (!evp_priv.get())
-			return build_error("gen_kex_key::PEM_read_bio_PrivateKey: Error reading PEM key", v0);
-
-		string dhfile1 = tmpdir + "/dh.pub.pem";
-		if (i > 0) {
-			char s[32] = {0};
-			snprintf(s, sizeof(s), "/dh.pub.%d.pem", i);
-			dhfile1 = tmpdir + s;
-		}
-
-		if ((fd = open(dhfile1.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600)) < 0)
-			return build_error("gen_kex_key::open:", v0);
-		unique_ptr<FILE, FILE_del> f(fdopen(fd, "r+"), ffclose);
-		if (!f.get())
-			return build_error("gen_kex_key::fdopen:", v0);
-		if (fwrite(pub_pem.c_str(), pub_pem.size(), 1, f.get()) != 1)
-			return build_error("gen_kex_key::fwrite:", v0);
-		f.reset();
-
-		string dhfile2 = tmpdir + "/dh.priv.pem";
-		if (i > 0) {
-			char s[32] = {0};
-			snprintf(s, sizeof(s), "/dh.priv.%d.pem", i);
-			dhfile2 = tmpdir + s;
-		}
-		if ((fd = open(dhfile2.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600)) < 0)
-			return build_error("gen_kex_key::open:", v0);
-		f.reset(fdopen(fd, "r+"));
-		if (!f.get())
-			return build_error("gen_kex_key::fdopen:", v0);
-		if (fwrite(priv_pem.c_str(), priv_pem.size(), 1, f.get()) != 1)
-			return build_error("gen_kex_key::fwrite:", v0);
-		f.reset();
+		// keys were handed out by the generator; PEMs are only needed for storage
+		unique_ptr<EVP_PKEY, EVP_PKEY_del> evp_pub(move(kex_pubs[i])), evp_priv(move(kex_privs[i]));
 
 		PKEYbox *pbox = new (nothrow) PKEYbox(evp_pub.release(), evp_priv.release());
 		if (!pbox)
@@ -1091,51 +1700,72 @@ vector<PKEYbox *> persona::gen_kex_key(const EVP_MD *md, const string &peer)
 		pbox->set_peer_id(peer);
 
 		pboxes->push_back(pbox);
-	}
 
-	string peerfile = tmpdir + "/peer";
-	// record any given designated peer
-	// really an "if". But errors here are non-fatal and may be "break" ed
-	while (peer.size() > 0 && is_hex_hash(peer)) {
-		if ((fd = open(peerfile.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0)
-			break;
-		string s = peer + "\n";
-		if (write(fd, s.c_str(), s.size()) < 0)
-			unlink(peerfile.c_str());
-		close(fd);
-		break;
+		kd.pub.push_back(pub_pem);
+		kd.priv.push_back(priv_pem);
 	}
 
+	// record any given designated peer
+	if (is_hex_hash(peer))
+		kd.peer = peer;
 
-	if (rename(tmpdir.c_str(), hexdir.c_str()) < 0) {
-		for (const string &s : vector<string>{"/dh.pub.pem", "/dh.priv.pem", "/dh.pub.1.pem", "/dh.priv.1.pem", "/dh.pub.2.pem", "/dh.priv.2.pem"}) {
-			string s2 = tmpdir + s;
-			unlink(s2.c_str());
-		}
-		unlink(peerfile.c_str());
-		rmdir(tmpdir.c_str());
-		return build_error("gen_kex_key: Error storing ECDH keys " + hex, v0);
-	}
+	if (d_store->kex_add(d_id, hex, kd) < 0)
+		return store_error("gen_kex_key", v0);
 
-	d_keys[hex] = *(pboxes.release());
+	d_keys[hex].swap(*pboxes);
 	return d_keys[hex];
 }
 
 
+// use a RFC 7919 named group instead of own DH params
+DHbox *persona::new_dh_group(const string &name)
+{
+	int nid = dh_group_nid(name);
+	if (nid == NID_undef)
+		return build_error("new_dh_group: Unsupported DH group " + name, nullptr);
+
+	unique_ptr<DH, DH_del> dh(dh_group_params(nid), DH_free);
+	if (!dh.get())
+		return build_error("new_dh_group::dh_group_params: Error creating DH group " + name, nullptr);
+
+	if (d_store->put(d_id, "dhgroup", name + "\n") < 0 || d_store->remove(d_id, "dhparams.pem") < 0)
+		return store_error("new_dh_group", nullptr);
+
+	if (d_dh_params)
+		delete d_dh_params;
+
+	d_dh_params = new (nothrow) DHbox(dh.release(), nullptr);
+	if (!d_dh_params)
+		return build_error("new_dh_group::OOM", nullptr);
+
+	return d_dh_params;
+}
+
+
 // get a new ephemeral (session, kex-id) DH key.
-int persona::gen_dh_key(const EVP_MD *md, string &pub, string &priv, string &hex)
+int persona::gen_dh_key(const EVP_MD *md, string &pub, string &priv, string &hex, EVP_PKEY **evp_pub, EVP_PKEY **evp_priv)
 {
 	char *ptr = nullptr;
 	int ecode = 0;
 
-	if (RAND_load_file("/dev/urandom", 256) != 256)
-		RAND_load_file("/dev/random", 8);
+	seed_rand();
 
 	if (!d_dh_params)
 		return build_error("gen_dh_key: Invalid persona. No DH params for " + d_id, -1);
 
-	unique_ptr<DH, DH_del> dh(DHparams_dup(d_dh_params->d_pub), DH_free);
-	if (!dh.get() || DH_generate_key(dh.get()) != 1 || DH_check(dh.get(), &ecode) != 1)
+	// named groups are pre-validated
+	int nid = dh_group_nid(d_dh_params->d_pub), r = 0;
+	unique_ptr<DH, DH_del> dh(nid != NID_undef ? dh_group_params(nid) : DHparams_dup(d_dh_params->d_pub), DH_free);
+	if (!dh.get())
+		return build_error("gen_dh_key: OOM", -1);
+
+	// own DH params: fixed-base table is kept next to dhparams.pem, if the storage has a place for it
+	string dir = d_store->dir(d_id);
+	if (nid == NID_undef && config::dh_precompute && dir.size() > 0) {
+		if ((r = dh_generate_key_tab(dh.get(), dir + "/dhparams.tab")) < 0)
+			return build_error("gen_dh_key::dh_generate_key_tab: Error generating DH key for " + d_id, -1);
+	}
+	if ((r == 0 && DH_generate_key(dh.get()) != 1) || (r == 0 && nid == NID_undef && DH_check(dh.get(), &ecode) != 1))
 		return build_error("gen_dh_key::DH_generate_key: Error generating DH key for " + d_id, -1);
 
 	hex = "";
@@ -1144,6 +1774,10 @@ int persona::gen_dh_key(const EVP_MD *md, string &pub, string &priv, string &hex
 
 	const BIGNUM *pub_key = nullptr;
 	opmsg::DH_get0_key(dh.get(), &pub_key, nullptr);
+
+	// table params were checked when the table was built
+	if (r == 1 && (DH_check_pub_key(dh.get(), pub_key, &ecode) != 1 || ecode != 0))
+		return build_error("gen_dh_key::DH_check_pub_key: Error generating DH key for " + d_id, -1);
 	if (bn2hexhash(md, pub_key, hex) < 0)
 		return build_error("gen_dh_key::bn2hexhash: Error hashing DH key.", -1);
 
@@ -1171,6 +1805,22 @@ int persona::gen_dh_key(const EVP_MD *md, string &pub, string &priv, string &hex
 	l = BIO_get_mem_data(bio.get(), &ptr);
 	priv = string(ptr, l);
 
+	// public-only copy for the PKEYbox, as it would have been read from dh.pub.pem
+	if (evp_pub) {
+		unique_ptr<DH, DH_del> pubdh(DHparams_dup(dh.get()), DH_free);
+		unique_ptr<BIGNUM, BIGNUM_del> bn(BN_dup(pub_key), BN_free);
+		unique_ptr<EVP_PKEY, EVP_PKEY_del> evp2(EVP_PKEY_new(), EVP_PKEY_free);
+		if (!pubdh.get() || !bn.get() || !evp2.get())
+			return build_error("gen_dh_key:: OOM", -1);
+		opmsg::DH_set0_key(pubdh.get(), bn.release(), nullptr);
+		if (EVP_PKEY_assign_DH(evp2.get(), pubdh.get()) != 1)
+			return build_error("gen_dh_key::EVP_PKEY_assign_DH: Error generating DH key", -1);
+		pubdh.release();
+		*evp_pub = evp2.release();
+	}
+	if (evp_priv)
+		*evp_priv = evp.release();
+
 	return 0;
 }
 
@@ -1179,14 +1829,10 @@ void persona::used_key(const string &hexid, bool u)
 {
 	if (!is_hex_hash(hexid))
 		return;
-	if (hexid == marker::rsa_kex_id || hexid == marker::ec_kex_id)
+	if (hexid == marker::rsa_kex_id || hexid == marker::ec_kex_id || hexid == marker::ratchet_kex_id)
 		return;
 
-	string file = d_cfgbase + "/" + d_id + "/" + hexid + "/used";
-	if (!u)
-		unlink(file.c_str());
-	else
-		close(open(file.c_str(), O_CREAT|O_EXCL, 0600));
+	d_store->kex_used(d_id, hexid, u);
 }
 
 
@@ -1200,22 +1846,23 @@ vector<PKEYbox *> persona::add_dh_pubkey(const string &hash, vector<string> &pem
 // encrypted messages to this persona
 vector<PKEYbox *> persona::add_dh_pubkey(const EVP_MD *md, vector<string> &pubs)
 {
-	struct stat st = {0};
-	int fd = -1, keytype = -1, keytype0 = -1;
-	string hex = "", dhfile = "", hexdir = "", tmpdir = "";
+	int keytype = -1, keytype0 = -1;
+	string hex = "";
 	vector<PKEYbox *> v0;	// empty vector for error return
 
 	if (pubs.size() > 3)
 		return build_error("add_dh_pubkey: Too many keys in import vector.", v0);
 
 	unique_ptr<vector<PKEYbox *>, vector_pkeybox_del> pboxes(new (nothrow) vector<PKEYbox *>, vector_pkeybox_free);
-	unique_ptr<FILE, FILE_del> f(nullptr, ffclose);
+	if (!pboxes.get())
+		return build_error("add_dh_pubkey: OOM", v0);
+	kex_data kd;
 
 	for (unsigned int i = 0; i < pubs.size(); ++i) {
 		string &pub_pem = pubs[i];
 
-		unique_ptr<char, free_del> sdup(strdup(pub_pem.c_str()), free);
-		unique_ptr<BIO, BIO_del> bio(BIO_new_mem_buf(sdup.get(), pub_pem.size()), BIO_free);
+		// read-only BIO, no need to copy the PEM
+		unique_ptr<BIO, BIO_del> bio(BIO_new_mem_buf(const_cast<char *>(pub_pem.c_str()), pub_pem.size()), BIO_free);
 		if (!bio.get())
 			return build_error("add_dh_pubkey: OOM", v0);
 		unique_ptr<EVP_PKEY, EVP_PKEY_del> evp_pub(PEM_read_bio_PUBKEY(bio.get(), nullptr, nullptr, nullptr), EVP_PKEY_free);
@@ -1228,7 +1875,8 @@ vector<PKEYbox *> persona::add_dh_pubkey(const EVP_MD *md, vector<string> &pubs)
 
 		keytype = EVP_PKEY_base_id(evp_pub.get());
 
-		if (keytype != keytype0)
+		// ECDH and X25519/X448 may be mixed across domains, DH stands alone
+		if ((keytype == EVP_PKEY_DH) != (keytype0 == EVP_PKEY_DH))
 			return build_error("add_dh_pubkey: Mismatch in multiple keys' types. (ECDH and DH mixed).", v0);
 
 		// DH keys are hashed differently than EC(DH) keys, as DH pubkey consists of a single
@@ -1241,7 +1889,7 @@ vector<PKEYbox *> persona::add_dh_pubkey(const EVP_MD *md, vector<string> &pubs)
 			opmsg::DH_get0_key(dh.get(), &pub_key, nullptr);
 			if (!dh.get() || bn2hexhash(md, pub_key, hex) < 0)
 				return build_error("add_dh_key::bn2hexhash: Error hashing DH pubkey.", v0);
-		} else if (keytype == EVP_PKEY_EC) {
+		} else if (keytype == EVP_PKEY_EC || is_xdh(keytype)) {
 			string h = "";
 			if (normalize_and_hexhash(md, pub_pem, h) < 0)
 				return build_error("add_dh_key:: Error hashing ECDH pubkey.", v0);
@@ -1251,85 +1899,85 @@ vector<PKEYbox *> persona::add_dh_pubkey(const EVP_MD *md, vector<string> &pubs)
 		} else
 			return build_error("add_dh_pubkey: Unknown key type.", v0);
 
-		hexdir = d_cfgbase + "/" + d_id + "/" + hex;
-
 		if (i == 0) {
 			// some remote persona tries to import a key twice?
-			// stat() to check if an empty key directory exists. That'd mean that
-			// key was already imported and used once. Do not reimport. (Later rename()
-			// would not fail on empty target dirs.)
+			// Storage also knows Kex ids that were already imported and deleted.
 			// Needed since older opmsg versions leave empty hexdir instead of recording
 			// it in "imported" file
-			if (d_imported.count(hex) > 0 || d_keys.count(hex) > 0 || stat(hexdir.c_str(), &st) == 0)
+			int r = imported(hex);
+			if (r < 0)
+				return v0;
+			if (r > 0 || d_keys.count(hex) > 0 || d_store->kex_exists(d_id, hex))
 				return build_error("add_dh_pubkey: Key already exist(ed).", v0);
-
-			if (mkdir_helper(d_cfgbase + "/" + d_id, tmpdir) < 0)
-				return build_error("add_dh_key::mkdir:", v0);
-
-			dhfile = tmpdir + "/dh.pub.pem";
-		} else {
-			char s[32] = {0};
-			snprintf(s, sizeof(s), "/dh.pub.%d.pem", i);
-			dhfile = tmpdir + s;
 		}
 
-		if ((fd = open(dhfile.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600)) < 0)
-			return build_error("add_dh_key::open:", v0);
-		f.reset(fdopen(fd, "r+"));
-		if (!f.get())
-			return build_error("add_dh_key::fdopen:", v0);
-		if (fwrite(pub_pem.c_str(), pub_pem.size(), 1, f.get()) != 1)
-			return build_error("add_dh_key::fwrite:", v0);
-		f.reset();
-
 		PKEYbox *pbox = new (nothrow) PKEYbox(evp_pub.release(), nullptr);
 		if (!pbox)
 			return build_error("add_dh_pubkey:: OOM", v0);
 		pbox->d_pub_pem = pub_pem;
 		pbox->d_hex = hex;
 		pboxes->push_back(pbox);
-	}
 
-	if (rename(tmpdir.c_str(), hexdir.c_str()) < 0) {
-		for (const string &s : vector<string>{"/dh.pub.pem", "/dh.priv.pem", "/dh.pub.1.pem", "/dh.priv.1.pem", "/dh.pub.2.pem", "/dh.priv.2.pem"}) {
-			string s2 = tmpdir + s;
-			unlink(s2.c_str());
-		}
-		rmdir(tmpdir.c_str());
-		return build_error("add_dh_key: Error storing (EC)DH pubkey " + hex, v0);
+		kd.pub.push_back(pub_pem);
 	}
 
+	if (d_store->kex_add(d_id, hex, kd) < 0)
+		return store_error("add_dh_key", v0);
+
 	// record this key id as imported
-	d_imported[hex] = 1;
-	string imfile = d_cfgbase + "/" + d_id + "/imported";
-	f.reset(fopen(imfile.c_str(), "a"));
-	if (f.get()) {
-		wlockf(f.get());
-		fprintf(f.get(), "%s:1\n", hex.c_str());
-	}
-	f.reset();	// calls unlock
+	unsigned int now = time(nullptr);
+	d_imported[hex] = now;
+	d_store->append(d_id, "imported", hex + ":" + to_string(now) + "\n");
 
-	d_keys[hex] = *(pboxes.release());
+	// Only imports grow the log, so only they compact it and lookups never rewrite the
+	// index. If it fails, the log just stays longer.
+	if (d_imported.size() >= MAX_IMPORTED_LOG)
+		compact_imported();
+
+	d_keys[hex].swap(*pboxes);
 
 	return d_keys[hex];
 }
 
 
 
+// Cached message keys must not outlive the Kex key that opened the messages
+static void keycache_drop(const string &dir, const string &hex)
+{
+	if (dir.empty())
+		return;
+	string kdir = dir + "/keycache/" + hex;
+	DIR *d = opendir(kdir.c_str());
+	if (!d)
+		return;
+	dirent *de = nullptr;
+	while ((de = readdir(d)) != nullptr) {
+		if (de->d_name[0] != '.')
+			unlink((kdir + "/" + de->d_name).c_str());
+	}
+	closedir(d);
+	rmdir(kdir.c_str());
+}
+
+
 int persona::del_dh_id(const string &hex)
 {
 	if (!is_hex_hash(hex))
 		return build_error("del_dh_id: Invalid key id.", -1);
-	if (hex == marker::rsa_kex_id || hex == marker::ec_kex_id)
+	if (hex == marker::rsa_kex_id || hex == marker::ec_kex_id || hex == marker::ratchet_kex_id)
 		return 0;
 
-	string dir = d_cfgbase + "/" + d_id + "/" + hex;
 	if (d_keys.count(hex) > 0) {
 		for (auto it = d_keys[hex].begin(); it != d_keys[hex].end(); ++it)
 			delete *it;
 		d_keys.erase(hex);
 	}
-	return rmdir(dir.c_str());
+
+	keycache_drop(d_store->dir(d_id), hex);
+
+	if (d_store->kex_del_id(d_id, hex) < 0)
+		return store_error("del_dh_id", -1);
+	return 0;
 }
 
 
@@ -1338,43 +1986,13 @@ int persona::del_dh_priv(const string &hex)
 	if (!is_hex_hash(hex))
 		return build_error("del_dh_priv: Invalid key id.", -1);
 
-	if (hex == marker::rsa_kex_id || hex == marker::ec_kex_id)
+	if (hex == marker::rsa_kex_id || hex == marker::ec_kex_id || hex == marker::ratchet_kex_id)
 		return 0;
 
-	string base = d_cfgbase + "/" + d_id + "/" + hex;
-	string used = d_cfgbase + "/" + d_id + "/" + hex + "/used";
-	string peer = d_cfgbase + "/" + d_id + "/" + hex + "/peer";
-
-	int j = 0;
-	struct stat st = {0};
-	for (const string &s : vector<string>{"/dh.priv.pem", "/dh.priv.1.pem", "/dh.priv.2.pem"}) {
-		string file = base + s;
-		int fd = open(file.c_str(), O_RDWR);
-
-		// ENOENT errors for (possibly not existing) subkeys are OK
-		if (fd < 0) {
-			if (j == 0 || errno != ENOENT)
-				return build_error("del_dh_priv: Unable to open keyfile for shredding.", -1);
-			else
-				continue;
-		}
-
-		if (fstat(fd, &st) < 0)
-			return build_error("del_dh_priv: Unable to fstat keyfile during shredding.", -1);
+	keycache_drop(d_store->dir(d_id), hex);
 
-		char buf[512];
-		memset(buf, 0, sizeof(buf));
-		for (off_t i = 0; i < st.st_size; i += sizeof(buf)) {
-			if (write(fd, buf, sizeof(buf)) > 0)
-				sync();
-		}
-		close(fd);
-		unlink(file.c_str());
-		++j;
-	}
-
-	unlink(used.c_str());
-	unlink(peer.c_str());
+	if (d_store->kex_del_priv(d_id, hex) < 0)
+		return store_error("del_dh_priv", -1);
 
 	if (d_keys.count(hex) > 0) {
 		for (auto it = d_keys[hex].begin(); it != d_keys[hex].end(); ++it) {
@@ -1393,12 +2011,11 @@ int persona::del_dh_pub(const string &hex)
 {
 	if (!is_hex_hash(hex))
 		return build_error("del_dh_pub: Invalid key id.", -1);
-	if (hex == marker::rsa_kex_id || hex == marker::ec_kex_id)
+	if (hex == marker::rsa_kex_id || hex == marker::ec_kex_id || hex == marker::ratchet_kex_id)
 		return 0;
 
-	string file = d_cfgbase + "/" + d_id + "/" + hex;
-	for (const string &s : vector<string>{"/dh.pub.pem", "/dh.pub.1.pem", "/dh.pub.2.pem"})
-		unlink((file + s).c_str());
+	if (d_store->kex_del_pub(d_id, hex) < 0)
+		return store_error("del_dh_pub", -1);
 
 	if (d_keys.count(hex) > 0) {
 		for (auto it = d_keys[hex].begin(); it != d_keys[hex].end(); ++it) {
@@ -1415,25 +2032,8 @@ int persona::link(const string &hex)
 	if (!is_hex_hash(hex))
 		return build_error("link: Invalid src id.", -1);
 
-	string file = d_cfgbase + "/" + d_id + "/srclink";
-
-	int saved_errno = 0;
-	int fd = open(file.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
-	if (fd >= 0) {
-		wlockf(fd);
-		if (write(fd, hex.c_str(), hex.size()) < 0)
-			saved_errno = errno;
-		if (write(fd, "\n", 1) < 0)
-			saved_errno = errno;
-		unlockf(fd);
-		close(fd);
-	} else
-		return build_error("link: ", -1);
-
-	if (saved_errno != 0) {
-		errno = saved_errno;
-		return build_error("link::write:", -1);
-	}
+	if (d_store->put(d_id, "srclink", hex + "\n") < 0)
+		return store_error("link", -1);
 
 	return 0;
 }
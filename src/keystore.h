@@ -31,11 +31,14 @@
 #include <sys/stat.h>
 
 #include "misc.h"
+#include "storage.h"
+#include "idmap.h"
 #include "marker.h"
 
 
 extern "C" {
 #include <openssl/dh.h>
+#include <openssl/ec.h>
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
 #include <openssl/err.h>
@@ -63,6 +66,13 @@ public:
 	 */
 	std::string d_peer_id{""};
 
+	// Private key operations prepared on first use, so that repeated signing or
+	// decryption with the same key only copies or re-uses them.
+	EVP_MD_CTX *d_sign_ctx{nullptr};
+	const EVP_MD *d_sign_md{nullptr};
+	EVP_PKEY_CTX *d_dec_ctx{nullptr};
+	bool d_blinding{0};
+
 
 	PKEYbox(EVP_PKEY *p, EVP_PKEY *s)
 		: d_pub(p), d_priv(s)
@@ -71,12 +81,20 @@ public:
 
 	virtual ~PKEYbox()
 	{
+		if (d_sign_ctx)
+			EVP_MD_CTX_destroy(d_sign_ctx);
+		if (d_dec_ctx)
+			EVP_PKEY_CTX_free(d_dec_ctx);
 		if (d_pub)
 			EVP_PKEY_free(d_pub);
 		if (d_priv)
 			EVP_PKEY_free(d_priv);
 	}
 
+	EVP_MD_CTX *sign_ctx(const EVP_MD *);
+
+	EVP_PKEY_CTX *decrypt_ctx();
+
 	bool can_sign()
 	{
 		return d_priv != nullptr;
@@ -159,15 +177,28 @@ class persona {
 	std::string d_id{""}, d_name{""}, d_link_src{""}, d_ptype{""};
 
 	// The (EC)DH 'session' keys this persona holds
-	std::map<std::string, std::vector<PKEYbox *>> d_keys;
+	id_map<std::vector<PKEYbox *>> d_keys;
 
-	// List of hashes of all imported keys so far
-	std::map<std::string, unsigned int> d_imported;
+	// Hashes of imported keys since the last compaction of the "imported" log,
+	// with the time of import. Older ones are in the sorted "imported.idx".
+	id_map<unsigned int> d_imported;
 
 	PKEYbox *d_pkey{nullptr};
 	DHbox *d_dh_params{nullptr};
 
-	std::string d_cfgbase{""}, d_err{""};
+	// Ed personas: X25519/X448 key derived from d_pkey for the ec_kex_id fallback
+	PKEYbox *d_xkey{nullptr};
+
+	// own directory storage, unless one was handed in
+	dir_storage d_dirs;
+	storage *d_store{nullptr};
+
+	// DER copies of parsed PEM keys by hash of the PEM, if config::dercache
+	std::map<std::string, std::pair<int, std::string>> d_der;
+	std::map<std::string, bool> d_der_used;
+	bool d_der_loaded{0}, d_der_dirty{0};
+
+	std::string d_err{""};
 
 	template<class T>
 	T build_error(const std::string &msg, T r)
@@ -188,12 +219,32 @@ class persona {
 		return r;
 	}
 
-	int load_dh(const std::string &hex);
+	template<class T>
+	T store_error(const std::string &msg, T r)
+	{
+		errno = 0;
+		return build_error(msg + "::" + d_store->why(), r);
+	}
+
+	int load_kex(const std::string &hex);
+
+	EVP_PKEY *pem2key(const std::string &, bool);
+
+	void der_sync(bool);
 
 public:
 
 	persona(const std::string &dir, const std::string &hash, const std::string &n = "")
-		: d_id(hash), d_name(n), d_cfgbase(dir)
+		: d_id(hash), d_name(n), d_dirs(dir), d_store(&d_dirs)
+	{
+		if (!is_hex_hash(d_id))
+			d_id = "dead";
+
+		d_ptype = marker::unknown;
+	}
+
+	persona(storage *s, const std::string &hash, const std::string &n = "")
+		: d_id(hash), d_name(n), d_dirs(""), d_store(s)
 	{
 		if (!is_hex_hash(d_id))
 			d_id = "dead";
@@ -210,11 +261,12 @@ public:
 
 		delete d_pkey;
 		delete d_dh_params;
+		delete d_xkey;
 	}
 
 	void set_type(const std::string &t)
 	{
-		if (t == marker::rsa || t == marker::ec)
+		if (t == marker::rsa || t == marker::ec || t == marker::ed25519 || t == marker::ed448)
 			d_ptype = t;
 	}
 
@@ -278,13 +330,15 @@ public:
 
 	DHbox *new_dh_params(const std::string &pem);
 
+	DHbox *new_dh_group(const std::string &name);
+
 	std::vector<PKEYbox *> add_dh_pubkey(const std::string &hash, std::vector<std::string> &pems);
 
 	std::vector<PKEYbox *> add_dh_pubkey(const EVP_MD *md, std::vector<std::string> &pems);
 
 	std::vector<PKEYbox *> gen_kex_key(const std::string &hash, const std::string & = "");
 
-	int gen_dh_key(const EVP_MD *md, std::string&, std::string&, std::string&);
+	int gen_dh_key(const EVP_MD *md, std::string&, std::string&, std::string&, EVP_PKEY ** = nullptr, EVP_PKEY ** = nullptr);
 
 	std::vector<PKEYbox *> gen_kex_key(const EVP_MD *md, const std::string & = "");
 
@@ -296,22 +350,28 @@ public:
 
 	int del_dh_priv(const std::string &hex);
 
+	int imported(const std::string &hex);
+
 	bool has_imported(const std::string &hex)
 	{
-		return d_imported.count(hex) > 0;
+		return imported(hex) > 0;
 	}
 
+	int compact_imported();
+
 	void used_key(const std::string &hex, bool);
 
 	int load(const std::string &hex = "", uint32_t how = LFLAGS_ALL);
 
 	int link(const std::string &hex);
 
-	std::map<std::string, std::vector<PKEYbox *>>::iterator first_key();
+	int compact_kex();
 
-	std::map<std::string, std::vector<PKEYbox *>>::iterator end_key();
+	id_map<std::vector<PKEYbox *>>::iterator first_key();
 
-	std::map<std::string, std::vector<PKEYbox *>>::iterator next_key(const std::map<std::string, std::vector<PKEYbox *>>::iterator &);
+	id_map<std::vector<PKEYbox *>>::iterator end_key();
+
+	id_map<std::vector<PKEYbox *>>::iterator next_key(const id_map<std::vector<PKEYbox *>>::iterator &);
 
 	int size()
 	{
@@ -329,8 +389,10 @@ public:
 
 class keystore {
 
-	std::string d_cfgbase{""};
-	std::map<std::string, persona *> d_personas;
+	dir_storage d_dirs;
+	storage *d_store{nullptr};
+
+	id_map<persona *> d_personas;
 
 	const EVP_MD *d_md{nullptr};
 
@@ -355,10 +417,19 @@ class keystore {
 		return r;
 	}
 
+	int load_all(const std::vector<std::string> &, uint32_t);
+
 public:
 
 	keystore(const std::string& hash, const std::string &base = ".opmsg")
-		: d_cfgbase(base)
+		: d_dirs(base), d_store(&d_dirs)
+	{
+		d_md = algo2md(hash);
+	}
+
+	// keys kept in a storage of the callers choice, which must outlive the keystore
+	keystore(const std::string& hash, storage *s)
+		: d_dirs(""), d_store(s)
 	{
 		d_md = algo2md(hash);
 	}
@@ -381,20 +452,24 @@ public:
 
 	int gen_ec(std::string &pub, std::string &priv, int);
 
+	int gen_ed(std::string &pub, std::string &priv, const std::string &);
+
 	persona *add_persona(const std::string &name, const std::string &rsa_pub_pem, const std::string &rsa_priv_pem, const std::string &dhparams_pem);
 
 	persona *find_persona(const std::string &hex);
 
+	int shard();
+
 	int size()
 	{
 		return d_personas.size();
 	}
 
-	std::map<std::string, persona *>::iterator first_pers();
+	id_map<persona *>::iterator first_pers();
 
-	std::map<std::string, persona *>::iterator end_pers();
+	id_map<persona *>::iterator end_pers();
 
-	std::map<std::string, persona *>::iterator next_pers(const std::map<std::string, persona *>::iterator &);
+	id_map<persona *>::iterator next_pers(const id_map<persona *>::iterator &);
 
 
 	const char *why()
@@ -405,6 +480,16 @@ public:
 
 int normalize_and_hexhash(const EVP_MD *, std::string &s, std::string &);
 
+int dh_group_nid(const std::string &);
+
+int dh_group_nid(const DH *);
+
+DH *dh_group_params(int);
+
+const EC_GROUP *ec_group(int);
+
+bool is_xdh(int);
+
 } // namespace
 
 #endif
@@ -58,18 +58,32 @@ string kex_id = "kex-id=";
 string aad_tag = "gcm-aad-tag=";
 string cfg_num = "cfg-num=";
 
+// content of tree-hashed detached signatures: tree-hash=chunksize:hexhash
+string tree_hash = "tree-hash=";
+
+// content of signed manifests: manifest=#files, followed by sha256sum(1) like lines
+string manifest = "manifest=";
+
 // if no ephemeral DH keys are left, this signals standart RSA encrypted secret
 string rsa_kex_id = "00000000";
 
 // if no ephemeral ECDH keys are left, the EC persona key is used for ECDH kex
 string ec_kex_id = "11111111";
 
+// message key taken from the ratchet session with the peer, no Kex at all
+string ratchet_kex_id = "22222222";
+
+// ratchet-key=b64 ratchet key:pn:n:check for ratchet messages, or b64 ratchet key:b64 masked root key for offers
+string ratchet_key = "ratchet-key=";
+
 
 // rythmz=persona-hash:key-hash:sign-hash:crypto:IV
 string algos = "rythmz=";
 
 string ec = "ec";
 string rsa = "rsa";
+string ed25519 = "ed25519";
+string ed448 = "ed448";
 string dh = "dh";
 string unknown = "unknown";
 
@@ -58,14 +58,22 @@ extern std::string aad_tag;
 
 extern std::string cfg_num;
 
+extern std::string tree_hash;
+
+extern std::string manifest;
+
 extern std::string rsa_kex_id;
 
 extern std::string ec_kex_id;
 
+extern std::string ratchet_kex_id;
+
+extern std::string ratchet_key;
+
 extern std::string algos;
 
 // persona types
-extern std::string ec, dh, rsa, unknown;
+extern std::string ec, dh, rsa, ed25519, ed448, unknown;
 
 }
 
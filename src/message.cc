@@ -24,6 +24,15 @@
 #include <algorithm>
 #include <iterator>
 #include <iostream>
+#include <thread>
+#include <system_error>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
 
 #include "misc.h"
 #include "base64.h"
@@ -31,6 +40,9 @@
 #include "message.h"
 #include "deleters.h"
 #include "marker.h"
+#include "ringbuf.h"
+#include "dhtab.h"
+#include "ratchet.h"
 
 
 extern "C" {
@@ -39,6 +51,8 @@ extern "C" {
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
 #include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/hmac.h>
 }
 
 #include "missing.h"
@@ -51,6 +65,59 @@ using namespace std;
 static string::size_type lwidth = 80, max_sane_string = 0x1000, min_entropy_bytes = 16;
 
 
+// chunk size and number of in-flight chunks per stage of the encrypt pipeline
+static const size_t enc_chunk_size = 0x100000*3;
+enum { enc_pipe_slots = 4 };
+
+struct enc_chunk {
+	unique_ptr<unsigned char[]> bin{nullptr};
+	int len{0};
+	string text{""};
+	bool last{0};
+};
+
+typedef spsc_ring<enc_chunk *, enc_pipe_slots> enc_ring;
+
+
+// Base64 encode ciphertext into lines of lwidth. 60 binary bytes make exactly one
+// line, so remainders are carried into the next chunk. This way the output is the same
+// as if the whole ciphertext was encoded at once.
+static void b64_wrap(const unsigned char *bin, size_t len, string &carry, string &out, bool last)
+{
+	const size_t lbin = lwidth/4*3;
+	string b64 = "";
+
+	if (carry.size() > 0) {
+		size_t n = lbin - carry.size() < len ? lbin - carry.size() : len;
+		carry.append(reinterpret_cast<const char *>(bin), n);
+		bin += n;
+		len -= n;
+		if (carry.size() == lbin) {
+			out += b64_encode(carry, b64);
+			out += "\n";
+			carry.clear();
+		}
+	}
+
+	size_t full = len - len % lbin;
+	if (full > 0) {
+		b64_encode(reinterpret_cast<const char *>(bin), full, b64);
+		out.reserve(out.size() + b64.size() + b64.size()/lwidth);
+		for (string::size_type idx = 0; idx < b64.size(); idx += lwidth) {
+			out.append(b64, idx, lwidth);
+			out += "\n";
+		}
+	}
+	carry.append(reinterpret_cast<const char *>(bin) + full, len - full);
+
+	if (last && carry.size() > 0) {
+		out += b64_encode(carry, b64);
+		out += "\n";
+		carry.clear();
+	}
+}
+
+
 //                                                                                                                                          64
 static int kdf_v123(unsigned int vers, unsigned char *secret, int slen, const string &s1, const string &s2, unsigned char key[OPMSG_MAX_KEY_LENGTH])
 {
@@ -61,10 +128,10 @@ static int kdf_v123(unsigned int vers, unsigned char *secret, int slen, const st
 		return -1;
 	memset(key, 0xff, OPMSG_MAX_KEY_LENGTH);
 
-	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(EVP_MD_CTX_create(), EVP_MD_CTX_delete);
+	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(md_ctx_new(), md_ctx_free);
 	if (!md_ctx.get())
 		return -1;
-	if (EVP_DigestInit_ex(md_ctx.get(), EVP_sha512(), nullptr) != 1)
+	if (EVP_DigestInit_ex(md_ctx.get(), fetch_md(EVP_sha512()), nullptr) != 1)
 		return -1;
 	if (EVP_DigestUpdate(md_ctx.get(), secret, slen) != 1)
 		return -1;
@@ -110,38 +177,80 @@ static int kdf_v1(unsigned char *secret, int slen, unsigned char key[OPMSG_MAX_K
 }
 
 
-int message::sign(const string &msg, persona *src_persona, string &result)
+// Ed25519/Ed448 only sign in one shot
+static bool is_prehash_key(EVP_PKEY *evp)
 {
-	size_t siglen = 0;
-	RSA *rsa = nullptr;
+#ifdef HAVE_X25519
+	int type = EVP_PKEY_base_id(evp);
+	return type == EVP_PKEY_ED25519 || type == EVP_PKEY_ED448;
+#else
+	return false;
+#endif
+}
 
-	result = "";
 
+int message::sign_init(EVP_MD_CTX *md_ctx, persona *src_persona)
+{
 	if (!src_persona->can_sign())
 		return build_error("sign:: Persona has no pkey.", -1);
 
 	// do not take ownership
 	EVP_PKEY *evp = src_persona->get_pkey()->d_priv;
 
-	if ((rsa = EVP_PKEY_get1_RSA(evp))) {
-		RSA_blinding_on(rsa, nullptr);
-		RSA_free(rsa);
-		rsa = nullptr;
+	sign_evp = evp;
+	sign_prehash = is_prehash_key(evp);
+	if (sign_prehash) {
+		if (EVP_DigestInit_ex(md_ctx, id2md(shash_id), nullptr) != 1)
+			return build_error("sign::EVP_DigestInit_ex:", -1);
+		return 1;
 	}
 
-	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(EVP_MD_CTX_create(), EVP_MD_CTX_delete);
-	if (!md_ctx.get())
-		return build_error("sign::EVP_MD_CTX_create:", -1);
-	if (EVP_DigestSignInit(md_ctx.get(), nullptr, algo2md(shash), nullptr, evp) != 1)
+	// start from the persona's prepared context
+	EVP_MD_CTX *tmpl = src_persona->get_pkey()->sign_ctx(id2md(shash_id));
+	if (!tmpl)
 		return build_error("sign::EVP_DigestSignInit:", -1);
-	if (EVP_DigestSignUpdate(md_ctx.get(), msg.c_str(), msg.size()) != 1)
-		return build_error("sign::EVP_DigestSignUpdate:", -1);
-	if (EVP_DigestSignFinal(md_ctx.get(), nullptr, &siglen) != 1)
-		return build_error("sign::EVP_DigestSignFinal: Message signing failed", -1);
+	if (EVP_MD_CTX_copy_ex(md_ctx, tmpl) != 1)
+		return build_error("sign::EVP_MD_CTX_copy_ex:", -1);
+	return 1;
+}
+
+
+int message::sign_update(EVP_MD_CTX *md_ctx, const void *buf, size_t len)
+{
+	if (sign_prehash)
+		return EVP_DigestUpdate(md_ctx, buf, len);
+	return EVP_DigestSignUpdate(md_ctx, buf, len);
+}
+
+
+int message::sign_final(EVP_MD_CTX *md_ctx, string &result)
+{
+	size_t siglen = 0;
+	unique_ptr<unsigned char[]> sig(nullptr);
 
-	unique_ptr<unsigned char[]> sig(new (nothrow) unsigned char[siglen]);
-	if (!sig.get() || EVP_DigestSignFinal(md_ctx.get(), sig.get(), &siglen) != 1)
-		return build_error("sign:: EVP_DigestSignFinal: Message signing failed", -1);
+	result = "";
+
+	if (sign_prehash) {
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		unsigned int dlen = 0;
+		if (EVP_DigestFinal_ex(md_ctx, digest, &dlen) != 1)
+			return build_error("sign::EVP_DigestFinal_ex: Message signing failed", -1);
+		unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> ed_ctx(md_ctx_new(), md_ctx_free);
+		if (!ed_ctx.get() || EVP_DigestSignInit(ed_ctx.get(), nullptr, nullptr, nullptr, sign_evp) != 1)
+			return build_error("sign::EVP_DigestSignInit:", -1);
+		if (EVP_DigestSign(ed_ctx.get(), nullptr, &siglen, digest, dlen) != 1)
+			return build_error("sign::EVP_DigestSign: Message signing failed", -1);
+		sig.reset(new (nothrow) unsigned char[siglen]);
+		if (!sig.get() || EVP_DigestSign(ed_ctx.get(), sig.get(), &siglen, digest, dlen) != 1)
+			return build_error("sign::EVP_DigestSign: Message signing failed", -1);
+	} else {
+		if (EVP_DigestSignFinal(md_ctx, nullptr, &siglen) != 1)
+			return build_error("sign::EVP_DigestSignFinal: Message signing failed", -1);
+
+		sig.reset(new (nothrow) unsigned char[siglen]);
+		if (!sig.get() || EVP_DigestSignFinal(md_ctx, sig.get(), &siglen) != 1)
+			return build_error("sign:: EVP_DigestSignFinal: Message signing failed", -1);
+	}
 
 	string s = "";
 	b64_encode(reinterpret_cast<char *>(sig.get()), siglen, s);
@@ -159,6 +268,22 @@ int message::sign(const string &msg, persona *src_persona, string &result)
 }
 
 
+int message::sign(const string &msg, persona *src_persona, string &result)
+{
+	result = "";
+
+	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(md_ctx_new(), md_ctx_free);
+	if (!md_ctx.get())
+		return build_error("sign::EVP_MD_CTX_create:", -1);
+	if (sign_init(md_ctx.get(), src_persona) != 1)
+		return -1;
+	if (sign_update(md_ctx.get(), msg.c_str(), msg.size()) != 1)
+		return build_error("sign::EVP_DigestSignUpdate:", -1);
+
+	return sign_final(md_ctx.get(), result);
+}
+
+
 int message::encrypt(string &raw, persona *src_persona, persona *dst_persona)
 {
 	unsigned char iv[OPMSG_MAX_IV_LENGTH], iv_kdf[OPMSG_MAX_KEY_LENGTH];
@@ -169,7 +294,7 @@ int message::encrypt(string &raw, persona *src_persona, persona *dst_persona)
 	vector<string> b64pubkeys;
 	string outmsg = "", b64sig = "", iv_b64 = "", b64_aad_tag = "";
 	string::size_type aad_tag_insert_pos = string::npos;
-	bool no_dh_key = (kex_id_hex == marker::rsa_kex_id);
+	bool no_dh_key = (kex_id_hex == marker::rsa_kex_id || kex_id_hex == marker::ratchet_kex_id);
 	int ecode = 0;
 	size_t n = 0;
 	unsigned int i = 0;
@@ -182,7 +307,7 @@ int message::encrypt(string &raw, persona *src_persona, persona *dst_persona)
 	if (!src_persona || !dst_persona)
 		return build_error("encrypt: No src/dst personas specified!", -1);
 
-	if (!is_valid_halgo(phash) || !is_valid_halgo(khash) || !is_valid_halgo(shash) || !is_valid_calgo(calgo))
+	if (!is_valid_halgo(phash) || !is_valid_halgo(khash) || shash_id == HALGO_INVALID || calgo_id == CALGO_INVALID)
 		return build_error("encrypt: Invalid algo name(s).", -1);
 
 	if (!is_hex_hash(src_id_hex) || !is_hex_hash(dst_id_hex))
@@ -228,7 +353,7 @@ int message::encrypt(string &raw, persona *src_persona, persona *dst_persona)
 	outmsg += marker::kex_id + kex_id_hex + "\n";
 
 	// null encryption: plaintext signing case
-	if (calgo == "null") {
+	if (calgo_id == CALGO_NULL) {
 		outmsg += marker::opmsg_databegin;
 		outmsg += raw;
 		if (sign(outmsg, src_persona, b64sig) != 1)
@@ -247,7 +372,7 @@ int message::encrypt(string &raw, persona *src_persona, persona *dst_persona)
 		return 1;
 	}
 
-	bool has_aad = (calgo.find("gcm") != string::npos || calgo == "chacha20-poly1305");
+	bool has_aad = is_aead(calgo_id);
 
 	// append public (EC)DH keys
 	for (auto it = ecdh_keys.begin(); it != ecdh_keys.end(); ++it) {
@@ -262,14 +387,41 @@ int message::encrypt(string &raw, persona *src_persona, persona *dst_persona)
 	if (!secret.get())
 		return build_error("encrypt: OOM", -1);
 
-	if (!ec_dh.empty() && (EVP_PKEY_base_id(ec_dh[0]->d_pub) == EVP_PKEY_DH)) {
+	unique_ptr<ratchet> rt(nullptr);
+	string rt_hdr = "";
+
+	if (kex_id_hex == marker::ratchet_kex_id) {
+		// running ratchet session: message key from the sending chain, no Kex
+		rt.reset(new (nothrow) ratchet(cfgbase, src_id_hex, dst_id_hex));
+		if (!rt.get())
+			return build_error("encrypt: OOM", -1);
+		if (rt->load() != 1 || rt->send_key(secret.get(), rt_hdr) < 0)
+			return build_error("encrypt::" + string(rt->why()), -1);
+		slen = ratchet::KEY_LEN;
+
+	} else if (!ec_dh.empty() && (EVP_PKEY_base_id(ec_dh[0]->d_pub) == EVP_PKEY_DH)) {
 		const BIGNUM *his_pub_key = nullptr, *my_pub_key = nullptr;
 		unique_ptr<DH, DH_del> dh(EVP_PKEY_get1_DH(ec_dh[0]->d_pub), DH_free);
 		if (!dh.get())
 			return build_error("encrypt: OOM", -1);
-		unique_ptr<DH, DH_del> mydh(DHparams_dup(dh.get()), DH_free);
-		if (!mydh.get() || DH_generate_key(mydh.get()) != 1 || DH_check(mydh.get(), &ecode) != 1)
+		// named groups come pre-validated from the group cache
+		int nid = dh_group_nid(dh.get()), r = 0;
+		unique_ptr<DH, DH_del> mydh(nid != NID_undef ? dh_group_params(nid) : DHparams_dup(dh.get()), DH_free);
+		if (!mydh.get())
+			return build_error("encrypt: OOM", -1);
+
+		// the peer's DH params; table is kept in its persona dir
+		if (nid == NID_undef && dh_precompute) {
+			if ((r = dh_generate_key_tab(mydh.get(), persona_dir(cfgbase, dst_id_hex) + "/dhparams.tab")) < 0)
+				return build_error("encrypt::dh_generate_key_tab: Cannot generate DH key ", -1);
+		}
+		if ((r == 0 && DH_generate_key(mydh.get()) != 1) || (r == 0 && nid == NID_undef && DH_check(mydh.get(), &ecode) != 1))
 			return build_error("encrypt::DH_generate_key: Cannot generate DH key ", -1);
+
+		// table params were checked when the table was built
+		opmsg::DH_get0_key(mydh.get(), &my_pub_key, nullptr);
+		if (r == 1 && (DH_check_pub_key(mydh.get(), my_pub_key, &ecode) != 1 || ecode != 0))
+			return build_error("encrypt::DH_check_pub_key: Cannot generate DH key ", -1);
 		// re-calculate size for secret in the DH case; it differs
 		slen = DH_size(mydh.get());
 		secret.reset(new (nothrow) unsigned char[slen]);
@@ -287,44 +439,81 @@ int message::encrypt(string &raw, persona *src_persona, persona *dst_persona)
 		b64_encode(reinterpret_cast<char *>(bin.get()), binlen, s);
 		b64pubkeys.push_back(s);
 
-	} else if (!ec_dh.empty() && (EVP_PKEY_base_id(ec_dh[0]->d_pub) == EVP_PKEY_EC)) {
+	} else if (!ec_dh.empty() && (EVP_PKEY_base_id(ec_dh[0]->d_pub) == EVP_PKEY_EC || is_xdh(EVP_PKEY_base_id(ec_dh[0]->d_pub)))) {
 
 		vector<unsigned char> secret_v;
 		secret_v.reserve(0x1000);	// to avoid re-allocation
 		slen = 0;
 
 		for (unsigned int i = 0; i < ec_dh.size(); ++i) {
-			if (!ec_dh[i]->can_encrypt() || EVP_PKEY_base_id(ec_dh[i]->d_pub) != EVP_PKEY_EC)
+			int ktype = EVP_PKEY_base_id(ec_dh[i]->d_pub);
+			if (!ec_dh[i]->can_encrypt() || (ktype != EVP_PKEY_EC && !is_xdh(ktype)))
 				return build_error("encrypt: Found non-ECDH key in ECDH loop.", -1);
 
-			unique_ptr<EVP_PKEY_CTX, EVP_PKEY_CTX_del> ctx1(EVP_PKEY_CTX_new(ec_dh[i]->d_pub, nullptr), EVP_PKEY_CTX_free);
-			if (!ctx1.get() || EVP_PKEY_keygen_init(ctx1.get()) != 1)
-				return build_error("encrypt::EVP_PKEY_keygen_init:", -1);
-			EVP_PKEY *ppkey = nullptr;
-			if (EVP_PKEY_keygen(ctx1.get(), &ppkey) != 1)
-				return build_error("encrypt::EVP_PKEY_keygen:", -1);
-			unique_ptr<EVP_PKEY, EVP_PKEY_del> my_ec(ppkey, EVP_PKEY_free);
-			unique_ptr<EVP_PKEY_CTX, EVP_PKEY_CTX_del> ctx2(EVP_PKEY_CTX_new(my_ec.get(), nullptr), EVP_PKEY_CTX_free);
-			if (EVP_PKEY_derive_init(ctx2.get()) != 1)
-				return build_error("encrypt::EVP_PKEY_derive_init: ", -1);
-			if (EVP_PKEY_derive_set_peer(ctx2.get(), ec_dh[i]->d_pub) != 1)
-				return build_error("encrypt::EVP_PKEY_derive_set_peer: ", -1);
-
-			// find len
-			size_t len = 0;
-			if (EVP_PKEY_derive(ctx2.get(), nullptr, &len) != 1)
-				return build_error("encrypt::EVP_PKEY_derive: ", -1);
+#ifdef HAVE_X25519
+			// X25519/X448: derive via EVP and send the raw public key
+			if (is_xdh(ktype)) {
+				unique_ptr<EVP_PKEY_CTX, EVP_PKEY_CTX_del> kctx(EVP_PKEY_CTX_new_id(ktype, nullptr), EVP_PKEY_CTX_free);
+				EVP_PKEY *key = nullptr;
+				if (!kctx.get() || EVP_PKEY_keygen_init(kctx.get()) != 1 || EVP_PKEY_keygen(kctx.get(), &key) != 1)
+					return build_error("encrypt::EVP_PKEY_keygen:", -1);
+				unique_ptr<EVP_PKEY, EVP_PKEY_del> my_key(key, EVP_PKEY_free);
+
+				unique_ptr<EVP_PKEY_CTX, EVP_PKEY_CTX_del> dctx(EVP_PKEY_CTX_new(my_key.get(), nullptr), EVP_PKEY_CTX_free);
+				if (!dctx.get() || EVP_PKEY_derive_init(dctx.get()) != 1)
+					return build_error("encrypt::EVP_PKEY_derive_init:", -1);
+				if (EVP_PKEY_derive_set_peer(dctx.get(), ec_dh[i]->d_pub) != 1)
+					return build_error("encrypt::EVP_PKEY_derive_set_peer:", -1);
+				size_t len = 0;
+				if (EVP_PKEY_derive(dctx.get(), nullptr, &len) != 1)
+					return build_error("encrypt::EVP_PKEY_derive:", -1);
+				if ((unsigned int)slen > max_sane_string || len > max_sane_string || len < min_entropy_bytes)
+					return build_error("encrypt: Insane large or too small derived keylen.", -1);
+				vector<unsigned char> secret_i(len, 0);
+				if (EVP_PKEY_derive(dctx.get(), &secret_i[0], &len) != 1)
+					return build_error("encrypt::EVP_PKEY_derive for key " + kex_id_hex, -1);
+				secret_v.insert(secret_v.end(), secret_i.begin(), secret_i.begin() + len);
+				slen += (int)len;
+
+				unsigned char raw[64];
+				size_t rawlen = sizeof(raw);
+				if (EVP_PKEY_get_raw_public_key(my_key.get(), raw, &rawlen) != 1)
+					return build_error("encrypt::EVP_PKEY_get_raw_public_key:", -1);
+
+				string s = "";
+				b64_encode(reinterpret_cast<char *>(raw), rawlen, s);
+				b64pubkeys.push_back(s);
+				continue;
+			}
+#endif
+
+			// use the shared group of the peer's curve; only use the peer's one for unnamed curves
+			unique_ptr<EC_KEY, EC_KEY_del> peer_ec(EVP_PKEY_get1_EC_KEY(ec_dh[i]->d_pub), EC_KEY_free);
+			if (!peer_ec.get())
+				return build_error("encrypt::EVP_PKEY_get1_EC_KEY:", -1);
+			if (EC_KEY_check_key(peer_ec.get()) != 1)
+				return build_error("encrypt::EC_KEY_check_key:", -1);
+			const EC_GROUP *grp = ec_group(EC_GROUP_get_curve_name(EC_KEY_get0_group(peer_ec.get())));
+			if (!grp)
+				grp = EC_KEY_get0_group(peer_ec.get());
+
+			unique_ptr<EC_KEY, EC_KEY_del> my_ec(EC_KEY_new(), EC_KEY_free);
+			if (!my_ec.get() || EC_KEY_set_group(my_ec.get(), grp) != 1)
+				return build_error("encrypt::EC_KEY_set_group:", -1);
+			if (EC_KEY_generate_key(my_ec.get()) != 1)
+				return build_error("encrypt::EC_KEY_generate_key:", -1);
+
+			// ECDH straight on the EC keys, same result as EVP_PKEY_derive()
+			size_t len = (EC_GROUP_get_degree(grp) + 7)/8;
 			if ((unsigned int)slen > max_sane_string || len > max_sane_string || len < min_entropy_bytes)
 				return build_error("encrypt: Insane large or too small derived keylen.", -1);
 			vector<unsigned char> secret_i(len, 0);
 
-			if (EVP_PKEY_derive(ctx2.get(), &secret_i[0], &len) != 1)
-				return build_error("encrypt::EVP_PKEY_derive for key " + kex_id_hex, -1);
+			if (ECDH_compute_key(&secret_i[0], len, EC_KEY_get0_public_key(peer_ec.get()), my_ec.get(), nullptr) != (int)len)
+				return build_error("encrypt::ECDH_compute_key for key " + kex_id_hex, -1);
 			secret_v.insert(secret_v.end(), secret_i.begin(), secret_i.end());
 			slen += (int)len;
-			unique_ptr<EC_KEY, EC_KEY_del> ec(EVP_PKEY_get1_EC_KEY(my_ec.get()), EC_KEY_free);
-			unique_ptr<BIGNUM, BIGNUM_del> bn(EC_POINT_point2bn(EC_KEY_get0_group(ec.get()),
-		        	                                            EC_KEY_get0_public_key(ec.get()),
+			unique_ptr<BIGNUM, BIGNUM_del> bn(EC_POINT_point2bn(grp, EC_KEY_get0_public_key(my_ec.get()),
 		                	                                    POINT_CONVERSION_COMPRESSED, nullptr, nullptr), BN_free);
 			if (!bn.get())
 				return build_error("encrypt::EC_POINT_point2bn:", -1);
@@ -381,6 +570,15 @@ int message::encrypt(string &raw, persona *src_persona, persona *dst_persona)
 	if (slen < (int)min_entropy_bytes)
 		return build_error("encrypt: Huh? Generated secret len of insufficient entropy size.", -1);
 
+	// no session with peer yet? Offer one along with this message
+	if (use_ratchet && !rt.get()) {
+		rt.reset(new (nothrow) ratchet(cfgbase, src_id_hex, dst_id_hex));
+		if (!rt.get())
+			return build_error("encrypt: OOM", -1);
+		if (rt->load() < 0 || (!rt->can_send() && rt->offer(secret.get(), slen, rt_hdr) < 0))
+			return build_error("encrypt::" + string(rt->why()), -1);
+	}
+
 	for (string &s : b64pubkeys) {
 		outmsg += marker::kex_begin;
 
@@ -394,15 +592,18 @@ int message::encrypt(string &raw, persona *src_persona, persona *dst_persona)
 		outmsg += "\n";
 	}
 
+	if (rt_hdr.size() > 0)
+		outmsg += marker::ratchet_key + rt_hdr + "\n";
+
 	outmsg += marker::opmsg_databegin;
 
 	unsigned char key[OPMSG_MAX_KEY_LENGTH];
 	if (kdf_v123(version, secret.get(), slen, src_id_hex, dst_id_hex, key) < 0)
 		return build_error("encrypt: Error deriving key: ", -1);
-	unique_ptr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_del> c_ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+	unique_ptr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_del> c_ctx(cipher_ctx_new(), cipher_ctx_free);
 	if (!c_ctx.get())
 		return build_error("encrypt::EVP_CIPHER_CTX_new: ", -1);
-	if (EVP_EncryptInit_ex(c_ctx.get(), algo2cipher(calgo), nullptr, key, iv) != 1)
+	if (EVP_EncryptInit_ex(c_ctx.get(), id2cipher(calgo_id), nullptr, key, iv) != 1)
 		return build_error("encrypt::EVP_EncryptInit_ex: ", -1);
 
 	// GCM ciphers need special treatment, the persona src id is used as AAD
@@ -413,28 +614,39 @@ int message::encrypt(string &raw, persona *src_persona, persona *dst_persona)
 	}
 	EVP_CIPHER_CTX_set_padding(c_ctx.get(), 1);
 
-	string b64_enc = "";
-	const size_t blen = 8000000*3;
-	unique_ptr<unsigned char[]> outbuf(new (nothrow) unsigned char[blen + EVP_MAX_BLOCK_LENGTH]);
-	if (!outbuf.get())
-		return build_error("encrypt:: OOM", -1);
-	int outlen = 0;
-	string::size_type idx = 0, rawsize = raw.size(), b64idx = 0, b64size = 0;
-	while (idx < rawsize) {
-		outlen = 0;
-		if (rawsize - idx < blen)
-			n = rawsize - idx;
-		else
-			n = blen;
-		if (EVP_EncryptUpdate(c_ctx.get(), outbuf.get(), &outlen, (unsigned char *)(raw.c_str() + idx), n) != 1)
+	// Without AAD tag, the signed header is complete now and the signature digest
+	// can run alongside encryption. Otherwise the tag is inserted into the header
+	// after the last chunk and we have to sign the whole thing afterwards.
+	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> sig_ctx(nullptr, md_ctx_free);
+	if (!has_aad) {
+		sig_ctx.reset(md_ctx_new());
+		if (!sig_ctx.get())
+			return build_error("encrypt::EVP_MD_CTX_create:", -1);
+		if (sign_init(sig_ctx.get(), src_persona) != 1)
+			return build_error("encrypt::" + err, -1);
+		if (sign_update(sig_ctx.get(), outmsg.c_str(), outmsg.size()) != 1)
+			return build_error("encrypt::EVP_DigestSignUpdate:", -1);
+	}
+
+	string carry = "";
+	bool sig_failed = 0;
+	string::size_type idx = 0, rawsize = raw.size();
+
+	// the three stages: cipher -> base64/wrap -> signature digest and output
+	auto cipher = [&](enc_chunk *c) -> int {
+		c->len = 0;
+		c->last = 0;
+		n = rawsize - idx < enc_chunk_size ? rawsize - idx : enc_chunk_size;
+		if (EVP_EncryptUpdate(c_ctx.get(), c->bin.get(), &c->len, (unsigned char *)(raw.c_str() + idx), n) != 1)
 			return build_error("encrypt::EVP_EncryptUpdate:", -1);
 		idx += n;
 		// if last chunk, also add padding from block cipher
 		if (idx == rawsize) {
 			int padlen = 0;
-			if (EVP_EncryptFinal_ex(c_ctx.get(), outbuf.get() + outlen, &padlen) != 1)
+			if (EVP_EncryptFinal_ex(c_ctx.get(), c->bin.get() + c->len, &padlen) != 1)
 				return build_error("encrypt::EVP_EncryptFinal_ex:", -1);
-			outlen += padlen;
+			c->len += padlen;
+			c->last = 1;
 			if (has_aad) {
 				if (EVP_CIPHER_CTX_ctrl(c_ctx.get(), EVP_CTRL_GCM_GET_TAG, sizeof(aad_tag), aad_tag) != 1)
 					return build_error("encrypt::EVP_CIPHER_CTX_ctrl:", -1);
@@ -443,24 +655,124 @@ int message::encrypt(string &raw, persona *src_persona, persona *dst_persona)
 				b64_aad_tag += "\n";
 			}
 		}
-		b64_encode(reinterpret_cast<const char *>(outbuf.get()), outlen, b64_enc);
-		b64size = b64_enc.size();
-		b64idx = 0;
-		while (b64idx < b64size) {
-			outmsg += b64_enc.substr(b64idx, lwidth);
-			outmsg += "\n";
-			b64idx += lwidth;
+		return 0;
+	};
+
+	auto wrap = [&](enc_chunk *in, enc_chunk *out) {
+		out->text.clear();
+		b64_wrap(in->bin.get(), in->len, carry, out->text, in->last);
+		out->last = in->last;
+	};
+
+	auto sink = [&](enc_chunk *c) {
+		if (sig_ctx.get() && sign_update(sig_ctx.get(), c->text.c_str(), c->text.size()) != 1)
+			sig_failed = 1;
+		outmsg += c->text;
+	};
+
+	bool piped = 0;
+	if (rawsize > enc_chunk_size) {
+		enc_chunk bins[enc_pipe_slots], texts[enc_pipe_slots];
+		enc_ring bin_full, bin_free, text_full, text_free;
+
+		for (i = 0; i < enc_pipe_slots; ++i) {
+			bins[i].bin.reset(new (nothrow) unsigned char[enc_chunk_size + EVP_MAX_BLOCK_LENGTH]);
+			if (!bins[i].bin.get())
+				return build_error("encrypt:: OOM", -1);
+			bin_free.push(&bins[i]);
+			text_free.push(&texts[i]);
+		}
+
+		thread b64_stage, sig_stage;
+		try {
+			b64_stage = thread([&]{
+				enc_chunk *in = nullptr, *out = nullptr;
+				bool last = 0;
+				do {
+					bin_full.pop_wait(in);
+					text_free.pop_wait(out);
+					wrap(in, out);
+					last = in->last;
+					bin_free.push_wait(in);
+					text_full.push_wait(out);
+				} while (!last);
+			});
+
+			sig_stage = thread([&]{
+				enc_chunk *c = nullptr;
+				bool last = 0;
+				do {
+					text_full.pop_wait(c);
+					sink(c);
+					last = c->last;
+					text_free.push_wait(c);
+				} while (!last);
+			});
+			piped = 1;
+		} catch (const system_error &) {
+			// no thread to spare: end a started b64 stage with an empty last chunk
+			// and do it all in this thread below
+			if (b64_stage.joinable()) {
+				enc_chunk *c = nullptr;
+				bin_free.pop_wait(c);
+				c->len = 0;
+				c->last = 1;
+				bin_full.push_wait(c);
+				b64_stage.join();
+				carry.clear();
+			}
+		}
+
+		int r = 0;
+		enc_chunk *c = nullptr;
+		while (piped && idx < rawsize) {
+			bin_free.pop_wait(c);
+			if ((r = cipher(c)) < 0) {
+				// drain the pipeline so the stages can be joined
+				c->len = 0;
+				c->last = 1;
+			}
+			bin_full.push_wait(c);
+			if (r < 0)
+				break;
+		}
+
+		if (piped) {
+			b64_stage.join();
+			sig_stage.join();
+		}
+
+		if (r < 0)
+			return -1;
+	}
+
+	if (!piped) {
+		// small messages or no threads: same stages back to back
+		enc_chunk bin, text;
+		bin.bin.reset(new (nothrow) unsigned char[enc_chunk_size + EVP_MAX_BLOCK_LENGTH]);
+		if (!bin.bin.get())
+			return build_error("encrypt:: OOM", -1);
+		while (idx < rawsize) {
+			if (cipher(&bin) < 0)
+				return -1;
+			wrap(&bin, &text);
+			sink(&text);
 		}
-		b64_enc.clear();
 	}
 
 	c_ctx.reset();
 	raw.clear();
 
+	if (sig_failed)
+		return build_error("encrypt::EVP_DigestSignUpdate: Message signing failed", -1);
+
 	if (b64_aad_tag.size() > 0)
 		outmsg.insert(aad_tag_insert_pos, b64_aad_tag);
 
-	if (sign(outmsg, src_persona, b64sig) != 1)
+	if (sig_ctx.get()) {
+		if (sign_final(sig_ctx.get(), b64sig) != 1)
+			return build_error("encrypt::" + err, -1);
+	} else if (sign(outmsg, src_persona, b64sig) != 1)
 		return build_error("encrypt::" + err, -1);
 
 	outmsg.insert(0, b64sig);
@@ -473,6 +785,10 @@ int message::encrypt(string &raw, persona *src_persona, persona *dst_persona)
 	outmsg.insert(0, marker::opmsg_begin);
 	outmsg += marker::opmsg_end;
 
+	// commit the advanced (or offered) session only for messages that were made
+	if (rt_hdr.size() > 0 && rt->store() < 0)
+		return build_error("encrypt::" + string(rt->why()), -1);
+
 	raw = outmsg;
 
 	return 1;
@@ -519,6 +835,15 @@ int message::parse_hdr(string &hdr, vector<string> &kexdhs, vector<char> &aad_ta
 		aad_tag.insert(aad_tag.end(), s.begin(), s.end());
 	}
 
+	// ratchet message or session offer
+	ratchet_hdr = "";
+	if ((pos = hdr.find(marker::ratchet_key)) != string::npos) {
+		pos += marker::ratchet_key.size();
+		if ((nl = hdr.find("\n", pos)) == string::npos || nl - pos > max_sane_string)
+			return build_error("parse_hdr: Error finding end of ratchet key.", -1);
+		ratchet_hdr = hdr.substr(pos, nl - pos);
+	}
+
 	if ((pos = hdr.find(marker::kex_id)) == string::npos)
 		return build_error("parse_hdr: Not in OPMSG format (1).", -1);
 	pos += marker::kex_id.size();
@@ -584,13 +909,244 @@ int message::parse_hdr(string &hdr, vector<string> &kexdhs, vector<char> &aad_ta
 }
 
 
+// the hex id following marker m in raw[0, end), as parse_hdr() would find it
+static bool hdr_id(const string &raw, string::size_type end, const string &m, string &id)
+{
+	string::size_type pos = raw.find(m), nl = string::npos;
+	if (pos == string::npos || pos >= end)
+		return 0;
+	pos += m.size();
+	if ((nl = raw.find("\n", pos)) == string::npos || nl > end || nl - pos > max_sane_string)
+		return 0;
+	id = raw.substr(pos, nl - pos);
+	return is_hex_hash(id);
+}
+
+
+// The key cache entries are encrypted with AES-256-GCM under a key derived from the dst persona's
+// private key: IV | tag | (message key | src name). They live in keycache/<kex id>/<message hash>,
+// so deleting a Kex key can drop the keys of all messages it opened.
+enum {
+	KEYCACHE_IV_LEN		= 12,
+	KEYCACHE_TAG_LEN	= 16
+};
+
+
+static int keycache_kek(persona *p, unsigned char kek[32])
+{
+	unsigned char *der = nullptr;
+	unsigned int len = 32;
+	int r = 0, derlen = 0;
+
+	if (!p->can_decrypt() || (derlen = i2d_PrivateKey(p->get_pkey()->d_priv, &der)) <= 0)
+		return -1;
+	if (!HMAC(EVP_sha256(), der, derlen, reinterpret_cast<const unsigned char *>("opmsg keycache"), 14, kek, &len))
+		r = -1;
+	OPENSSL_cleanse(der, derlen);
+	OPENSSL_free(der);
+	return r;
+}
+
+
+// drop entries older than the given number of days, and the Kex dirs this empties
+static void keycache_sweep(const string &dir, unsigned int days)
+{
+	time_t expire = time(nullptr) - 86400*(time_t)days;
+	struct stat st;
+	string kdir = "", file = "";
+
+	DIR *d = opendir(dir.c_str()), *kd = nullptr;
+	if (!d)
+		return;
+
+	dirent *de = nullptr, *kde = nullptr;
+	while ((de = readdir(d)) != nullptr) {
+		if (de->d_name[0] == '.')
+			continue;
+		kdir = dir + "/" + de->d_name;
+		if (lstat(kdir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode) || (kd = opendir(kdir.c_str())) == nullptr)
+			continue;
+		while ((kde = readdir(kd)) != nullptr) {
+			if (kde->d_name[0] == '.')
+				continue;
+			file = kdir + "/" + kde->d_name;
+			if (lstat(file.c_str(), &st) == 0 && st.st_mtime < expire)
+				unlink(file.c_str());
+		}
+		closedir(kd);
+		rmdir(kdir.c_str());
+	}
+	closedir(d);
+}
+
+
+// returns 1 and the message key if found in cache, 0 otherwise. Needs dst_id_hex and kex_id_hex.
+int message::keycache_get(const string &mhash, unsigned char *key)
+{
+	string file = persona_dir(cfgbase, dst_id_hex) + "/keycache/" + kex_id_hex + "/" + mhash;
+	unique_ptr<FILE, FILE_del> f(fopen(file.c_str(), "r"), ffclose);
+	if (!f.get())
+		return 0;
+
+	struct stat st;
+	if (fstat(fileno(f.get()), &st) < 0)
+		return 0;
+	if (st.st_mtime < time(nullptr) - 86400*(time_t)keycache_expire) {
+		f.reset();
+		unlink(file.c_str());
+		return 0;
+	}
+
+	unsigned char buf[KEYCACHE_IV_LEN + KEYCACHE_TAG_LEN + OPMSG_MAX_KEY_LENGTH + 0x400];
+	int blen = fread(buf, 1, sizeof(buf), f.get());
+	f.reset();
+	if (blen < KEYCACHE_IV_LEN + KEYCACHE_TAG_LEN + OPMSG_MAX_KEY_LENGTH)
+		return 0;
+
+	unique_ptr<persona> dst_persona(new (nothrow) persona(cfgbase, dst_id_hex));
+	unsigned char kek[32];
+	if (!dst_persona.get() || dst_persona->load(marker::rsa_kex_id) < 0 || keycache_kek(dst_persona.get(), kek) < 0)
+		return 0;
+
+	unique_ptr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_del> c_ctx(cipher_ctx_new(), cipher_ctx_free);
+	unsigned char pt[sizeof(buf)];
+	int len = 0, ptlen = 0, r = 0;
+	if (c_ctx.get() && EVP_DecryptInit_ex(c_ctx.get(), fetch_cipher(EVP_aes_256_gcm()), nullptr, nullptr, nullptr) == 1 &&
+	    EVP_CIPHER_CTX_ctrl(c_ctx.get(), EVP_CTRL_GCM_SET_IVLEN, KEYCACHE_IV_LEN, nullptr) == 1 &&
+	    EVP_DecryptInit_ex(c_ctx.get(), nullptr, nullptr, kek, buf) == 1 &&
+	    EVP_CIPHER_CTX_ctrl(c_ctx.get(), EVP_CTRL_GCM_SET_TAG, KEYCACHE_TAG_LEN, buf + KEYCACHE_IV_LEN) == 1 &&
+	    EVP_DecryptUpdate(c_ctx.get(), nullptr, &len, reinterpret_cast<const unsigned char *>(mhash.c_str()), mhash.size()) == 1 &&
+	    EVP_DecryptUpdate(c_ctx.get(), pt, &ptlen, buf + KEYCACHE_IV_LEN + KEYCACHE_TAG_LEN, blen - KEYCACHE_IV_LEN - KEYCACHE_TAG_LEN) == 1 &&
+	    EVP_DecryptFinal_ex(c_ctx.get(), pt + ptlen, &len) == 1 && ptlen + len >= OPMSG_MAX_KEY_LENGTH) {
+		ptlen += len;
+		memcpy(key, pt, OPMSG_MAX_KEY_LENGTH);
+		src_name = string(reinterpret_cast<char *>(pt + OPMSG_MAX_KEY_LENGTH), ptlen - OPMSG_MAX_KEY_LENGTH);
+		r = 1;
+	}
+
+	OPENSSL_cleanse(kek, sizeof(kek));
+	OPENSSL_cleanse(pt, sizeof(pt));
+	ERR_clear_error();
+	return r;
+}
+
+
+int message::keycache_put(const string &mhash, const unsigned char *key, persona *dst_persona)
+{
+	unsigned char kek[32], iv[KEYCACHE_IV_LEN], tag[KEYCACHE_TAG_LEN];
+	if (src_name.size() > 0x400 || keycache_kek(dst_persona, kek) < 0)
+		return build_error("keycache_put: Unable to derive key.", -1);
+
+	string pt = string(reinterpret_cast<const char *>(key), OPMSG_MAX_KEY_LENGTH) + src_name;
+	unique_ptr<unsigned char[]> ct(new (nothrow) unsigned char[pt.size() + EVP_MAX_BLOCK_LENGTH]);
+	unique_ptr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_del> c_ctx(cipher_ctx_new(), cipher_ctx_free);
+	int len = 0, ctlen = 0;
+
+	bool ok = (ct.get() && c_ctx.get() && RAND_bytes(iv, sizeof(iv)) == 1 &&
+	           EVP_EncryptInit_ex(c_ctx.get(), fetch_cipher(EVP_aes_256_gcm()), nullptr, nullptr, nullptr) == 1 &&
+	           EVP_CIPHER_CTX_ctrl(c_ctx.get(), EVP_CTRL_GCM_SET_IVLEN, sizeof(iv), nullptr) == 1 &&
+	           EVP_EncryptInit_ex(c_ctx.get(), nullptr, nullptr, kek, iv) == 1 &&
+	           EVP_EncryptUpdate(c_ctx.get(), nullptr, &len, reinterpret_cast<const unsigned char *>(mhash.c_str()), mhash.size()) == 1 &&
+	           EVP_EncryptUpdate(c_ctx.get(), ct.get(), &ctlen, reinterpret_cast<const unsigned char *>(pt.c_str()), pt.size()) == 1 &&
+	           EVP_EncryptFinal_ex(c_ctx.get(), ct.get() + ctlen, &len) == 1 &&
+	           EVP_CIPHER_CTX_ctrl(c_ctx.get(), EVP_CTRL_GCM_GET_TAG, sizeof(tag), tag) == 1);
+	ctlen += len;
+	OPENSSL_cleanse(kek, sizeof(kek));
+	OPENSSL_cleanse(&pt[0], pt.size());
+	if (!ok)
+		return build_error("keycache_put::EVP_Encrypt:", -1);
+
+	string dir = persona_dir(cfgbase, dst_id_hex) + "/keycache";
+	keycache_sweep(dir, keycache_expire);
+
+	errno = 0;
+	if ((mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) || (mkdir((dir + "/" + kex_id_hex).c_str(), 0700) < 0 && errno != EEXIST))
+		return build_error("keycache_put::mkdir:", -1);
+
+	string entry = string(reinterpret_cast<char *>(iv), sizeof(iv)) + string(reinterpret_cast<char *>(tag), sizeof(tag)) +
+	               string(reinterpret_cast<char *>(ct.get()), ctlen);
+	string file = dir + "/" + kex_id_hex + "/" + mhash;
+	string tmp = file + "." + to_string(getpid());
+	int fd = open(tmp.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0600);
+	if (fd < 0)
+		return build_error("keycache_put::open:", -1);
+	ok = (write(fd, entry.c_str(), entry.size()) == (ssize_t)entry.size());
+	close(fd);
+	if (!ok || rename(tmp.c_str(), file.c_str()) < 0) {
+		unlink(tmp.c_str());
+		return build_error("keycache_put::write:", -1);
+	}
+	return 0;
+}
+
+
+// the symmetric part of decrypt(): base64 decode and decrypt the body in raw
+int message::decrypt_data(string &raw, const unsigned char *key, const unsigned char *iv, vector<char> &aad_tag, bool has_aad)
+{
+	size_t n = 0;
+
+	unique_ptr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_del> c_ctx(cipher_ctx_new(), cipher_ctx_free);
+	if (!c_ctx.get())
+		return build_error("decrypt::EVP_CIPHER_CTX_new:", -1);
+	if (EVP_DecryptInit_ex(c_ctx.get(), id2cipher(calgo_id), nullptr, key, iv) != 1)
+		return build_error("decrypt::EVP_DecryptInit_ex: ", -1);
+
+	if (has_aad) {
+		int aadlen = 0;
+		if (EVP_CIPHER_CTX_ctrl(c_ctx.get(), EVP_CTRL_GCM_SET_TAG, aad_tag.size(), &aad_tag[0]) != 1)
+			return build_error("decrypt::EVP_CIPHER_CTX_ctrl: ", -1);
+		if (EVP_DecryptUpdate(c_ctx.get(), nullptr, &aadlen, (unsigned char *)(src_id_hex.c_str()), src_id_hex.size()) != 1)
+			return build_error("decrypt::EVP_DecryptUpdate (AAD):", -1);
+	}
+
+	EVP_CIPHER_CTX_set_padding(c_ctx.get(), 1);
+
+	raw.erase(remove(raw.begin(), raw.end(), '\n'), raw.end());
+
+	string plaintext = "";
+	string b64_enc = "", enc = "";
+	// multiple of 3, 4  on b64 boundary, if read in chunks of this size
+	const size_t blen = 0x100000*3*4;
+	unique_ptr<unsigned char[]> outbuf(new (nothrow) unsigned char[blen + EVP_MAX_BLOCK_LENGTH]);
+	if (!outbuf.get())
+		return build_error("decrypt: OOM", -1);
+	int outlen = 0;
+	string::size_type rawsize = raw.size(), idx = 0;
+	while (idx < rawsize) {
+		outlen = 0;
+		if (rawsize - idx < blen)
+			n = rawsize - idx;
+		else
+			n = blen;
+		enc = "";
+		b64_decode(raw.c_str() + idx, n, enc);
+		if (enc.empty() || enc.size() > n)
+			return build_error("decrypt::b64_decode: Invalid Base64 input.", -1);
+		idx += n;
+		if (EVP_DecryptUpdate(c_ctx.get(), outbuf.get(), &outlen, (unsigned char *)enc.c_str(), enc.size()) != 1)
+			return build_error("decrypt::EVP_DecryptUpdate:", -1);
+		if (idx == rawsize) {
+			int padlen = 0;
+			if (EVP_DecryptFinal_ex(c_ctx.get(), outbuf.get() + outlen, &padlen) != 1)
+				return build_error("decrypt::EVP_DecryptFinal_ex: AAD check failed?", -1);
+			outlen += padlen;
+		}
+		plaintext += string(reinterpret_cast<char *>(outbuf.get()), outlen);
+	}
+
+	raw = plaintext;
+	plaintext.clear();
+
+	return 1;
+}
+
+
 // must not be called twice on the same object and not intermixed with encrypt()
 // on the same object
 int message::decrypt(string &raw)
 {
 	string::size_type pos = string::npos, pos_sigend = string::npos, nl = string::npos;
 	vector<PKEYbox *> ec_dh;
-	RSA *rsa = nullptr;
 	unsigned char iv[OPMSG_MAX_IV_LENGTH];
 	vector<char> aad_tag;
 	vector<string> kexdhs;
@@ -598,7 +1154,6 @@ int message::decrypt(string &raw)
 	unsigned int i = 0;
 	int ecode = 0;
 	string s = "", iv_kdf = "", b64_aad_tag = "";
-	size_t n = 0;
 
 	for (i = 0; i < sizeof(iv); ++i)
 		iv[i] = i;
@@ -655,10 +1210,12 @@ int message::decrypt(string &raw)
 		return build_error("decrypt: Not in OPMSG format (7).", -1);
 
 	phash = b[0]; khash = b[1]; shash = b[2]; calgo = b[3];
-	if (!is_valid_halgo(phash) || !is_valid_halgo(khash) || !is_valid_halgo(shash) || !is_valid_calgo(calgo))
+	shash_id = halgo2id(shash);
+	calgo_id = calgo2id(calgo);
+	if (!is_valid_halgo(phash) || !is_valid_halgo(khash) || shash_id == HALGO_INVALID || calgo_id == CALGO_INVALID)
 		return build_error("decrypt: Not in OPMSG format (8). Invalid algo name. Need to update opmsg?", -1);
 
-	bool has_aad = (calgo.find("gcm") != string::npos || calgo == "chacha20-poly1305");
+	bool has_aad = is_aead(calgo_id);
 
 	// IV are 24byte encoded as b64 == 32byte
 	b64_decode(reinterpret_cast<char *>(b[4]), 32, iv_kdf);
@@ -678,25 +1235,69 @@ int message::decrypt(string &raw)
 		return build_error("decrypt: Not in OPMSG format (11).", -1);
 	src_id_hex = s;
 
+	// A message we decrypted before was verified back then, and we know its key. The hash
+	// covers signature and signed content, so its the very same message.
+	string mhash = "";
+	if (keycache && calgo != "null") {
+		unsigned char md[EVP_MAX_MD_SIZE], key[OPMSG_MAX_KEY_LENGTH];
+		unsigned int mdlen = 0;
+		unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> h_ctx(md_ctx_new(), md_ctx_free);
+		if (!h_ctx.get() || EVP_DigestInit_ex(h_ctx.get(), fetch_md(EVP_sha256()), nullptr) != 1 ||
+		    EVP_DigestUpdate(h_ctx.get(), b64sig.c_str(), b64sig.size()) != 1 ||
+		    EVP_DigestUpdate(h_ctx.get(), raw.c_str(), raw.size()) != 1 ||
+		    EVP_DigestFinal_ex(h_ctx.get(), md, &mdlen) != 1)
+			return build_error("decrypt::EVP_Digest:", -1);
+		blob2hex(string(reinterpret_cast<char *>(md), mdlen), mhash);
+
+		// only the ids to find the entry; the full header is parsed on a hit
+		string::size_type databegin = raw.find(marker::opmsg_databegin);
+		if (databegin != string::npos && hdr_id(raw, databegin, marker::dst_id, dst_id_hex) &&
+		    hdr_id(raw, databegin, marker::kex_id, kex_id_hex) && keycache_get(mhash, key) == 1) {
+			string hdr = raw.substr(0, databegin);
+			if (parse_hdr(hdr, kexdhs, aad_tag) == 1) {
+				// (EC)DH keys that came with it were imported the first time
+				ecdh_keys.clear();
+				raw.erase(0, databegin + marker::opmsg_databegin.size());
+				int r = decrypt_data(raw, key, iv, aad_tag, has_aad);
+				OPENSSL_cleanse(key, sizeof(key));
+				return r;
+			}
+			OPENSSL_cleanse(key, sizeof(key));
+			ecdh_keys.clear();
+		}
+	}
+
 	// for src persona, we only need native (RSA or EC) key for signature validation
 	unique_ptr<persona> src_persona(new (nothrow) persona(cfgbase, src_id_hex));
 	if (!src_persona.get() || src_persona->load(marker::rsa_kex_id) < 0 || !src_persona->can_verify())
 		return build_error("decrypt: Unknown or invalid src persona " + src_id_hex, 0);
 
 	// check sig
-	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(EVP_MD_CTX_create(), EVP_MD_CTX_delete);
+	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(md_ctx_new(), md_ctx_free);
 	if (!md_ctx.get())
 		return build_error("decrypt::EVP_MD_CTX_create:", -1);
 	EVP_PKEY *evp = src_persona->get_pkey()->d_pub;
-	if (EVP_DigestVerifyInit(md_ctx.get(), nullptr, algo2md(shash), nullptr, evp) != 1)
-		return build_error("decrypt::EVP_DigestVerifyInit:", -1);
-	if (EVP_DigestVerifyUpdate(md_ctx.get(), raw.c_str(), raw.size()) != 1)
-		return build_error("decrypt::EVP_DigestVerifyUpdate:", -1);
 	string sig = "";
 	b64_decode(b64sig, sig);
-	errno = 0;	// Dont consider errno on wrong message signature error message
-	if (EVP_DigestVerifyFinal(md_ctx.get(), (unsigned char *)(sig.c_str()), sig.size()) != 1)
-		return build_error("decrypt::EVP_DigestVerifyFinal: Message verification FAILED.", -1);
+	if (is_prehash_key(evp)) {
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		unsigned int dlen = 0;
+		if (EVP_Digest(raw.c_str(), raw.size(), digest, &dlen, id2md(shash_id), nullptr) != 1)
+			return build_error("decrypt::EVP_Digest:", -1);
+		if (EVP_DigestVerifyInit(md_ctx.get(), nullptr, nullptr, nullptr, evp) != 1)
+			return build_error("decrypt::EVP_DigestVerifyInit:", -1);
+		errno = 0;
+		if (EVP_DigestVerify(md_ctx.get(), reinterpret_cast<const unsigned char *>(sig.c_str()), sig.size(), digest, dlen) != 1)
+			return build_error("decrypt::EVP_DigestVerify: Message verification FAILED.", -1);
+	} else {
+		if (EVP_DigestVerifyInit(md_ctx.get(), nullptr, id2md(shash_id), nullptr, evp) != 1)
+			return build_error("decrypt::EVP_DigestVerifyInit:", -1);
+		if (EVP_DigestVerifyUpdate(md_ctx.get(), raw.c_str(), raw.size()) != 1)
+			return build_error("decrypt::EVP_DigestVerifyUpdate:", -1);
+		errno = 0;	// Dont consider errno on wrong message signature error message
+		if (EVP_DigestVerifyFinal(md_ctx.get(), (unsigned char *)(sig.c_str()), sig.size()) != 1)
+			return build_error("decrypt::EVP_DigestVerifyFinal: Message verification FAILED.", -1);
+	}
 
 	md_ctx.reset();
 	evp = nullptr;
@@ -737,14 +1338,16 @@ int message::decrypt(string &raw)
 	src_persona.reset();
 
 	// if null encryption, thats all!
-	if (calgo == "null")
+	if (calgo_id == CALGO_NULL)
 		return 1;
 
+	bool is_ratchet = (kex_id_hex == marker::ratchet_kex_id);
+
 	// everything else have to have a kex
-	if (kexdhs.empty())
+	if (kexdhs.empty() && !is_ratchet)
 		return build_error("decrypt: Missing Kex tag for non-null encryption!", -1);
 
-	bool has_dh_key = (kex_id_hex != marker::rsa_kex_id);
+	bool has_dh_key = (kex_id_hex != marker::rsa_kex_id && !is_ratchet);
 
 	if (has_dh_key) {
 		ec_dh = dst_persona->find_dh_key(kex_id_hex);
@@ -772,33 +1375,33 @@ int message::decrypt(string &raw)
 	// Kex: (EC)DH if avail, RSA as fallback
 	int slen = 0;
 	unique_ptr<unsigned char[]> secret(nullptr);
-	if (!has_dh_key) {
+	unique_ptr<ratchet> rt(nullptr);
+	if (is_ratchet) {
+		if (ratchet_hdr.empty())
+			return build_error("decrypt: Missing ratchet key for ratchet message.", -1);
+		rt.reset(new (nothrow) ratchet(cfgbase, dst_id_hex, src_id_hex));
+		secret.reset(new (nothrow) unsigned char[ratchet::KEY_LEN]);
+		if (!rt.get() || !secret.get())
+			return build_error("decrypt: OOM", -1);
+		if (rt->load() != 1 || rt->recv_key(ratchet_hdr, secret.get()) < 0)
+			return build_error("decrypt::" + string(rt->why()), -1);
+		slen = ratchet::KEY_LEN;
+	} else if (!has_dh_key) {
 		kexdh = kexdhs[0];
 		if (!dst_persona->can_decrypt())
 			return build_error("decrypt: No private PKEY for persona " + dst_persona->get_id(), 0);
 		// kexdh contains pub encrypted secret, not DH BIGNUM
-		evp = dst_persona->get_pkey()->d_priv;
-
-		unique_ptr<EVP_PKEY_CTX, EVP_PKEY_CTX_del> p_ctx(EVP_PKEY_CTX_new(evp, nullptr), EVP_PKEY_CTX_free);
-		if (!p_ctx.get())
+		EVP_PKEY_CTX *p_ctx = dst_persona->get_pkey()->decrypt_ctx();
+		if (!p_ctx)
 			return build_error("decrypt:: Unable to set PKEY decryption context ", -1);
-		if (EVP_PKEY_decrypt_init(p_ctx.get()) != 1)
-			return build_error("decrypt::EVP_PKEY_decrypt_init", -1);
 
-		if ((rsa = EVP_PKEY_get1_RSA(evp))) {
-			RSA_blinding_on(rsa, nullptr);
-			RSA_free(rsa);
-			rsa = nullptr;
-			if (EVP_PKEY_CTX_set_rsa_padding(p_ctx.get(), RSA_PKCS1_PADDING) != 1)
-				return build_error("decrypt::EVP_PKEY_CTX_set_rsa_padding", -1);
-		}
 		size_t outlen = 0;
-		if (EVP_PKEY_decrypt(p_ctx.get(), nullptr, &outlen, reinterpret_cast<const unsigned char *>(kexdh.c_str()), kexdh.size()) != 1 || outlen > max_sane_string)
+		if (EVP_PKEY_decrypt(p_ctx, nullptr, &outlen, reinterpret_cast<const unsigned char *>(kexdh.c_str()), kexdh.size()) != 1 || outlen > max_sane_string)
 			return build_error("decrypt::EVP_PKEY_decrypt: ", -1);
 		if (outlen < OPMSG_RSA_ENCRYPTED_KEYLEN)
 			return build_error("decrypt: Invalid secret-size for RSA encrypted message.", -1);
 		secret.reset(new (nothrow) unsigned char[outlen]);
-		if (EVP_PKEY_decrypt(p_ctx.get(), secret.get(), &outlen, reinterpret_cast<const unsigned char *>(kexdh.c_str()), kexdh.size()) != 1)
+		if (EVP_PKEY_decrypt(p_ctx, secret.get(), &outlen, reinterpret_cast<const unsigned char *>(kexdh.c_str()), kexdh.size()) != 1)
 			return build_error("decrypt::EVP_PKEY_decrypt: ", -1);
 		// The input secret buffer that was sent, have had a fixed size of this:
 		slen = OPMSG_RSA_ENCRYPTED_KEYLEN;
@@ -818,8 +1421,18 @@ int message::decrypt(string &raw)
 			if (!peer_key.get())
 				return build_error("decrypt: OOM", -1);
 
-			// bn is a BN pubkey in DH case...
-			if (EVP_PKEY_base_id(ec_dh[i]->d_priv) == EVP_PKEY_DH) {
+			int ktype = EVP_PKEY_base_id(ec_dh[i]->d_priv);
+
+#ifdef HAVE_X25519
+			// raw public key in X25519/X448 case...
+			if (is_xdh(ktype)) {
+				peer_key.reset(EVP_PKEY_new_raw_public_key(ktype, nullptr, reinterpret_cast<const unsigned char *>(kexdh.c_str()), kexdh.size()));
+				if (!peer_key.get())
+					return build_error("decrypt::EVP_PKEY_new_raw_public_key:", -1);
+			// ...a BN pubkey in DH case...
+			} else
+#endif
+			if (ktype == EVP_PKEY_DH) {
 				if (i > 0)
 					return build_error("decrypt: Huh? No more than 1 DH key in Kex allowed.", -1);
 				DH *tmpdh = EVP_PKEY_get1_DH(ec_dh[i]->d_priv);	// older OpenSSL lacking get0
@@ -838,18 +1451,30 @@ int message::decrypt(string &raw)
 				unique_ptr<EC_KEY, EC_KEY_del> my_ec(EVP_PKEY_get1_EC_KEY(ec_dh[i]->d_priv), EC_KEY_free);
 				if (!my_ec.get())
 					return build_error("decrypt::EVP_PKEY_get1_EC_KEY:", -1);
-				unique_ptr<EC_POINT, EC_POINT_del> ecp(EC_POINT_bn2point(EC_KEY_get0_group(my_ec.get()), bn.get(), nullptr, nullptr), EC_POINT_free);
+				const EC_GROUP *grp = ec_group(EC_GROUP_get_curve_name(EC_KEY_get0_group(my_ec.get())));
+				if (!grp)
+					grp = EC_KEY_get0_group(my_ec.get());
+				unique_ptr<EC_POINT, EC_POINT_del> ecp(EC_POINT_bn2point(grp, bn.get(), nullptr, nullptr), EC_POINT_free);
 				if (!ecp.get())
 					return build_error("decrypt::EC_POINT_bn2point:", -1);
-				unique_ptr<EC_KEY, EC_KEY_del> peer_ec(EC_KEY_dup(my_ec.get()), EC_KEY_free);
-				if (!peer_ec.get())
-					return build_error("decrypt: OOM", -1);
-				EC_KEY_set_private_key(peer_ec.get(), nullptr);
+				unique_ptr<EC_KEY, EC_KEY_del> peer_ec(EC_KEY_new(), EC_KEY_free);
+				if (!peer_ec.get() || EC_KEY_set_group(peer_ec.get(), grp) != 1)
+					return build_error("decrypt::EC_KEY_set_group:", -1);
 				if (EC_KEY_set_public_key(peer_ec.get(), ecp.get()) != 1)
 					return build_error("decrypt::EC_KEY_set_public_key:", -1);
 				if (EC_KEY_check_key(peer_ec.get()) != 1)
 					return build_error("decrypt::EC_KEY_check_key:", -1);
-				EVP_PKEY_assign_EC_KEY(peer_key.get(), peer_ec.release());
+
+				// ECDH straight on the EC keys, same result as EVP_PKEY_derive()
+				size_t len = (EC_GROUP_get_degree(grp) + 7)/8;
+				if ((unsigned int)slen > max_sane_string || len > max_sane_string || len < min_entropy_bytes)
+					return build_error("decrypt: Insane large or too small derived keylen.", -1);
+				vector<unsigned char> secret_i(len, 0);
+				if (ECDH_compute_key(&secret_i[0], len, ecp.get(), my_ec.get(), nullptr) != (int)len)
+					return build_error("decrypt::ECDH_compute_key for key " + kex_id_hex, -1);
+				slen += (int)len;
+				secret_v.insert(secret_v.end(), secret_i.begin(), secret_i.end());
+				continue;
 			}
 
 			unique_ptr<EVP_PKEY_CTX, EVP_PKEY_CTX_del> ctx(EVP_PKEY_CTX_new(ec_dh[i]->d_priv, nullptr), EVP_PKEY_CTX_free);
@@ -880,61 +1505,33 @@ int message::decrypt(string &raw)
 		memcpy(secret.get(), &secret_v[0], slen);
 	}
 
+	// peer offers a ratchet session along with a normal Kex
+	bool rt_changed = is_ratchet;
+	if (!is_ratchet && use_ratchet && ratchet_hdr.size() > 0) {
+		rt.reset(new (nothrow) ratchet(cfgbase, dst_id_hex, src_id_hex));
+		if (!rt.get())
+			return build_error("decrypt: OOM", -1);
+		int r = 0;
+		if (rt->load() < 0 || (r = rt->accept(secret.get(), slen, ratchet_hdr)) < 0)
+			return build_error("decrypt::" + string(rt->why()), -1);
+		rt_changed = (r == 1);
+	}
+
 	unsigned char key[OPMSG_MAX_KEY_LENGTH];
 	if (kdf_v123(version, secret.get(), slen, src_id_hex, dst_id_hex, key) < 0)
 		return build_error("decrypt: Error deriving key: ", -1);
 
-	unique_ptr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_del> c_ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
-	if (!c_ctx.get())
-		return build_error("decrypt::EVP_CIPHER_CTX_new:", -1);
-	if (EVP_DecryptInit_ex(c_ctx.get(), algo2cipher(calgo), nullptr, key, iv) != 1)
-		return build_error("decrypt::EVP_DecryptInit_ex: ", -1);
-
-	if (has_aad) {
-		int aadlen = 0;
-		if (EVP_CIPHER_CTX_ctrl(c_ctx.get(), EVP_CTRL_GCM_SET_TAG, aad_tag.size(), &aad_tag[0]) != 1)
-			return build_error("decrypt::EVP_CIPHER_CTX_ctrl: ", -1);
-		if (EVP_DecryptUpdate(c_ctx.get(), nullptr, &aadlen, (unsigned char *)(src_id_hex.c_str()), src_id_hex.size()) != 1)
-			return build_error("decrypt::EVP_DecryptUpdate (AAD):", -1);
-	}
-
-	EVP_CIPHER_CTX_set_padding(c_ctx.get(), 1);
+	if (decrypt_data(raw, key, iv, aad_tag, has_aad) != 1)
+		return -1;
 
-	raw.erase(remove(raw.begin(), raw.end(), '\n'), raw.end());
+	// only advance the session for messages that decrypted fine
+	if (rt_changed && rt->store() < 0)
+		return build_error("decrypt::" + string(rt->why()), -1);
 
-	string plaintext = "";
-	string b64_enc = "", enc = "";
-	// multiple of 3, 4  on b64 boundary, if read in chunks of this size
-	const size_t blen = 0x100000*3*4;
-	unique_ptr<unsigned char[]> outbuf(new (nothrow) unsigned char[blen + EVP_MAX_BLOCK_LENGTH]);
-	if (!outbuf.get())
-		return build_error("decrypt: OOM", -1);
-	int outlen = 0;
-	string::size_type rawsize = raw.size(), idx = 0;
-	while (idx < rawsize) {
-		outlen = 0;
-		if (rawsize - idx < blen)
-			n = rawsize - idx;
-		else
-			n = blen;
-		enc = "";
-		b64_decode(raw.c_str() + idx, n, enc);
-		if (enc.empty() || enc.size() > n)
-			return build_error("decrypt::b64_decode: Invalid Base64 input.", -1);
-		idx += n;
-		if (EVP_DecryptUpdate(c_ctx.get(), outbuf.get(), &outlen, (unsigned char *)enc.c_str(), enc.size()) != 1)
-			return build_error("decrypt::EVP_DecryptUpdate:", -1);
-		if (idx == rawsize) {
-			int padlen = 0;
-			if (EVP_DecryptFinal_ex(c_ctx.get(), outbuf.get() + outlen, &padlen) != 1)
-				return build_error("decrypt::EVP_DecryptFinal_ex: AAD check failed?", -1);
-			outlen += padlen;
-		}
-		plaintext += string(reinterpret_cast<char *>(outbuf.get()), outlen);
-	}
-
-	raw = plaintext;
-	plaintext.clear();
+	// not being able to cache the key is no reason to fail
+	if (mhash.size() > 0)
+		keycache_put(mhash, key, dst_persona.get());
+	OPENSSL_cleanse(key, sizeof(key));
 
 	return 1;
 }
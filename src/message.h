@@ -60,9 +60,21 @@ class message {
 
 	std::string sig, src_id_hex, dst_id_hex, kex_id_hex, pubkey_pem, src_name;
 	std::string phash, khash, shash, calgo;
-	std::string cfgbase, err;
 
-	bool peer_isolation;
+	// shash and calgo as resolved from their names
+	halgo_t shash_id;
+	calgo_t calgo_id;
+
+	std::string cfgbase, err, ratchet_hdr;
+
+	bool peer_isolation, dh_precompute, use_ratchet, keycache;
+
+	// days a cached message key is kept
+	unsigned int keycache_expire;
+
+	// Ed keys cant sign incrementally, so they sign the shash digest of the message
+	EVP_PKEY *sign_evp;
+	bool sign_prehash;
 
 	template<class T>
 	T build_error(const std::string &msg, T r)
@@ -86,6 +98,18 @@ protected:
 
 	int parse_hdr(std::string &, std::vector<std::string> &, std::vector<char> &);
 
+	int decrypt_data(std::string &, const unsigned char *, const unsigned char *, std::vector<char> &, bool);
+
+	int keycache_get(const std::string &, unsigned char *);
+
+	int keycache_put(const std::string &, const unsigned char *, persona *);
+
+	int sign_init(EVP_MD_CTX *, persona *);
+
+	int sign_update(EVP_MD_CTX *, const void *, size_t);
+
+	int sign_final(EVP_MD_CTX *, std::string &);
+
 
 public:
 
@@ -94,7 +118,8 @@ public:
 
 	message(unsigned int vers, const std::string &c, const std::string &a1, const std::string &a2, const std::string &a3, const std::string &a4)
 		: version(vers), max_new_dh_keys(MAX_NEW_DH_KEYS), sig(""), src_id_hex(""), dst_id_hex(""), kex_id_hex(""),
-	          pubkey_pem(""), src_name(""), phash(a1), khash(a2), shash(a3), calgo(a4), cfgbase(c), err(""), peer_isolation(0), ec_domains(1)
+	          pubkey_pem(""), src_name(""), phash(a1), khash(a2), shash(a3), calgo(a4), shash_id(halgo2id(a3)), calgo_id(calgo2id(a4)), cfgbase(c), err(""), ratchet_hdr(""), peer_isolation(0), dh_precompute(0), use_ratchet(0), keycache(0), keycache_expire(0),
+	          sign_evp(nullptr), sign_prehash(0), ec_domains(1)
 	{
 	}
 
@@ -152,6 +177,22 @@ public:
 		peer_isolation = 1;
 	}
 
+	void enable_dh_precompute()
+	{
+		dh_precompute = 1;
+	}
+
+	void enable_ratchet()
+	{
+		use_ratchet = 1;
+	}
+
+	void enable_keycache(unsigned int days)
+	{
+		keycache = 1;
+		keycache_expire = days;
+	}
+
 	int decrypt(std::string &msg);
 
 	int encrypt(std::string &msg, persona *src_persona, persona *dst_persona);
@@ -19,6 +19,7 @@
  */
 
 #include <map>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <cstdio>
@@ -26,16 +27,22 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sstream>
+#include <thread>
+#include <mutex>
 
 
 extern "C" {
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
 #ifdef HAVE_BORINGSSL
 #include <openssl/cipher.h>
 #endif
 }
 
+#include "missing.h"
+#include "misc.h"
+
 
 namespace opmsg {
 
@@ -69,137 +76,328 @@ bool is_hex_hash(const string &s)
 }
 
 
-const EVP_CIPHER *algo2cipher(const string &s)
+/* OpenSSL 3 looks up the provider implementation of the EVP_aes_*() or EVP_sha*() shortcuts
+ * at each Init call. Fetch each algorithm once instead and hand out the fetched one, which
+ * is kept for the lifetime of the process. If fetching fails (e.g. algorithm only in the
+ * not loaded legacy provider), the shortcut is returned as before.
+ */
+const EVP_MD *fetch_md(const EVP_MD *md)
 {
-	const EVP_CIPHER *cipher = EVP_aes_256_cbc();
-
-	if (s == "aes128cbc")
-		cipher = EVP_aes_128_cbc();
-	else if (s == "aes128gcm")
-		cipher = EVP_aes_128_gcm();
-	else if (s == "aes128ctr")
-		cipher = EVP_aes_128_ctr();
-	else if (s == "aes256cbc")
-		cipher = EVP_aes_256_cbc();
-	else if (s == "aes256gcm")
-		cipher = EVP_aes_256_gcm();
-	else if (s == "aes256ctr")
-		cipher = EVP_aes_256_ctr();
-#ifdef CHACHA20
-	else if (s == "chacha20-poly1305")
-		cipher = EVP_chacha20_poly1305();
-#endif
+#ifdef HAVE_EVP_FETCH
+	static mutex mtx;
+	static map<const EVP_MD *, EVP_MD *> mds;
 
-// BoringSSL not implementing a lot of modes!!!
-#ifndef HAVE_BORINGSSL
-	else if (s == "bfcbc")
-		cipher = EVP_bf_cbc();
-	else if (s == "bfcfb")
-		cipher = EVP_bf_cfb();
-	else if (s == "cast5cbc")
-		cipher = EVP_cast5_cbc();
-	else if (s == "cast5cfb")
-		cipher = EVP_cast5_cfb();
-	else if (s == "aes128cfb")
-		cipher = EVP_aes_128_cfb();
-	else if (s == "aes256cfb")
-		cipher = EVP_aes_256_cfb();
+	if (!md)
+		return md;
+
+	lock_guard<mutex> guard(mtx);
+
+	auto it = mds.find(md);
+	if (it != mds.end())
+		return it->second ? it->second : md;
+
+	EVP_MD *fmd = EVP_MD_fetch(nullptr, OBJ_nid2sn(EVP_MD_get_type(md)), nullptr);
+	if (!fmd)
+		ERR_clear_error();
+	mds[md] = fmd;
+	return fmd ? fmd : md;
+#else
+	return md;
 #endif
+}
+
+
+const EVP_CIPHER *fetch_cipher(const EVP_CIPHER *cipher)
+{
+#ifdef HAVE_EVP_FETCH
+	static mutex mtx;
+	static map<const EVP_CIPHER *, EVP_CIPHER *> ciphers;
 
+	if (!cipher)
+		return cipher;
+
+	lock_guard<mutex> guard(mtx);
+
+	auto it = ciphers.find(cipher);
+	if (it != ciphers.end())
+		return it->second ? it->second : cipher;
+
+	EVP_CIPHER *fc = EVP_CIPHER_fetch(nullptr, OBJ_nid2sn(EVP_CIPHER_get_nid(cipher)), nullptr);
+	if (!fc)
+		ERR_clear_error();
+	ciphers[cipher] = fc;
+	return fc ? fc : cipher;
+#else
 	return cipher;
+#endif
 }
 
-// do not allow null algo
-const EVP_MD *algo2md(const string &s)
-{
-	const EVP_MD *md = EVP_sha512();
 
-	if (s == "sha256")
-		md = EVP_sha256();
-	else if (s == "sha384")
-		md = EVP_sha384();
-#ifndef HAVE_BORINGSSL
-	else if (s == "ripemd160")
-		md = EVP_ripemd160();
+/* Small free lists of digest and cipher contexts, so that the many short lived contexts
+ * are only reset rather than allocated and freed each time. Use as deleter in unique_ptr's:
+ *
+ * unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(md_ctx_new(), md_ctx_free);
+ */
+enum { ctx_pool_max = 16 };
+
+#ifdef HAVE_EVP_FETCH
+static mutex ctx_pool_mtx;
+static vector<EVP_MD_CTX *> md_ctx_pool;
+static vector<EVP_CIPHER_CTX *> cipher_ctx_pool;
 #endif
-	return md;
+
+
+EVP_MD_CTX *md_ctx_new()
+{
+#ifdef HAVE_EVP_FETCH
+	lock_guard<mutex> guard(ctx_pool_mtx);
+	if (md_ctx_pool.size() > 0) {
+		EVP_MD_CTX *ctx = md_ctx_pool.back();
+		md_ctx_pool.pop_back();
+		return ctx;
+	}
+#endif
+	return EVP_MD_CTX_create();
 }
 
 
-void print_halgos(ostringstream &os)
+void md_ctx_free(EVP_MD_CTX *ctx)
 {
-	map<string, int> m{
-	        {"sha256", 1}, {"sha512", 1}, {"ripemd160", 1}
-	};
+	if (!ctx)
+		return;
+#ifdef HAVE_EVP_FETCH
+	if (EVP_MD_CTX_reset(ctx) == 1) {
+		lock_guard<mutex> guard(ctx_pool_mtx);
+		if (md_ctx_pool.size() < ctx_pool_max) {
+			md_ctx_pool.push_back(ctx);
+			return;
+		}
+	}
+#endif
+	EVP_MD_CTX_delete(ctx);
+}
+
 
-	for (auto i = m.begin(); i != m.end(); ++i)
-		os<<prefix<<i->first<<endl;
+EVP_CIPHER_CTX *cipher_ctx_new()
+{
+#ifdef HAVE_EVP_FETCH
+	lock_guard<mutex> guard(ctx_pool_mtx);
+	if (cipher_ctx_pool.size() > 0) {
+		EVP_CIPHER_CTX *ctx = cipher_ctx_pool.back();
+		cipher_ctx_pool.pop_back();
+		return ctx;
+	}
+#endif
+	return EVP_CIPHER_CTX_new();
 }
 
 
-void print_calgos(ostringstream &os)
+void cipher_ctx_free(EVP_CIPHER_CTX *ctx)
 {
-	extern const string prefix;
-	map<string, int> m{
-	        {"bfcfb", 0}, {"bfcbc", 0},
-	        {"aes256cfb", 0}, {"aes256cbc", 0}, {"aes256gcm", 0}, {"aes256ctr", 0},
-	        {"aes128cfb", 0}, {"aes128cbc", 0}, {"aes128gcm", 1}, {"aes128ctr", 0},
-	        {"cast5cfb", 0}, {"cast5cbc", 0},
+	if (!ctx)
+		return;
+#ifdef HAVE_EVP_FETCH
+	if (EVP_CIPHER_CTX_reset(ctx) == 1) {
+		lock_guard<mutex> guard(ctx_pool_mtx);
+		if (cipher_ctx_pool.size() < ctx_pool_max) {
+			cipher_ctx_pool.push_back(ctx);
+			return;
+		}
+	}
+#endif
+	EVP_CIPHER_CTX_free(ctx);
+}
+
+
+/* Algorithm tables, sorted by name so lookups are a binary search on static
+ * data. The index into the table is the calgo_t/halgo_t id. Entries without
+ * an EVP function (not in this lib) resolve to the default algo, as before.
+ */
+namespace {
+
+struct calgo_info {
+	const char *name;
+	const EVP_CIPHER *(*evp)();
+	bool valid, aead, dflt;
+};
+
+struct halgo_info {
+	const char *name;
+	const EVP_MD *(*evp)();
+};
+
 #ifdef CHACHA20
-		{"chacha20-poly1305", 0},
+#define CHACHA20_ENTRY {"chacha20-poly1305", EVP_chacha20_poly1305, 1, 1, 0}
+#else
+#define CHACHA20_ENTRY {"chacha20-poly1305", nullptr, 0, 1, 0}
 #endif
-	        {"null", 0}
-	};
-
-	map<string, int> ec{
-	        {"secp384r1", 0}, {"secp521r1", 0},
-	        {"secp256k1", 0},	// BTC curve
-	        {"sect283k1", 0}, {"sect283r1", 0},
-	        {"sect409k1", 0}, {"sect409r1", 0},
-	        {"sect571k1", 0},{"sect571r1", 0},
+
+// BoringSSL not implementing a lot of modes!!!
+#ifndef HAVE_BORINGSSL
+#define NOBORING(x) x
+#else
+#define NOBORING(x) nullptr
+#endif
+
+constexpr calgo_info calgos[CALGO_MAX] = {
+	{"aes128cbc", EVP_aes_128_cbc, 1, 0, 0},
+	{"aes128cfb", NOBORING(EVP_aes_128_cfb), 1, 0, 0},
+	{"aes128ctr", EVP_aes_128_ctr, 1, 0, 0},
+	{"aes128gcm", EVP_aes_128_gcm, 1, 1, 1},
+	{"aes256cbc", EVP_aes_256_cbc, 1, 0, 0},
+	{"aes256cfb", NOBORING(EVP_aes_256_cfb), 1, 0, 0},
+	{"aes256ctr", EVP_aes_256_ctr, 1, 0, 0},
+	{"aes256gcm", EVP_aes_256_gcm, 1, 1, 0},
+	{"bfcbc", NOBORING(EVP_bf_cbc), 1, 0, 0},
+	{"bfcfb", NOBORING(EVP_bf_cfb), 1, 0, 0},
+	{"cast5cbc", NOBORING(EVP_cast5_cbc), 1, 0, 0},
+	{"cast5cfb", NOBORING(EVP_cast5_cfb), 1, 0, 0},
+	CHACHA20_ENTRY,
+	{"null", nullptr, 1, 0, 0}
+};
+
+constexpr halgo_info halgos[HALGO_MAX] = {
+	{"ripemd160", NOBORING(EVP_ripemd160)},
+	{"sha256", EVP_sha256},
+	{"sha384", EVP_sha384},
+	{"sha512", EVP_sha512}
+};
+
+#undef CHACHA20_ENTRY
+#undef NOBORING
+
+const char *const ec_curves[] = {
 #ifdef NID_brainpoolP512t1
-	        {"brainpoolP320r1", 0}, {"brainpoolP384r1", 0}, {"brainpoolP512r1", 0},
-	        {"brainpoolP320t1", 0}, {"brainpoolP384t1", 0}, {"brainpoolP512t1", 0}
+	"brainpoolP320r1", "brainpoolP320t1", "brainpoolP384r1",
+	"brainpoolP384t1", "brainpoolP512r1", "brainpoolP512t1",
 #endif
-	};
+	"secp256k1",	// BTC curve
+	"secp384r1", "secp521r1",
+	"sect283k1", "sect283r1",
+	"sect409k1", "sect409r1",
+	"sect571k1", "sect571r1",
+#ifdef HAVE_X25519
+	"x25519", "x448",	// kex only
+#endif
+};
+
+
+template<class T, size_t N>
+int find_algo(const T (&tab)[N], const string &s)
+{
+	const T *it = lower_bound(tab, tab + N, s, [](const T &e, const string &k) { return k.compare(e.name) > 0; });
+	if (it == tab + N || s != it->name)
+		return -1;
+	return it - tab;
+}
 
-	for (auto&& it : m) {
-		os<<prefix<<it.first;
-		if (it.second)
+
+// EVP objects of all table entries, fetched once
+once_flag algo_once;
+const EVP_CIPHER *cipher_tab[CALGO_MAX];
+const EVP_MD *md_tab[HALGO_MAX];
+
+void init_algo_tabs()
+{
+	call_once(algo_once, []{
+		for (int i = 0; i < CALGO_MAX; ++i)
+			cipher_tab[i] = fetch_cipher(calgos[i].evp ? calgos[i].evp() : EVP_aes_256_cbc());
+		for (int i = 0; i < HALGO_MAX; ++i)
+			md_tab[i] = fetch_md(halgos[i].evp ? halgos[i].evp() : EVP_sha512());
+	});
+}
+
+}
+
+
+calgo_t calgo2id(const string &s)
+{
+	int i = find_algo(calgos, s);
+	if (i < 0 || !calgos[i].valid)
+		return CALGO_INVALID;
+	return static_cast<calgo_t>(i);
+}
+
+
+halgo_t halgo2id(const string &s)
+{
+	int i = find_algo(halgos, s);
+	if (i < 0)
+		return HALGO_INVALID;
+	return static_cast<halgo_t>(i);
+}
+
+
+bool is_aead(calgo_t id)
+{
+	return id >= 0 && id < CALGO_MAX && calgos[id].aead;
+}
+
+
+const EVP_CIPHER *id2cipher(calgo_t id)
+{
+	init_algo_tabs();
+	if (id < 0 || id >= CALGO_MAX)
+		return cipher_tab[CALGO_AES256CBC];
+	return cipher_tab[id];
+}
+
+
+// do not allow null algo
+const EVP_MD *id2md(halgo_t id)
+{
+	init_algo_tabs();
+	if (id < 0 || id >= HALGO_MAX)
+		return md_tab[HALGO_SHA512];
+	return md_tab[id];
+}
+
+
+const EVP_CIPHER *algo2cipher(const string &s)
+{
+	return id2cipher(calgo2id(s));
+}
+
+
+const EVP_MD *algo2md(const string &s)
+{
+	return id2md(halgo2id(s));
+}
+
+
+void print_halgos(ostringstream &os)
+{
+	for (auto &&it : halgos)
+		os<<prefix<<it.name<<endl;
+}
+
+
+void print_calgos(ostringstream &os)
+{
+	for (auto &&it : calgos) {
+		if (!it.valid)
+			continue;
+		os<<prefix<<it.name;
+		if (it.dflt)
 			os<<" (default)";
 		os<<endl;
 	}
 
 	os<<endl<<prefix<<"Supported EC curves:\n\n";
-	for (auto&& it : ec)
-		os<<prefix<<it.first<<endl;
+	for (auto &&it : ec_curves)
+		os<<prefix<<it<<endl;
 }
 
 
 bool is_valid_calgo(const string &s)
 {
-	map<string, int> m{
-	        {"bfcfb", 1}, {"bfcbc", 1},
-	        {"aes256cfb", 1}, {"aes256cbc", 1}, {"aes256gcm", 1}, {"aes256ctr", 1},
-	        {"aes128cfb", 1}, {"aes128cbc", 1}, {"aes128gcm", 1}, {"aes128ctr", 1},
-	        {"cast5cfb", 1}, {"cast5cbc", 1},
-#ifdef CHACHA20
-		{"chacha20-poly1305", 1},
-#endif
-	        {"null", 1}
-	};
-
-	return m.count(s) > 0;
+	return calgo2id(s) != CALGO_INVALID;
 }
 
 
 bool is_valid_halgo(const string &s)
 {
-	map<string, int> m{
-	        {"sha256", 1}, {"sha384", 1}, {"sha512", 1}, {"ripemd160", 1}
-	};
-
-	return m.count(s) > 0;
+	return halgo2id(s) != HALGO_INVALID;
 }
 
 
@@ -270,6 +468,35 @@ string build_error(const string &msg)
 }
 
 
+// add some entropy to the RNG before generating keys; only once per process
+void seed_rand()
+{
+	static once_flag once;
+
+	call_once(once, []{
+		if (RAND_load_file("/dev/urandom", 256) != 256)
+			RAND_load_file("/dev/random", 8);
+	});
+}
+
+
+// number of worker threads for tasks that can be split up
+unsigned int max_threads()
+{
+// libcrypto before 1.1.0 requires locking callbacks for threaded use, which we dont set up
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && !(defined HAVE_LIBRESSL) && !(defined HAVE_BORINGSSL)
+	return 1;
+#else
+	unsigned int n = thread::hardware_concurrency();
+	if (n == 0)
+		n = 1;
+	else if (n > 64)
+		n = 64;
+	return n;
+#endif
+}
+
+
 #if 0
 
 // for debugging/inspection
@@ -32,6 +32,22 @@ extern "C" {
 
 namespace opmsg {
 
+// ids of the supported algos, as index into the (sorted) tables in misc.cc
+enum calgo_t {
+	CALGO_INVALID = -1,
+	CALGO_AES128CBC = 0, CALGO_AES128CFB, CALGO_AES128CTR, CALGO_AES128GCM,
+	CALGO_AES256CBC, CALGO_AES256CFB, CALGO_AES256CTR, CALGO_AES256GCM,
+	CALGO_BFCBC, CALGO_BFCFB, CALGO_CAST5CBC, CALGO_CAST5CFB,
+	CALGO_CHACHA20_POLY1305, CALGO_NULL,
+	CALGO_MAX
+};
+
+enum halgo_t {
+	HALGO_INVALID = -1,
+	HALGO_RIPEMD160 = 0, HALGO_SHA256, HALGO_SHA384, HALGO_SHA512,
+	HALGO_MAX
+};
+
 std::string &blob2hex(const std::string &, std::string &);
 
 bool is_hex_hash(const std::string &);
@@ -44,10 +60,32 @@ void print_calgos(std::ostringstream &);
 
 void print_halgos(std::ostringstream &);
 
+calgo_t calgo2id(const std::string &);
+
+halgo_t halgo2id(const std::string &);
+
+bool is_aead(calgo_t);
+
+const EVP_CIPHER *id2cipher(calgo_t);
+
+const EVP_MD *id2md(halgo_t);
+
 const EVP_CIPHER *algo2cipher(const std::string &);
 
 const EVP_MD *algo2md(const std::string &);
 
+const EVP_MD *fetch_md(const EVP_MD *);
+
+const EVP_CIPHER *fetch_cipher(const EVP_CIPHER *);
+
+EVP_MD_CTX *md_ctx_new();
+
+void md_ctx_free(EVP_MD_CTX *);
+
+EVP_CIPHER_CTX *cipher_ctx_new();
+
+void cipher_ctx_free(EVP_CIPHER_CTX *);
+
 std::string build_error(const std::string &msg);
 
 void rlockf(FILE *);
@@ -64,6 +102,10 @@ void unlockf(int);
 
 void hex_dump(const char *, size_t);
 
+unsigned int max_threads();
+
+void seed_rand();
+
 extern const std::string prefix;
 
 }
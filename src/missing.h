@@ -44,6 +44,26 @@ extern "C" {
 #define EVP_MD_CTX_delete EVP_MD_CTX_destroy
 #endif
 
+// multi-prime RSA keys (RFC 8017) can be generated as of OpenSSL 1.1.1
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !(defined HAVE_LIBRESSL) && !(defined HAVE_BORINGSSL)
+#define HAVE_RSA_MULTIPRIME
+#endif
+
+// X25519/X448 kex and Ed25519/Ed448 personas need the raw key API which appeared in OpenSSL 1.1.1
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !(defined HAVE_LIBRESSL) && !(defined HAVE_BORINGSSL)
+#define HAVE_X25519
+#endif
+
+// secure heap BIGNUMs and BN_priv_rand() for private exponents, as of OpenSSL 1.1.1
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !(defined HAVE_LIBRESSL) && !(defined HAVE_BORINGSSL)
+#define HAVE_BN_PRIV_RAND
+#endif
+
+// explicit algorithm fetching from providers, as of OpenSSL 3.0
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !(defined HAVE_LIBRESSL) && !(defined HAVE_BORINGSSL)
+#define HAVE_EVP_FETCH
+#endif
+
 
 namespace opmsg {
 
@@ -59,6 +79,8 @@ void DH_get0_key(const DH *dh, const BIGNUM **pub_key, const BIGNUM **priv_key);
 
 int DH_set0_key(DH *dh, BIGNUM *pub_key, BIGNUM *priv_key);
 
+void DH_get0_pqg(const DH *dh, const BIGNUM **p, const BIGNUM **q, const BIGNUM **g);
+
 }
 
 #endif
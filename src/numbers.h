@@ -31,10 +31,33 @@ enum {
 	DEFAULT_DH_PLEN		= 2048,
 	MIN_DH_PLEN		= 1024,
 	MAX_DH_PLEN		= 16000,
+	MAX_DHTAB_PLEN		= 8192,
 
 	DEFAULT_RSA_LEN		= 4096,
 	MIN_RSA_LEN		= 1024,
-	MAX_RSA_LEN		= 16000
+	MAX_RSA_LEN		= 16000,
+
+	DEFAULT_RSA_PRIMES	= 2,
+	MIN_RSA_PRIMES		= 2,
+	MAX_RSA_PRIMES		= 5,
+
+	MAX_RATCHET_SKIP	= 256,
+
+	MAX_KEXPACK_RECORD	= 0x10000,
+
+	MAX_DIRFDS		= 64,
+
+	MAX_ID_BYTES		= 64,		// EVP_MAX_MD_SIZE
+
+	MAX_IMPORTED_LOG	= 1024,		// entries of 'imported' before it is compacted
+	MAX_IMPORTED_EXPIRE	= 36500,	// days
+
+	DEFAULT_KEYCACHE_EXPIRE	= 30,		// days
+	MAX_KEYCACHE_EXPIRE	= 36500,
+
+	DEFAULT_TREEHASH_CHUNK	= 0x400000,
+	MIN_TREEHASH_CHUNK	= 0x1000,
+	MAX_TREEHASH_CHUNK	= 0x40000000
 
 };
 
@@ -25,6 +25,7 @@
 #include <string>
 #include <cstdio>
 #include <cstring>
+#include <cstdlib>
 #include <fcntl.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -40,6 +41,8 @@
 #include "config.h"
 #include "message.h"
 #include "keystore.h"
+#include "filehash.h"
+#include "ratchet.h"
 
 extern "C" {
 #include <openssl/evp.h>
@@ -60,6 +63,12 @@ enum {
 	NEWECP			= 6,
 	DENIABLE		= 7,
 	FREEHUGS		= 8,
+	TREEHASH		= 9,
+	SIGN_MANIFEST		= 10,
+	VERIFY_MANIFEST		= 11,
+	NEWEDP			= 12,
+	COMPACT			= 13,
+	SHARD			= 14,
 
 	CMODE_INVALID		= 0,
 	CMODE_ENCRYPT		= 0x100,
@@ -73,7 +82,12 @@ enum {
 	CMODE_PGPLIST		= 0x10000,
 	CMODE_LINK		= 0x20000,
 	CMODE_NEWECP		= 0x40000,
-	CMODE_FREEHUGS		= 0x80000
+	CMODE_FREEHUGS		= 0x80000,
+	CMODE_SIGN_MANIFEST	= 0x100000,
+	CMODE_VERIFY_MANIFEST	= 0x200000,
+	CMODE_NEWEDP		= 0x400000,
+	CMODE_COMPACT		= 0x800000,
+	CMODE_SHARD		= 0x1000000
 };
 
 
@@ -107,13 +121,17 @@ void usage(const char *p)
 	    <<"\t[--verify file] <--persona ID> [--import] [--list] [--listpgp]"<<endl
 	    <<"\t[--short] [--long] [--split] [--new(ec)p] [--newdhp] [--calgo name]"<<endl
 	    <<"\t[--phash name [--name name] [--in infile] [--out outfile]"<<endl
-	    <<"\t[--link target id] [--deniable] [--burn]"<<endl<<endl
+	    <<"\t[--link target id] [--deniable] [--burn] [--treehash]"<<endl
+	    <<"\t[--sign-manifest dir|list] [--verify-manifest] [--compact] [--shard]"<<endl<<endl
             <<"\t--confdir,\t-c\t(must come first) defaults to ~/.opmsg"<<endl
 	    <<"\t--native,\t-R\tEC/RSA override (dont use existing (EC)DH keys)"<<endl
 	    <<"\t--encrypt,\t-E\trecipients persona hex id (-i to -o, needs -P)"<<endl
 	    <<"\t--decrypt,\t-D\tdecrypt --in to --out"<<endl
 	    <<"\t--sign,\t\t-S\tcreate detached signature file from -i via -P"<<endl
 	    <<"\t--verify,\t-V\tvrfy hash contained in detached file against -i"<<endl
+	    <<"\t--treehash\t\tuse parallel tree-hash when signing (large files)"<<endl
+	    <<"\t--sign-manifest\t\tsign hashes of all files in dir or list via -P"<<endl
+	    <<"\t--verify-manifest\tvrfy all files of signed manifest from -i"<<endl
 	    <<"\t--persona,\t-P\tyour persona hex id as used for signing"<<endl
 	    <<"\t--import,\t-I\timport new persona from --in"<<endl
 	    <<"\t--list,\t\t-l\tlist all personas"<<endl
@@ -123,10 +141,13 @@ void usage(const char *p)
 	    <<"\t--split\t\t\tsplit view of hex ids"<<endl
 	    <<"\t--newp,\t\t-N\tcreate new RSA persona (should add --name)"<<endl
 	    <<"\t--newecp\t\tcreate new EC persona (should add --name)"<<endl
+	    <<"\t--newedp\t\tcreate new Ed25519/Ed448 persona (should add --name)"<<endl
 	    <<"\t--deniable\t\twhen create/import personas, do it deniable"<<endl
 	    <<"\t--link\t\t\tlink (your) --persona as default src to this"<<endl
 	    <<"\t\t\t\ttarget id"<<endl
 	    <<"\t--newdhp\t\tcreate new DHparams for persona (rarely needed)"<<endl
+	    <<"\t--compact\t\tdrop deleted keys and compact imported list of --persona"<<endl
+	    <<"\t--shard\t\t\tmove keystore into the layout set by shard/shard_kex"<<endl
 	    <<"\t--calgo,\t-C\tuse this algo for encryption"<<endl
 	    <<"\t--phash,\t-p\tuse this hash algo for hashing personas"<<endl
 	    <<"\t--in,\t\t-i\tinput file (stdin)"<<endl
@@ -228,27 +249,49 @@ string idformat(const string &id)
 }
 
 
-int file2hexhash(const string &path, string &hexhash)
+// load the persona used for detached signatures
+persona *load_signer(keystore *ks)
 {
-	hexhash = "";
-	string text = "";
-	if (read_msg(path, text) < 0)
-		return -1;
+	persona *my_p = nullptr;
 
-	unsigned int hlen = 0;
-	unsigned char digest[EVP_MAX_MD_SIZE];	// 64 which matches sha512
-	unique_ptr<EVP_MD_CTX, EVP_MD_CTX_del> md_ctx(EVP_MD_CTX_create(), EVP_MD_CTX_delete);
-	if (!md_ctx.get())
-		return -1;
-	if (EVP_DigestInit_ex(md_ctx.get(), algo2md(config::shash), nullptr) != 1)
-		return -1;
-	if (EVP_DigestUpdate(md_ctx.get(), text.c_str(), text.size()) != 1)
+	if (ks->load(config::my_id) < 0) {
+		estr<<prefix<<"ERROR: "<<ks->why()<<endl; eflush();
+		return nullptr;
+	}
+
+	if (!(my_p = ks->find_persona(config::my_id))) {
+		estr<<prefix<<"ERROR: "<<ks->why()<<endl; eflush();
+		return nullptr;
+	}
+
+	if (!my_p->can_sign()) {
+		estr<<prefix<<"ERROR: Missing keys for signing!\n"; eflush();
+		return nullptr;
+	}
+	return my_p;
+}
+
+
+// sign content via a null-calgo message and write it to outfile
+int sign_detached(persona *my_p, string &content)
+{
+	message msg(config::version, config::cfgbase, config::phash, config::khash, config::shash, "null");
+	msg.src_id(my_p->get_id());
+	msg.dst_id(my_p->get_id());
+
+	if (my_p->get_type() == marker::rsa)
+		msg.kex_id(marker::rsa_kex_id);
+	else
+		msg.kex_id(marker::ec_kex_id);
+
+	if (msg.encrypt(content, my_p, my_p) != 1) {
+		estr<<prefix<<"ERROR: Signing file: "<<msg.why()<<endl; eflush();
 		return -1;
-	if (EVP_DigestFinal_ex(md_ctx.get(), digest, &hlen) != 1)
+	}
+	if (write_msg(config::outfile, content, 0) < 0) {
+		estr<<prefix<<"ERROR: Writing outfile: "<<strerror(errno)<<endl; eflush();
 		return -1;
-
-	text = "";
-	blob2hex(string(reinterpret_cast<char *>(digest), hlen), hexhash);
+	}
 	return 0;
 }
 
@@ -266,47 +309,89 @@ int do_sign()
 		return -1;
 	}
 
-	if (ks->load(config::my_id) < 0) {
-		estr<<prefix<<"ERROR: "<<ks->why()<<endl; eflush();
+	if (!(my_p = load_signer(ks.get())))
 		return -1;
-	}
 
-	if (!(my_p = ks->find_persona(config::my_id))) {
-		estr<<prefix<<"ERROR: "<<ks->why()<<endl; eflush();
+	if (config::treehash > 0) {
+		if (file2treehash(algo2md(config::shash), config::infile, config::treehash, hexhash) < 0) {
+			estr<<prefix<<"ERROR: generating "<<config::shash<<" tree-hash for file.\n"; eflush();
+			return -1;
+		}
+		hexhash = marker::tree_hash + to_string(config::treehash) + ":" + hexhash;
+	} else if (file2hexhash(algo2md(config::shash), config::infile, hexhash) < 0) {
+		estr<<prefix<<"ERROR: generating "<<config::shash<<" for file.\n"; eflush();
 		return -1;
 	}
 
-	if (!my_p->can_sign()) {
-		estr<<prefix<<"ERROR: Missing keys for signing!\n"; eflush();
-		return -1;
-	}
+	return sign_detached(my_p, hexhash);
+}
 
-	if (file2hexhash(config::infile, hexhash) < 0) {
-		estr<<prefix<<"ERROR: generating "<<config::shash<<" for file.\n"; eflush();
+
+// one signature across the hashes of many files
+int do_sign_manifest(const string &src)
+{
+	struct stat st;
+	string list = "", manifest = "";
+	vector<string> files, hexhashes, skipped;
+	vector<int> errnos;
+
+	unique_ptr<keystore> ks(new (nothrow) keystore(config::phash, config::cfgbase));
+	persona *my_p = nullptr;
+
+	if (!ks.get()) {
+		estr<<prefix<<"ERROR: OOM\n"; eflush();
 		return -1;
 	}
 
-	message msg(config::version, config::cfgbase, config::phash, config::khash, config::shash, "null");
-	msg.src_id(my_p->get_id());
-	msg.dst_id(my_p->get_id());
+	if (!(my_p = load_signer(ks.get())))
+		return -1;
 
-	if (my_p->get_type() == marker::rsa)
-		msg.kex_id(marker::rsa_kex_id);
-	else
-		msg.kex_id(marker::ec_kex_id);
+	if (stat(src.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+		if (dir2files(src, files, skipped) < 0) {
+			estr<<prefix<<"ERROR: reading directory "<<src<<": "<<strerror(errno)<<endl; eflush();
+			return -1;
+		}
+		for (auto &f : skipped)
+			estr<<prefix<<"WARNING: not signing "<<f<<", not a regular file (symlinks are not followed)\n";
+		eflush();
+	} else {
+		if (read_msg(src, list) < 0) {
+			estr<<prefix<<"ERROR: reading file list "<<src<<": "<<strerror(errno)<<endl; eflush();
+			return -1;
+		}
+		istringstream istr(list);
+		for (string line; getline(istr, line);) {
+			if (line.size() > 0 && line[line.size() - 1] == '\r')
+				line.erase(line.size() - 1);
+			if (line.size() > 0)
+				files.push_back(line);
+		}
+	}
 
-	if (msg.encrypt(hexhash, my_p, my_p) != 1) {
-		estr<<prefix<<"ERROR: Signing file: "<<msg.why()<<endl; eflush();
+	if (files.empty()) {
+		estr<<prefix<<"ERROR: No files to sign.\n"; eflush();
 		return -1;
 	}
-	if (write_msg(config::outfile, hexhash, 0) < 0) {
-		estr<<prefix<<"ERROR: Writing outfile: "<<strerror(errno)<<endl; eflush();
+
+	if (files2hexhash(algo2md(config::shash), files, hexhashes, &errnos) != 0) {
+		for (vector<string>::size_type i = 0; i < files.size(); ++i) {
+			if (hexhashes[i].empty())
+				estr<<prefix<<"ERROR: generating "<<config::shash<<" for "<<files[i]<<": "<<(errnos[i] ? strerror(errnos[i]) : "hashing failed")<<endl;
+		}
+		eflush();
 		return -1;
 	}
-	return 0;
+
+	manifest = marker::manifest + to_string(files.size()) + "\n";
+	for (vector<string>::size_type i = 0; i < files.size(); ++i)
+		manifest += hexhashes[i] + "  " + files[i] + "\n";
+
+	estr<<prefix<<"hashed "<<files.size()<<" files\n"; eflush();
+	return sign_detached(my_p, manifest);
 }
 
 
+
 int do_encrypt(const string &dst_id, const string &s, int may_append)
 {
 	int r1 = 0, r2 = 0;
@@ -371,17 +456,38 @@ int do_encrypt(const string &dst_id, const string &s, int may_append)
 	msg.src_id(src_p->get_id());
 	msg.dst_id(dst_p->get_id());
 
-	if (dst_p->get_type() == marker::ec)
+	if (config::dh_precompute)
+		msg.enable_dh_precompute();
+
+	// EC and Ed personas fall back to ECDH with their persona key
+	if (dst_p->get_type() != marker::rsa)
 		kex_id = marker::ec_kex_id;
 
-	if (!config::native_crypt && config::calgo != "null") {
+	// with a running ratchet session, neither a Kex key is used nor new ones are sent.
+	// Not for personas linked to themselfs, as both sides would share the session.
+	bool use_ratchet = 0;
+	if (config::ratchet && !linked_to_myself && config::calgo != "null") {
+		msg.enable_ratchet();
+		ratchet rt(config::cfgbase, src_p->get_id(), dst_p->get_id());
+		if ((r1 = rt.load()) < 0) {
+			estr<<prefix<<"ERROR: "<<rt.why()<<endl; eflush();
+			return -1;
+		}
+		if (r1 == 1 && rt.can_send()) {
+			kex_id = marker::ratchet_kex_id;
+			use_ratchet = 1;
+		}
+		r1 = 0;
+	}
+
+	if (!use_ratchet && !config::native_crypt && config::calgo != "null") {
 		for (auto i = dst_p->first_key(); i != dst_p->end_key(); i = dst_p->next_key(i)) {
 			if (!i->second.empty() && i->second[0]->can_encrypt()) {
 				// only keys that peer sent us for import, so ignore (EC)DH keys
 				// where we also store the private half
 				if (linked_to_myself && i->second[0]->can_decrypt())
 					continue;
-				kex_id = i->first;
+				kex_id = i->first.hex();
 				break;
 			}
 		}
@@ -397,7 +503,7 @@ int do_encrypt(const string &dst_id, const string &s, int may_append)
 
 	// Add new (EC)DH keys for upcoming Kex in future
 	vector<string> newdh;
-	for (int i = 0; config::calgo != "null" && src_p->can_kex_gen() && i < config::new_dh_keys; ++i) {
+	for (int i = 0; !use_ratchet && config::calgo != "null" && src_p->can_kex_gen() && i < config::new_dh_keys; ++i) {
 		vector<PKEYbox *> vpbox = src_p->gen_kex_key(config::khash, dst_p->get_id());
 		if (vpbox.size() > 0) {
 			newdh.push_back(vpbox[0]->d_hex);
@@ -434,7 +540,7 @@ int do_encrypt(const string &dst_id, const string &s, int may_append)
 
 	// everything went fine, so erase used pub DH key from
 	// peer personas store to avoid using them twice
-	if (kex_id != marker::rsa_kex_id && kex_id != marker::ec_kex_id) {
+	if (kex_id != marker::rsa_kex_id && kex_id != marker::ec_kex_id && kex_id != marker::ratchet_kex_id) {
 		dst_p->del_dh_pub(kex_id);
 		// hexid directory can be delted too, newly imported keys are tracked
 		// via 'imported' file per persona. If we dont track it in "imported"
@@ -493,6 +599,11 @@ int do_decrypt()
 
 		if (config::peer_isolation)
 			msg.enable_peer_isolation();
+		if (config::ratchet)
+			msg.enable_ratchet();
+		// a cached key would outlive burnt kex keys
+		if (config::keycache && !config::burn)
+			msg.enable_keycache(config::keycache_expire);
 
 		r = msg.decrypt(s);
 		if (r != 1) {
@@ -537,9 +648,9 @@ int do_decrypt()
 }
 
 
-int do_verify(const string &verify_file)
+// read and check a detached signature from infile, leaving the signed content in ctext
+int verify_detached(message &msg, string &ctext)
 {
-	string ctext = "", hexhash = "";
 	string::size_type pos = 0;
 
 	if (read_msg(config::infile, ctext) < 0) {
@@ -561,14 +672,47 @@ int do_verify(const string &verify_file)
 
 	ctext.erase(pos + marker::opmsg_end.size());
 
-	message msg(1, config::cfgbase, config::phash, config::khash, config::shash, config::calgo);
-
 	if (msg.decrypt(ctext) != 1) {
 		estr<<prefix<<"ERROR: verifying message: "<<msg.why()<<endl; eflush();
 		return -1;
 	}
 
-	if (file2hexhash(verify_file, hexhash) < 0) {
+	if (msg.get_calgo() != "null") {
+		estr<<prefix<<"ERROR: Infile is not a detached signature.\n"; eflush();
+		return -1;
+	}
+	return 0;
+}
+
+
+int do_verify(const string &verify_file)
+{
+	string ctext = "", hexhash = "";
+
+	message msg(1, config::cfgbase, config::phash, config::khash, config::shash, config::calgo);
+
+	if (verify_detached(msg, ctext) < 0)
+		return -1;
+
+	const EVP_MD *md = algo2md(msg.get_shash());
+	if (!md) {
+		estr<<prefix<<"ERROR: unknown hash algo "<<msg.get_shash()<<" in signature.\n"; eflush();
+		return -1;
+	}
+
+	// tree-hash=chunksize:hexhash
+	if (ctext.find(marker::tree_hash) == 0) {
+		unsigned long chunk = strtoul(ctext.c_str() + marker::tree_hash.size(), nullptr, 10);
+		if (chunk < MIN_TREEHASH_CHUNK || chunk > MAX_TREEHASH_CHUNK) {
+			estr<<prefix<<"ERROR: invalid tree-hash chunk size in signature.\n"; eflush();
+			return -1;
+		}
+		if (file2treehash(md, verify_file, chunk, hexhash) < 0) {
+			estr<<prefix<<"ERROR: generating tree-hash for file.\n"; eflush();
+			return -1;
+		}
+		hexhash = marker::tree_hash + to_string(chunk) + ":" + hexhash;
+	} else if (file2hexhash(md, verify_file, hexhash) < 0) {
 		estr<<prefix<<"ERROR: generating hash for file.\n"; eflush();
 		return -1;
 	}
@@ -582,6 +726,81 @@ int do_verify(const string &verify_file)
 }
 
 
+int do_verify_manifest()
+{
+	string ctext = "", line = "";
+	vector<string> files, hexhashes, signed_hashes;
+	string::size_type pos = 0;
+	unsigned long n = 0, bad = 0;
+
+	message msg(1, config::cfgbase, config::phash, config::khash, config::shash, config::calgo);
+
+	if (verify_detached(msg, ctext) < 0)
+		return -1;
+
+	const EVP_MD *md = algo2md(msg.get_shash());
+	if (!md) {
+		estr<<prefix<<"ERROR: unknown hash algo "<<msg.get_shash()<<" in signature.\n"; eflush();
+		return -1;
+	}
+
+	if (ctext.find(marker::manifest) != 0) {
+		estr<<prefix<<"ERROR: Signed content is not a manifest.\n"; eflush();
+		return -1;
+	}
+
+	istringstream istr(ctext);
+	getline(istr, line);
+	n = strtoul(line.c_str() + marker::manifest.size(), nullptr, 10);
+
+	while (getline(istr, line)) {
+		if ((pos = line.find("  ")) == string::npos || !is_hex_hash(line.substr(0, pos))) {
+			estr<<prefix<<"ERROR: Invalid manifest line.\n"; eflush();
+			return -1;
+		}
+		signed_hashes.push_back(line.substr(0, pos));
+		files.push_back(line.substr(pos + 2));
+	}
+
+	if (files.size() != n) {
+		estr<<prefix<<"ERROR: Truncated manifest.\n"; eflush();
+		return -1;
+	}
+
+	files2hexhash(md, files, hexhashes);
+
+	for (vector<string>::size_type i = 0; i < files.size(); ++i) {
+		if (hexhashes[i].empty()) {
+			estr<<prefix<<"MISSING "<<files[i]<<endl;
+			++bad;
+		} else if (hexhashes[i] != signed_hashes[i]) {
+			estr<<prefix<<"BAD "<<msg.get_shash()<<" of "<<files[i]<<endl;
+			++bad;
+		}
+	}
+
+	if (bad == 0) {
+		estr<<prefix<<"GOOD signature and hashes of "<<n<<" files via persona "<<idformat(msg.src_id())<<"\n"; eflush();
+		return 0;
+	}
+
+	estr<<prefix<<bad<<" of "<<n<<" files failed verification for persona "<<idformat(msg.src_id())<<"\n"; eflush();
+	return -1;
+}
+
+
+// index of the first configured curve that can be used for an EC persona,
+// as x25519/x448 are kex-only
+static int persona_curve()
+{
+	for (unsigned int i = 0; i < config::curve_nids.size(); ++i) {
+		if (!is_xdh(config::curve_nids[i]))
+			return (int)i;
+	}
+	return -1;
+}
+
+
 int do_newpersona(const string &name, const string &type, bool sign)
 {
 	keystore ks(config::phash, config::cfgbase);
@@ -593,8 +812,18 @@ int do_newpersona(const string &name, const string &type, bool sign)
 			estr<<prefix<<"ERROR: generating new RSA keys: "<<ks.why()<<endl; eflush();
 			return -1;
 		}
+	} else if (type == marker::ed25519 || type == marker::ed448) {
+		if (ks.gen_ed(pub, priv, type) < 0) {
+			estr<<prefix<<"ERROR: generating new Ed keys: "<<ks.why()<<endl; eflush();
+			return -1;
+		}
 	} else {
-		if (ks.gen_ec(pub, priv, config::curve_nids[0]) < 0) {
+		int c = persona_curve();
+		if (c < 0) {
+			estr<<prefix<<"ERROR: No curve configured that is suitable for an EC persona.\n"; eflush();
+			return -1;
+		}
+		if (ks.gen_ec(pub, priv, config::curve_nids[c]) < 0) {
 			estr<<prefix<<"ERROR: generating new EC keys: "<<ks.why()<<endl; eflush();
 			return -1;
 		}
@@ -634,10 +863,10 @@ int do_newpersona(const string &name, const string &type, bool sign)
 		msg.src_id(p->get_id());
 		msg.dst_id(p->get_id());
 
-		if (p->get_type() == marker::ec)
-			msg.kex_id(marker::ec_kex_id);
-		else
+		if (p->get_type() == marker::rsa)
 			msg.kex_id(marker::rsa_kex_id);
+		else
+			msg.kex_id(marker::ec_kex_id);
 
 		if (msg.encrypt(s, p, p) < 0) {
 			estr<<prefix<<"ERROR: Signing freshly generated persona key: "<<msg.why()<<endl; eflush();
@@ -670,6 +899,12 @@ int do_new_ec_persona(const string &name, bool sign)
 }
 
 
+int do_new_ed_persona(const string &name, bool sign)
+{
+	return do_newpersona(name, config::ed_curve, sign);
+}
+
+
 int do_newdhparams()
 {
 	unique_ptr<keystore> ks(new (nothrow) keystore(config::phash, config::cfgbase));
@@ -695,7 +930,12 @@ int do_newdhparams()
 		return -1;
 	}
 
-	if (!my_p->new_dh_params()) {
+	if (config::dh_group.size() > 0) {
+		if (!my_p->new_dh_group(config::dh_group)) {
+			estr<<prefix<<"ERROR: "<<my_p->why()<<endl; eflush();
+			return -1;
+		}
+	} else if (!my_p->new_dh_params()) {
 		estr<<"\n\n"<<prefix<<"ERROR: Generating DHparams for "<<config::my_id<<"\n"; eflush();
 		return -1;
 	}
@@ -705,6 +945,47 @@ int do_newdhparams()
 }
 
 
+int do_compact()
+{
+	unique_ptr<keystore> ks(new (nothrow) keystore(config::phash, config::cfgbase));
+	persona *p = nullptr;
+
+	if (!ks.get()) {
+		estr<<prefix<<"ERROR: OOM\n"; eflush();
+		return -1;
+	}
+
+	// no need to load any (EC)DH keys
+	if (ks->load(config::my_id, LFLAGS_NAME|LFLAGS_KEY) < 0) {
+		estr<<prefix<<"ERROR: "<<ks->why()<<endl; eflush();
+		return -1;
+	}
+
+	if (!(p = ks->find_persona(config::my_id))) {
+		estr<<prefix<<"ERROR: "<<ks->why()<<endl; eflush();
+		return -1;
+	}
+
+	if (p->compact_kex() < 0 || p->compact_imported() < 0) {
+		estr<<prefix<<"ERROR: "<<p->why()<<endl; eflush();
+		return -1;
+	}
+	return 0;
+}
+
+
+int do_shard()
+{
+	keystore ks(config::phash, config::cfgbase);
+
+	if (ks.shard() < 0) {
+		estr<<prefix<<"ERROR: "<<ks.why()<<endl; eflush();
+		return -1;
+	}
+	return 0;
+}
+
+
 int do_list(const string &name)
 {
 	// for conveniance, treat hash sums the way they are, even
@@ -772,7 +1053,7 @@ static int split_deniable_keys(string &pub, string &priv)
 int do_import(const string &name)
 {
 	if (config::infile == "/dev/stdin") {
-		estr<<prefix<<"Paste the EC/RSA pubkey here. End with <Return> followed by <Ctrl-C>\n\n";
+		estr<<prefix<<"Paste the EC/Ed/RSA pubkey here. End with <Return> followed by <Ctrl-C>\n\n";
 		eflush();
 	}
 
@@ -897,7 +1178,10 @@ int main(int argc, char **argv)
 	        {"split", no_argument, nullptr, ID_FORMAT_SPLIT},
 	        {"newp", no_argument, nullptr, 'N'},
 		{"newecp", no_argument, nullptr, NEWECP},
+		{"newedp", no_argument, nullptr, NEWEDP},
 		{"newdhp", no_argument, nullptr, NEWDHP},
+		{"compact", no_argument, nullptr, COMPACT},
+		{"shard", no_argument, nullptr, SHARD},
 		{"deniable", no_argument, nullptr, DENIABLE},
 	        {"calgo", required_argument, nullptr, 'C'},
 	        {"phash", required_argument, nullptr, 'p'},
@@ -907,10 +1191,13 @@ int main(int argc, char **argv)
 	        {"in", required_argument, nullptr, 'i'},
 	        {"out", required_argument, nullptr, 'o'},
 	        {"freehugs", no_argument, nullptr, FREEHUGS},
+	        {"treehash", no_argument, nullptr, TREEHASH},
+	        {"sign-manifest", required_argument, nullptr, SIGN_MANIFEST},
+	        {"verify-manifest", no_argument, nullptr, VERIFY_MANIFEST},
 	        {nullptr, 0, nullptr, 0}};
 
 	int c = 1, opt_idx = 0, cmode = CMODE_INVALID, r = -1;
-	string detached_file = "", verify_file = "", name = "", link_src = "", s = "";
+	string detached_file = "", verify_file = "", name = "", link_src = "", s = "", manifest_src = "";
 	string::size_type ridx = string::npos;
 	vector<string> dst_ids;
 
@@ -1053,9 +1340,18 @@ int main(int argc, char **argv)
 		case NEWDHP:
 			cmode = CMODE_NEWDHP;
 			break;
+		case COMPACT:
+			cmode = CMODE_COMPACT;
+			break;
+		case SHARD:
+			cmode = CMODE_SHARD;
+			break;
 		case NEWECP:
 			cmode |= CMODE_NEWECP;
 			break;
+		case NEWEDP:
+			cmode |= CMODE_NEWEDP;
+			break;
 		case ID_FORMAT_LONG:
 			config::idformat = "long";
 			break;
@@ -1078,6 +1374,16 @@ int main(int argc, char **argv)
 		case FREEHUGS:
 			cmode = CMODE_FREEHUGS;
 			break;
+		case TREEHASH:
+			config::treehash = DEFAULT_TREEHASH_CHUNK;
+			break;
+		case SIGN_MANIFEST:
+			manifest_src = optarg;
+			cmode = CMODE_SIGN_MANIFEST;
+			break;
+		case VERIFY_MANIFEST:
+			cmode = CMODE_VERIFY_MANIFEST;
+			break;
 		}
 	}
 
@@ -1161,9 +1467,20 @@ int main(int argc, char **argv)
 		estr<<prefix<<"verifying detached file\n"; eflush();
 		r = do_verify(verify_file);
 		break;
+	case CMODE_SIGN_MANIFEST:
+		estr<<prefix<<"manifest-signing by persona "<<idformat(config::my_id)<<"\n"; eflush();
+		r = do_sign_manifest(manifest_src);
+		break;
+	case CMODE_VERIFY_MANIFEST:
+		estr<<prefix<<"verifying manifest\n"; eflush();
+		r = do_verify_manifest();
+		break;
 	case CMODE_NEWP:
 	case CMODE_NEWP|CMODE_SIGN:
-		estr<<prefix<<"creating new persona (RSA "<<config::rsa_len<<", DH "<<config::dh_plen<<")\n\n"; eflush();
+		estr<<prefix<<"creating new persona (RSA "<<config::rsa_len;
+		if (config::rsa_primes > 2)
+			estr<<"/"<<config::rsa_primes<<" primes";
+		estr<<", DH "<<config::dh_plen<<")\n\n"; eflush();
 		r = do_new_rsa_persona(name, (cmode & CMODE_SIGN) == CMODE_SIGN);
 		break;
 	case CMODE_NEWDHP:
@@ -1172,9 +1489,22 @@ int main(int argc, char **argv)
 		break;
 	case CMODE_NEWECP:
 	case CMODE_NEWECP|CMODE_SIGN:
-		estr<<prefix<<"creating new EC persona (curve "<<config::curves[0]<<")\n\n"; eflush();
+		estr<<prefix<<"creating new EC persona (curve "<<(persona_curve() < 0 ? "none" : config::curves[persona_curve()])<<")\n\n"; eflush();
 		r = do_new_ec_persona(name, (cmode & CMODE_SIGN) == CMODE_SIGN);
 		break;
+	case CMODE_NEWEDP:
+	case CMODE_NEWEDP|CMODE_SIGN:
+		estr<<prefix<<"creating new Ed persona ("<<config::ed_curve<<")\n\n"; eflush();
+		r = do_new_ed_persona(name, (cmode & CMODE_SIGN) == CMODE_SIGN);
+		break;
+	case CMODE_COMPACT:
+		estr<<prefix<<"compacting (EC)DH keys of persona "<<idformat(config::my_id)<<"\n"; eflush();
+		r = do_compact();
+		break;
+	case CMODE_SHARD:
+		estr<<prefix<<"sharding keystore "<<config::cfgbase<<"\n"; eflush();
+		r = do_shard();
+		break;
 	case CMODE_IMPORT:
 		estr<<prefix<<"importing persona\n"; eflush();
 		r = do_import(name);
@@ -1194,6 +1524,9 @@ int main(int argc, char **argv)
 		estr<<prefix<<"Invalid combination of options?\n";
 	}
 
+	// dont rely on static destructors to shred burned keys
+	burn_drain();
+
 	if (cmode != CMODE_PGPLIST) {
 		if (r == 0)
 			estr<<prefix<<"SUCCESS.\n";
@@ -0,0 +1,524 @@
+/*
+ * This file is part of the opmsg crypto message framework.
+ *
+ * (C) 2015-2018 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * opmsg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * opmsg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with opmsg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <string>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+extern "C" {
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+}
+
+#include "missing.h"
+#include "deleters.h"
+#include "numbers.h"
+#include "base64.h"
+#include "misc.h"
+#include "storage.h"
+#include "ratchet.h"
+
+
+namespace opmsg {
+
+using namespace std;
+
+
+/* The double ratchet as known from Signal, on top of the normal opmsg Kex:
+ *
+ * A peer without a session sends an "offer" along with a normal (EC)DH/RSA
+ * kexed message: its ratchet key and a random root key, the latter masked
+ * with the Kex secret of that message. The same offer is repeated until the peer
+ * answers with a ratchet message, so it doesnt matter which of them arrives.
+ * The receiver of an offer starts the session by turning the ratchet once and
+ * can send right away. If both sides offer at the same time, the one with the
+ * larger persona id gives in.
+ *
+ * Each message key is the next step of a HMAC-SHA256 chain and only used as
+ * the Kex secret for the usual kdf. The root chain is fed by a fresh X25519
+ * output whenever the peer's ratchet key changes. Message keys of skipped
+ * messages are kept, so messages may arrive out of order.
+ */
+
+
+static void wipe(string &s)
+{
+	if (s.size() > 0)
+		OPENSSL_cleanse(&s[0], s.size());
+	s.clear();
+}
+
+
+static int hmac(const string &key, const string &data, string &out)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen = 0;
+
+	if (!HMAC(EVP_sha256(), key.c_str(), key.size(), reinterpret_cast<const unsigned char *>(data.c_str()), data.size(), md, &mdlen))
+		return -1;
+	out.assign(reinterpret_cast<char *>(md), mdlen);
+	OPENSSL_cleanse(md, sizeof(md));
+	return 0;
+}
+
+
+// any 32 random bytes make a X25519 private key
+static int x25519_keygen(string &priv)
+{
+	unsigned char raw[ratchet::KEY_LEN];
+
+	if (RAND_bytes(raw, sizeof(raw)) != 1)
+		return -1;
+	priv.assign(reinterpret_cast<char *>(raw), sizeof(raw));
+	OPENSSL_cleanse(raw, sizeof(raw));
+	return 0;
+}
+
+
+static int x25519_pub(const string &priv, string &pub)
+{
+#ifdef HAVE_X25519
+	unique_ptr<EVP_PKEY, EVP_PKEY_del> key(EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, nullptr,
+	                                       reinterpret_cast<const unsigned char *>(priv.c_str()), priv.size()), EVP_PKEY_free);
+	unsigned char raw[ratchet::KEY_LEN];
+	size_t rawlen = sizeof(raw);
+
+	if (!key.get() || EVP_PKEY_get_raw_public_key(key.get(), raw, &rawlen) != 1)
+		return -1;
+	pub.assign(reinterpret_cast<char *>(raw), rawlen);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+
+static int x25519(const string &priv, const string &pub, string &out)
+{
+#ifdef HAVE_X25519
+	unique_ptr<EVP_PKEY, EVP_PKEY_del> key(EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, nullptr,
+	                                       reinterpret_cast<const unsigned char *>(priv.c_str()), priv.size()), EVP_PKEY_free);
+	unique_ptr<EVP_PKEY, EVP_PKEY_del> peer(EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr,
+	                                        reinterpret_cast<const unsigned char *>(pub.c_str()), pub.size()), EVP_PKEY_free);
+	if (!key.get() || !peer.get())
+		return -1;
+
+	unique_ptr<EVP_PKEY_CTX, EVP_PKEY_CTX_del> ctx(EVP_PKEY_CTX_new(key.get(), nullptr), EVP_PKEY_CTX_free);
+	if (!ctx.get() || EVP_PKEY_derive_init(ctx.get()) != 1 || EVP_PKEY_derive_set_peer(ctx.get(), peer.get()) != 1)
+		return -1;
+
+	unsigned char raw[ratchet::KEY_LEN];
+	size_t rawlen = sizeof(raw);
+	if (EVP_PKEY_derive(ctx.get(), raw, &rawlen) != 1)
+		return -1;
+	out.assign(reinterpret_cast<char *>(raw), rawlen);
+	OPENSSL_cleanse(raw, sizeof(raw));
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+
+// short tag of the message key, so we detect out of sync sessions even for non-AEAD ciphers
+static int key_check(const string &mk, string &chk)
+{
+	string h = "";
+
+	if (hmac(mk, "opmsg ratchet check", h) < 0)
+		return -1;
+	blob2hex(h.substr(0, 8), chk);
+	return 0;
+}
+
+
+ratchet::ratchet(const string &cfgbase, const string &me, const string &peer)
+	: d_me(me), d_peer(peer)
+{
+	d_dir = persona_dir(cfgbase, me) + "/ratchet";
+	d_file = d_dir + "/" + peer;
+}
+
+
+ratchet::~ratchet()
+{
+	if (d_lockfd >= 0) {
+		unlockf(d_lockfd);
+		close(d_lockfd);
+	}
+	wipe(d_dhs);
+	wipe(d_rk);
+	wipe(d_cks);
+	wipe(d_ckr);
+	for (auto &it : d_skipped)
+		wipe(it.second);
+}
+
+
+// new root key and chain key from a DH output
+int ratchet::kdf_rk(const string &dh, string &ck)
+{
+	string prk = "", rk = "";
+
+	if (hmac(d_rk, dh, prk) < 0 || hmac(prk, "\x01", rk) < 0 || hmac(prk, "\x02", ck) < 0)
+		return build_error("kdf_rk::HMAC:", -1);
+	wipe(prk);
+	wipe(d_rk);
+	d_rk = rk;
+	wipe(rk);
+	return 0;
+}
+
+
+// next message key and chain key
+int ratchet::kdf_ck(string &ck, string &mk)
+{
+	string next = "";
+
+	if (hmac(ck, "\x01", mk) < 0 || hmac(ck, "\x02", next) < 0)
+		return build_error("kdf_ck::HMAC:", -1);
+	wipe(ck);
+	ck = next;
+	wipe(next);
+	return 0;
+}
+
+
+// keep message keys of receiving chain up to (excluding) n
+int ratchet::skip(unsigned int n)
+{
+	if (d_ckr.empty())
+		return 0;
+
+	if (n > d_nr + MAX_RATCHET_SKIP)
+		return build_error("skip: Too many skipped messages.", -1);
+
+	string b64pub = "", mk = "";
+	b64_encode(d_dhr, b64pub);
+	for (; d_nr < n; ++d_nr) {
+		if (kdf_ck(d_ckr, mk) < 0)
+			return -1;
+		d_skipped[b64pub + ":" + to_string(d_nr)] = mk;
+		wipe(mk);
+	}
+
+	while (d_skipped.size() > MAX_RATCHET_SKIP) {
+		wipe(d_skipped.begin()->second);
+		d_skipped.erase(d_skipped.begin());
+	}
+	return 0;
+}
+
+
+// 1 if session state found, 0 if none. The session stays locked against other
+// opmsg runs until the ratchet is destroyed, so that load, key derivation and
+// store() happen as one step.
+int ratchet::load()
+{
+#ifndef HAVE_X25519
+	return build_error("load: No X25519 support, needed for ratchet sessions.", -1);
+#endif
+
+	// store() replaces the state file, so lock a separate file that stays in place
+	if (d_lockfd < 0) {
+		if (mkdir(d_dir.c_str(), 0700) < 0 && errno != EEXIST)
+			return build_error("load::mkdir:", -1);
+		if ((d_lockfd = open((d_file + ".lock").c_str(), O_CREAT|O_RDWR, 0600)) < 0)
+			return build_error("load::open:", -1);
+		wlockf(d_lockfd);
+	}
+
+	unique_ptr<FILE, FILE_del> f(fopen(d_file.c_str(), "r"), ffclose);
+	if (!f.get()) {
+		if (errno == ENOENT) {
+			errno = 0;
+			return 0;
+		}
+		return build_error("load::fopen:", -1);
+	}
+
+	char buf[1024];
+	string sline = "", v = "";
+	string::size_type pos = string::npos;
+
+	while (fgets(buf, sizeof(buf), f.get())) {
+		sline = buf;
+		if (sline.size() > 0 && sline[sline.size() - 1] == '\n')
+			sline.erase(sline.size() - 1);
+
+		if (sline.find("dhs=") == 0)
+			b64_decode(sline.substr(4), d_dhs);
+		else if (sline.find("dhr=") == 0)
+			b64_decode(sline.substr(4), d_dhr);
+		else if (sline.find("rk=") == 0)
+			b64_decode(sline.substr(3), d_rk);
+		else if (sline.find("cks=") == 0)
+			b64_decode(sline.substr(4), d_cks);
+		else if (sline.find("ckr=") == 0)
+			b64_decode(sline.substr(4), d_ckr);
+		else if (sline.find("offer=") == 0)
+			b64_decode(sline.substr(6), d_offer);
+		else if (sline.find("num=") == 0) {
+			if (sscanf(sline.c_str() + 4, "%u:%u:%u", &d_ns, &d_nr, &d_pn) != 3)
+				break;
+		} else if (sline.find("skip=") == 0) {
+			if ((pos = sline.rfind(":")) == string::npos || pos < 5)
+				break;
+			b64_decode(sline.substr(pos + 1), v);
+			if (v.size() != KEY_LEN)
+				break;
+			d_skipped[sline.substr(5, pos - 5)] = v;
+			wipe(v);
+		}
+		OPENSSL_cleanse(buf, sizeof(buf));
+	}
+	OPENSSL_cleanse(buf, sizeof(buf));
+	wipe(sline);
+
+	for (auto k : {&d_dhs, &d_dhr, &d_rk, &d_cks, &d_ckr, &d_offer}) {
+		if (k->size() != 0 && k->size() != KEY_LEN)
+			return build_error("load: Invalid ratchet state in " + d_file, -1);
+	}
+	if (!feof(f.get()) || d_dhs.empty() || d_rk.empty())
+		return build_error("load: Invalid ratchet state in " + d_file, -1);
+
+	return 1;
+}
+
+
+int ratchet::store()
+{
+	errno = 0;
+	if (mkdir(d_dir.c_str(), 0700) < 0 && errno != EEXIST)
+		return build_error("store::mkdir:", -1);
+
+	string s = "", b64 = "";
+	auto add = [&](const string &tag, const string &v) {
+		if (v.empty())
+			return;
+		b64_encode(v, b64);
+		s += tag + b64 + "\n";
+	};
+
+	add("dhs=", d_dhs);
+	add("dhr=", d_dhr);
+	add("rk=", d_rk);
+	add("cks=", d_cks);
+	add("ckr=", d_ckr);
+	add("offer=", d_offer);
+	s += "num=" + to_string(d_ns) + ":" + to_string(d_nr) + ":" + to_string(d_pn) + "\n";
+	for (auto &it : d_skipped) {
+		b64_encode(it.second, b64);
+		s += "skip=" + it.first + ":" + b64 + "\n";
+	}
+	wipe(b64);
+
+	// replace state at once, so an interrupted store keeps the old session
+	string tmp = d_file + "." + to_string(getpid());
+	int fd = open(tmp.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0600);
+	if (fd < 0) {
+		wipe(s);
+		return build_error("store::open:", -1);
+	}
+	ssize_t r = write(fd, s.c_str(), s.size());
+	bool ok = (r == (ssize_t)s.size() && fsync(fd) == 0);
+	wipe(s);
+	close(fd);
+	if (!ok || rename(tmp.c_str(), d_file.c_str()) < 0) {
+		unlink(tmp.c_str());
+		return build_error("store::write:", -1);
+	}
+	return 0;
+}
+
+
+// start (or repeat) offering a session to the peer. secret is the Kex secret of the message
+// the offer goes along with
+int ratchet::offer(const unsigned char *secret, int slen, string &hdr)
+{
+	errno = 0;
+	if (d_dhs.empty() || d_dhr.size() > 0 || d_rk.size() != KEY_LEN) {
+		wipe(d_dhr); wipe(d_cks); wipe(d_ckr); wipe(d_rk);
+		d_ns = d_nr = d_pn = 0;
+		d_skipped.clear();
+
+		unsigned char rk[KEY_LEN];
+		if (x25519_keygen(d_dhs) < 0 || RAND_bytes(rk, sizeof(rk)) != 1)
+			return build_error("offer::RAND_bytes:", -1);
+		d_rk.assign(reinterpret_cast<char *>(rk), sizeof(rk));
+		OPENSSL_cleanse(rk, sizeof(rk));
+	}
+
+	string pub = "", mask = "", b64pub = "", b64rk = "";
+	if (x25519_pub(d_dhs, pub) < 0)
+		return build_error("offer: Invalid ratchet key.", -1);
+	if (hmac(string(reinterpret_cast<const char *>(secret), slen), "opmsg ratchet offer" + pub, mask) < 0)
+		return build_error("offer::HMAC:", -1);
+	for (unsigned int i = 0; i < KEY_LEN; ++i)
+		mask[i] ^= d_rk[i];
+
+	b64_encode(pub, b64pub);
+	b64_encode(mask, b64rk);
+	wipe(mask);
+	hdr = b64pub + ":" + b64rk;
+	return 0;
+}
+
+
+// take over a peer's offer. Returns 1 if a new session was started, 0 if the offer was ignored
+int ratchet::accept(const unsigned char *secret, int slen, const string &hdr)
+{
+	errno = 0;
+	string::size_type pos = hdr.find(":");
+	if (pos == string::npos)
+		return build_error("accept: Invalid ratchet offer.", -1);
+
+	string pub = "", rk = "", mask = "";
+	b64_decode(hdr.substr(0, pos), pub);
+	b64_decode(hdr.substr(pos + 1), rk);
+	if (pub.size() != KEY_LEN || rk.size() != KEY_LEN)
+		return build_error("accept: Invalid ratchet offer.", -1);
+
+	// repeated offer, or both offering and its on us to keep our own
+	if (pub == d_offer)
+		return 0;
+	if (d_dhs.size() > 0 && d_dhr.empty() && d_me < d_peer)
+		return 0;
+
+	if (hmac(string(reinterpret_cast<const char *>(secret), slen), "opmsg ratchet offer" + pub, mask) < 0)
+		return build_error("accept::HMAC:", -1);
+	for (unsigned int i = 0; i < KEY_LEN; ++i)
+		rk[i] ^= mask[i];
+	wipe(mask);
+
+	wipe(d_cks); wipe(d_ckr); wipe(d_rk);
+	d_ns = d_nr = d_pn = 0;
+	d_skipped.clear();
+
+	d_rk = rk;
+	wipe(rk);
+	d_dhr = pub;
+	d_offer = pub;
+
+	string dh = "";
+	if (x25519_keygen(d_dhs) < 0 || x25519(d_dhs, d_dhr, dh) < 0)
+		return build_error("accept: Error in X25519 ratchet step.", -1);
+	if (kdf_rk(dh, d_cks) < 0)
+		return -1;
+	wipe(dh);
+	return 1;
+}
+
+
+// next message key for sending, and the header that goes along with it
+int ratchet::send_key(unsigned char *mk, string &hdr)
+{
+	errno = 0;
+	if (!can_send())
+		return build_error("send_key: No ratchet session with " + d_peer, -1);
+
+	string k = "", pub = "", b64pub = "", chk = "";
+	if (kdf_ck(d_cks, k) < 0)
+		return -1;
+	if (x25519_pub(d_dhs, pub) < 0 || key_check(k, chk) < 0)
+		return build_error("send_key: Invalid ratchet key.", -1);
+
+	b64_encode(pub, b64pub);
+	hdr = b64pub + ":" + to_string(d_pn) + ":" + to_string(d_ns) + ":" + chk;
+	++d_ns;
+
+	memcpy(mk, k.c_str(), KEY_LEN);
+	wipe(k);
+	return 0;
+}
+
+
+// message key for a received ratchet header
+int ratchet::recv_key(const string &hdr, unsigned char *mk)
+{
+	char b64pub[65], chk[17];
+	unsigned int pn = 0, n = 0;
+
+	errno = 0;
+	memset(b64pub, 0, sizeof(b64pub));
+	memset(chk, 0, sizeof(chk));
+	if (sscanf(hdr.c_str(), "%64[^:]:%u:%u:%16[0-9a-f]", b64pub, &pn, &n, chk) != 4)
+		return build_error("recv_key: Invalid ratchet header.", -1);
+
+	string pub = "", k = "", kchk = "";
+	b64_decode(b64pub, pub);
+	if (pub.size() != KEY_LEN)
+		return build_error("recv_key: Invalid ratchet header.", -1);
+
+	auto it = d_skipped.find(string(b64pub) + ":" + to_string(n));
+	if (it != d_skipped.end()) {
+		k = it->second;
+		wipe(it->second);
+		d_skipped.erase(it);
+	} else {
+		if (d_dhs.empty() || d_rk.empty())
+			return build_error("recv_key: No ratchet session with " + d_peer, -1);
+
+		// peer turned the ratchet: finish receiving chain, then two DH steps
+		if (pub != d_dhr) {
+			if (skip(pn) < 0)
+				return -1;
+			d_pn = d_ns;
+			d_ns = d_nr = 0;
+			d_dhr = pub;
+
+			string dh = "";
+			if (x25519(d_dhs, d_dhr, dh) < 0 || kdf_rk(dh, d_ckr) < 0)
+				return build_error("recv_key: Error in X25519 ratchet step.", -1);
+			if (x25519_keygen(d_dhs) < 0 || x25519(d_dhs, d_dhr, dh) < 0 || kdf_rk(dh, d_cks) < 0)
+				return build_error("recv_key: Error in X25519 ratchet step.", -1);
+			wipe(dh);
+		} else if (n < d_nr)
+			return build_error("recv_key: Message key already used.", -1);
+
+		if (skip(n) < 0)
+			return -1;
+		if (kdf_ck(d_ckr, k) < 0)
+			return -1;
+		++d_nr;
+	}
+
+	if (key_check(k, kchk) < 0 || kchk != chk) {
+		wipe(k);
+		return build_error("recv_key: Message key mismatch. Ratchet session out of sync?", -1);
+	}
+
+	memcpy(mk, k.c_str(), KEY_LEN);
+	wipe(k);
+	return 0;
+}
+
+
+}
+
@@ -0,0 +1,122 @@
+/*
+ * This file is part of the opmsg crypto message framework.
+ *
+ * (C) 2015-2018 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * opmsg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * opmsg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with opmsg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef opmsg_ratchet_h
+#define opmsg_ratchet_h
+
+#include <map>
+#include <string>
+#include <cerrno>
+#include <cstring>
+
+extern "C" {
+#include <openssl/err.h>
+}
+
+
+namespace opmsg {
+
+// Per-peer double ratchet session, kept in <cfgbase>/<my id>/ratchet/<peer id>.
+// Message keys come from symmetric chains, and X25519 ratchet keys travel
+// in the message header whenever the direction of the conversation changes.
+class ratchet {
+
+	std::string d_me{""}, d_peer{""}, d_dir{""}, d_file{""}, d_err{""};
+
+	// write lock on <peer id>.lock, held from load() until the object goes away,
+	// so concurrent opmsg runs dont take the same chain step
+	int d_lockfd{-1};
+
+	// raw X25519 keys: our ratchet key (private), the peers ratchet key
+	std::string d_dhs{""}, d_dhr{""};
+
+	// root key, sending and receiving chain keys
+	std::string d_rk{""}, d_cks{""}, d_ckr{""};
+
+	unsigned int d_ns{0}, d_nr{0}, d_pn{0};
+
+	// the peer's ratchet key of the last offer we took over
+	std::string d_offer{""};
+
+	// message keys of skipped (not yet arrived) messages, by "b64 ratchet key:n"
+	std::map<std::string, std::string> d_skipped;
+
+	template<class T>
+	T build_error(const std::string &msg, T r)
+	{
+		int e = 0;
+		d_err = "ratchet::";
+		d_err += msg;
+		if ((e = ERR_get_error())) {
+			ERR_load_crypto_strings();
+			d_err += ":";
+			d_err += ERR_error_string(e, nullptr);
+			ERR_clear_error();
+		} else if (errno) {
+			d_err += ":";
+			d_err += strerror(errno);
+		}
+		return r;
+	}
+
+	int kdf_rk(const std::string &, std::string &);
+
+	int kdf_ck(std::string &, std::string &);
+
+	int skip(unsigned int);
+
+public:
+
+	enum {
+		KEY_LEN = 32
+	};
+
+	ratchet(const std::string &, const std::string &, const std::string &);
+
+	~ratchet();
+
+	int load();
+
+	int store();
+
+	bool can_send()
+	{
+		return d_dhs.size() > 0 && d_dhr.size() > 0 && d_cks.size() > 0;
+	}
+
+	int offer(const unsigned char *, int, std::string &);
+
+	int accept(const unsigned char *, int, const std::string &);
+
+	int send_key(unsigned char *, std::string &);
+
+	int recv_key(const std::string &, unsigned char *);
+
+	const char *why()
+	{
+		return d_err.c_str();
+	}
+};
+
+
+}
+
+#endif
+
@@ -0,0 +1,140 @@
+/*
+ * This file is part of the opmsg crypto message framework.
+ *
+ * (C) 2015-2018 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * opmsg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * opmsg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with opmsg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef opmsg_ringbuf_h
+#define opmsg_ringbuf_h
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+
+namespace opmsg {
+
+
+/* Bounded lock-free ring for exactly one producer and one consumer thread.
+ * Used to connect the stages of a pipeline. N must be a power of 2.
+ * push_wait()/pop_wait() spin a little and then sleep until the other side
+ * made progress, so a stage waiting for a slow one doesnt burn a core.
+ */
+template<class T, std::size_t N>
+class spsc_ring {
+
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "spsc_ring: N must be a power of 2");
+
+	enum { spins = 64 };
+
+	T d_slots[N];
+
+	// head is only written by producer, tail only by consumer; dont share cache lines
+	alignas(64) std::atomic<std::size_t> d_head{0};
+	alignas(64) std::atomic<std::size_t> d_tail{0};
+
+	// sleeping side, if any. Only touched when a waiter gave up spinning.
+	alignas(64) std::atomic<int> d_sleepers{0};
+	std::mutex d_lock;
+	std::condition_variable d_cv;
+
+	void wake()
+	{
+		// pairs with the increment of d_sleepers before the waiter's last retry
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (d_sleepers.load(std::memory_order_relaxed) > 0) {
+			std::lock_guard<std::mutex> g(d_lock);
+			d_cv.notify_all();
+		}
+	}
+
+	bool try_push(const T &t)
+	{
+		std::size_t h = d_head.load(std::memory_order_relaxed);
+		if (h - d_tail.load(std::memory_order_acquire) == N)
+			return false;
+		d_slots[h & (N - 1)] = t;
+		d_head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool try_pop(T &t)
+	{
+		std::size_t tl = d_tail.load(std::memory_order_relaxed);
+		if (d_head.load(std::memory_order_acquire) == tl)
+			return false;
+		t = d_slots[tl & (N - 1)];
+		d_tail.store(tl + 1, std::memory_order_release);
+		return true;
+	}
+
+	// retry f until it succeeds, then wake the other side
+	template<class F>
+	void wait(F f)
+	{
+		bool done = 0;
+		for (int i = 0; !done && i < spins; ++i) {
+			if (!(done = f()))
+				std::this_thread::yield();
+		}
+		if (!done) {
+			std::unique_lock<std::mutex> l(d_lock);
+			d_sleepers.fetch_add(1, std::memory_order_seq_cst);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while (!f())
+				d_cv.wait(l);
+			d_sleepers.fetch_sub(1, std::memory_order_relaxed);
+		}
+		wake();
+	}
+
+public:
+
+	bool push(const T &t)
+	{
+		if (!try_push(t))
+			return false;
+		wake();
+		return true;
+	}
+
+	bool pop(T &t)
+	{
+		if (!try_pop(t))
+			return false;
+		wake();
+		return true;
+	}
+
+	void push_wait(const T &t)
+	{
+		wait([&]{ return try_push(t); });
+	}
+
+	void pop_wait(T &t)
+	{
+		wait([&]{ return try_pop(t); });
+	}
+};
+
+
+}
+
+#endif
+
@@ -0,0 +1,1370 @@
+/*
+ * This file is part of the opmsg crypto message framework.
+ *
+ * (C) 2015-2018 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * opmsg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * opmsg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with opmsg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+extern "C" {
+#include <openssl/crypto.h>
+}
+
+#include "config.h"
+#include "numbers.h"
+#include "misc.h"
+#include "kexpack.h"
+#include "storage.h"
+
+
+namespace opmsg {
+
+using namespace std;
+
+
+static int mkdir_helper(const string &base, string &result)
+{
+	char unique[256];
+	timeval tv;
+
+	result = "";
+
+	gettimeofday(&tv, NULL);
+	snprintf(unique, sizeof(unique), "/%zx.%zx.%d", (size_t)tv.tv_sec, (size_t)tv.tv_usec, getpid());
+
+	string file = base + string(unique);
+
+	if (mkdir(file.c_str(), 0700) < 0)
+		return -1;
+
+	result = file;
+	return 0;
+}
+
+
+// read whole file from fd, until read() reports EOF. Short reads happen on
+// network filesystems or after signals and dont mean anything.
+static int read_fd(int fd, string &content)
+{
+	char buf[8192];
+	ssize_t r = 0;
+	struct stat st;
+
+	content = "";
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		content.reserve(st.st_size);
+	for (;;) {
+		if ((r = read(fd, buf, sizeof(buf))) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (r == 0)
+			break;
+		content.append(buf, r);
+	}
+	OPENSSL_cleanse(buf, sizeof(buf));
+	return r < 0 ? -1 : 0;
+}
+
+
+// read file relative to dfd. 1 if read, 0 if it does not exist
+static int read_file(int dfd, const string &file, string &content)
+{
+	content = "";
+
+	int fd = openat(dfd, file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	int r = read_fd(fd, content);
+	int saved_errno = errno;
+	close(fd);
+	if (r < 0) {
+		errno = saved_errno;
+		return -1;
+	}
+	return 1;
+}
+
+
+static int write_all(int fd, const string &content)
+{
+	for (string::size_type n = 0; n < content.size();) {
+		ssize_t r = write(fd, content.c_str() + n, content.size() - n);
+		if (r <= 0)
+			return -1;
+		n += r;
+	}
+	return 0;
+}
+
+
+static int write_new(int dfd, const string &file, const string &content)
+{
+	int fd = openat(dfd, file.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600);
+	if (fd < 0)
+		return -1;
+	int r = write_all(fd, content);
+	close(fd);
+	return r;
+}
+
+
+static DIR *opendirat(int dfd, const string &dir)
+{
+	int fd = openat(dfd, dir.c_str(), O_RDONLY|O_DIRECTORY);
+	if (fd < 0)
+		return nullptr;
+	DIR *d = fdopendir(fd);
+	if (!d)
+		close(fd);
+	return d;
+}
+
+
+// entries that cannot be a directory, if the filesystem tells us
+static bool no_dir(const dirent *de)
+{
+	return de->d_type != DT_DIR && de->d_type != DT_UNKNOWN;
+}
+
+
+// "ab/cd/" for an id abcd...
+static string shard_of(const string &hex)
+{
+	return hex.substr(0, 2) + "/" + hex.substr(2, 2) + "/";
+}
+
+
+// Path of hex below dir (relative to dfd), flat or sharded. An existing one wins,
+// otherwise the one of the preferred layout is returned.
+static string shard_path(int dfd, const string &dir, const string &hex, bool sharded, bool *found = nullptr)
+{
+	struct stat st;
+	string flat = dir + hex, r = flat;
+	bool f = 1;
+
+	if (hex.size() < 4) {
+		f = (fstatat(dfd, flat.c_str(), &st, 0) == 0);
+	} else {
+		string sh = dir + shard_of(hex) + hex;
+		const string &first = sharded ? sh : flat, &second = sharded ? flat : sh;
+		if (fstatat(dfd, first.c_str(), &st, 0) == 0)
+			r = first;
+		else if (fstatat(dfd, second.c_str(), &st, 0) == 0)
+			r = second;
+		else {
+			r = first;
+			f = 0;
+		}
+	}
+
+	if (found)
+		*found = f;
+	return r;
+}
+
+
+static int mkdir_shard(int dfd, const string &hex)
+{
+	string dir = hex.substr(0, 2);
+	if (mkdirat(dfd, dir.c_str(), 0700) < 0 && errno != EEXIST)
+		return -1;
+	dir += "/" + hex.substr(2, 2);
+	if (mkdirat(dfd, dir.c_str(), 0700) < 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+
+string persona_dir(const string &base, const string &id)
+{
+	return shard_path(AT_FDCWD, base + "/", id, config::shard);
+}
+
+
+thread_local string storage::d_err{""};
+
+
+// Overwrite all files in dir fd bfd with zeros, a single write each, flush just
+// those files and unlink them
+static void shred_dir(int bfd)
+{
+	vector<pair<string, int>> files;
+	struct stat st;
+
+	DIR *d = opendirat(bfd, ".");
+	if (!d)
+		return;
+
+	dirent *de = nullptr;
+	while ((de = readdir(d)) != nullptr) {
+		if (de->d_name[0] == '.')
+			continue;
+		int fd = openat(bfd, de->d_name, O_RDWR|O_NOFOLLOW);
+		if (fd < 0)
+			continue;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+			string zeros(st.st_size, 0);
+			for (string::size_type n = 0; n < zeros.size();) {
+				ssize_t r = pwrite(fd, zeros.c_str() + n, zeros.size() - n, n);
+				if (r <= 0)
+					break;
+				n += r;
+			}
+		}
+		files.push_back(make_pair(string(de->d_name), fd));
+	}
+	closedir(d);
+
+	for (auto &f : files) {
+		fdatasync(f.second);
+		close(f.second);
+		unlinkat(bfd, f.first.c_str(), 0);
+	}
+}
+
+
+/* Burned Kex privkeys are renamed into the .burn dir of their persona right away,
+ * so nothing can load them anymore, and shredded there by a background thread.
+ * burn_drain() shreds whatever was queued before the process exits. Leftovers of
+ * a crash or signal are swept once the persona dir is opened again.
+ */
+class burn_queue {
+
+	mutex d_lock;
+	condition_variable d_cv;
+	deque<int> d_dirs;
+	thread d_worker;
+	bool d_stop{0};
+
+	void run()
+	{
+		unique_lock<mutex> l(d_lock);
+		for (;;) {
+			d_cv.wait(l, [this]{ return d_stop || !d_dirs.empty(); });
+			if (d_dirs.empty())
+				break;
+
+			// take all that was queued meanwhile at once
+			deque<int> dirs;
+			dirs.swap(d_dirs);
+			l.unlock();
+			for (int bfd : dirs) {
+				shred_dir(bfd);
+				close(bfd);
+			}
+			l.lock();
+		}
+	}
+
+public:
+
+	~burn_queue()
+	{
+		drain();
+	}
+
+	// wait until everything queued is shredded; a later add() starts a new worker
+	void drain()
+	{
+		{
+			lock_guard<mutex> g(d_lock);
+			d_stop = 1;
+		}
+		d_cv.notify_one();
+		if (d_worker.joinable())
+			d_worker.join();
+		lock_guard<mutex> g(d_lock);
+		d_stop = 0;
+	}
+
+	// takes ownership of bfd
+	void add(int bfd)
+	{
+		{
+			lock_guard<mutex> g(d_lock);
+			d_dirs.push_back(bfd);
+			if (!d_worker.joinable())
+				d_worker = thread(&burn_queue::run, this);
+		}
+		d_cv.notify_one();
+	}
+};
+
+static burn_queue burner;
+
+
+void burn_drain()
+{
+	burner.drain();
+}
+
+
+// fd of the .burn dir below dfd if it holds anything, -1 otherwise. It stays
+// around once a key was burned, so only non-empty ones are worth a shred run.
+static int burn_leftovers(int dfd)
+{
+	DIR *d = opendirat(dfd, ".burn");
+	if (!d)
+		return -1;
+
+	bool found = 0;
+	dirent *de = nullptr;
+	while (!found && (de = readdir(d)) != nullptr)
+		found = (de->d_name[0] != '.');
+
+	int bfd = found ? dup(dirfd(d)) : -1;
+	closedir(d);
+	return bfd;
+}
+
+
+static const vector<string> kex_files{"dh.pub.pem", "dh.priv.pem", "dh.pub.1.pem", "dh.priv.1.pem", "dh.pub.2.pem", "dh.priv.2.pem", "peer", "used"};
+
+
+dir_storage::~dir_storage()
+{
+	for (auto &i : d_packs)
+		delete i.second;
+	for (auto &i : d_pfds)
+		close(i.second);
+}
+
+
+kexpack *dir_storage::pack(const string &id)
+{
+	string dir = pdir(id);
+
+	lock_guard<mutex> g(d_lock);
+
+	auto it = d_packs.find(id);
+	if (it != d_packs.end())
+		return it->second;
+
+	kexpack *kp = new (nothrow) kexpack(dir);
+	if (kp)
+		d_packs[id] = kp;
+	return kp;
+}
+
+
+string dir_storage::pdir(const string &id)
+{
+	{
+		lock_guard<mutex> g(d_lock);
+		auto it = d_pdirs.find(id);
+		if (it != d_pdirs.end())
+			return it->second;
+	}
+
+	bool found = 0;
+	string dir = shard_path(AT_FDCWD, d_base + "/", id, config::shard, &found);
+	if (found) {
+		lock_guard<mutex> g(d_lock);
+		d_pdirs[id] = dir;
+	}
+	return dir;
+}
+
+
+// persona dir is opened once, all further access is relative to it
+int dir_storage::pfd(const string &id)
+{
+	{
+		lock_guard<mutex> g(d_lock);
+		auto it = d_pfds.find(id);
+		if (it != d_pfds.end())
+			return it->second;
+	}
+
+	int fd = open(pdir(id).c_str(), O_RDONLY|O_DIRECTORY);
+	if (fd < 0)
+		return -1;
+
+	// privkeys burned by a process that died before shredding them
+	int bfd = burn_leftovers(fd);
+	if (bfd >= 0)
+		burner.add(bfd);
+
+	lock_guard<mutex> g(d_lock);
+
+	// another thread was faster
+	auto it = d_pfds.find(id);
+	if (it != d_pfds.end()) {
+		close(fd);
+		return it->second;
+	}
+
+	// loading a whole keystore must not run out of fds. Only evict fds that no
+	// other thread is using right now.
+	if (d_pfds.size() >= MAX_DIRFDS) {
+		for (auto i = d_pfds.begin(); i != d_pfds.end(); ++i) {
+			if (d_busy.count(i->first) == 0) {
+				close(i->second);
+				d_pfds.erase(i);
+				break;
+			}
+		}
+	}
+	d_pfds[id] = fd;
+	return fd;
+}
+
+
+void dir_storage::forget(const string &id)
+{
+	lock_guard<mutex> g(d_lock);
+
+	d_pdirs.erase(id);
+
+	auto it1 = d_pfds.find(id);
+	if (it1 != d_pfds.end()) {
+		close(it1->second);
+		d_pfds.erase(it1);
+	}
+
+	auto it2 = d_packs.find(id);
+	if (it2 != d_packs.end()) {
+		delete it2->second;
+		d_packs.erase(it2);
+	}
+}
+
+
+void dir_storage::busy(const string &id, bool b)
+{
+	lock_guard<mutex> g(d_lock);
+
+	if (b)
+		++d_busy[id];
+	else if (--d_busy[id] <= 0)
+		d_busy.erase(id);
+}
+
+
+// Kex dir of hex relative to persona dir
+string dir_storage::kdir(const string &id, const string &hex, bool *found)
+{
+	return shard_path(pfd(id), "", hex, config::shard_kex, found);
+}
+
+
+// hex ids with given prefix, flat inside dir and inside its ab/cd shards. A prefix of
+// at least two bytes makes it read only the one shard it belongs to.
+int dir_storage::scan(int dfd, const string &dir, const string &prefix, vector<string> &ids)
+{
+	vector<string> shards;
+
+	DIR *d = opendirat(dfd, dir);
+	if (!d)
+		return -1;
+
+	dirent *de = nullptr;
+	while ((de = readdir(d)) != nullptr) {
+		string n = de->d_name;
+		if (no_dir(de) || !is_hex_hash(n))
+			continue;
+		if (n.size() > 2) {
+			if (n.compare(0, prefix.size(), prefix) == 0)
+				ids.push_back(n);
+		} else if (prefix.size() < 2 || prefix.compare(0, 2, n) == 0)
+			shards.push_back(n);
+	}
+	closedir(d);
+
+	for (const string &s1 : shards) {
+		vector<string> shards2;
+		if (prefix.size() >= 4)
+			shards2.push_back(prefix.substr(2, 2));
+		else if ((d = opendirat(dfd, dir + "/" + s1)) != nullptr) {
+			while ((de = readdir(d)) != nullptr) {
+				string n = de->d_name;
+				if (!no_dir(de) && n.size() == 2 && is_hex_hash(n))
+					shards2.push_back(n);
+			}
+			closedir(d);
+		}
+
+		for (const string &s2 : shards2) {
+			if ((d = opendirat(dfd, dir + "/" + s1 + "/" + s2)) == nullptr)
+				continue;
+			while ((de = readdir(d)) != nullptr) {
+				string n = de->d_name;
+				if (no_dir(de) || n.size() <= 4 || !is_hex_hash(n))
+					continue;
+				if (n.compare(0, 4, s1 + s2) == 0 && n.compare(0, prefix.size(), prefix) == 0)
+					ids.push_back(n);
+			}
+			closedir(d);
+		}
+	}
+
+	return 0;
+}
+
+
+int dir_storage::personas(vector<string> &ids, const string &prefix)
+{
+	if (scan(AT_FDCWD, d_base, prefix, ids) < 0)
+		return build_error("personas::opendir:", -1);
+	return 0;
+}
+
+
+int dir_storage::add_persona(const string &id, const map<string, string> &files)
+{
+	string tmpdir = "";
+	if (mkdir_helper(d_base, tmpdir) < 0)
+		return build_error("add_persona::mkdir:", -1);
+
+	int r = 0;
+	for (auto &i : files) {
+		if ((r = write_new(AT_FDCWD, tmpdir + "/" + i.first, i.second)) < 0)
+			break;
+	}
+
+	string hexdir = persona_dir(d_base, id);
+	if (r == 0 && hexdir != d_base + "/" + id) {
+		int bfd = open(d_base.c_str(), O_RDONLY|O_DIRECTORY);
+		r = bfd < 0 ? -1 : mkdir_shard(bfd, id);
+		if (bfd >= 0)
+			close(bfd);
+	}
+	if (r < 0 || rename(tmpdir.c_str(), hexdir.c_str()) < 0) {
+		int saved_errno = errno;
+		for (auto &i : files)
+			unlink((tmpdir + "/" + i.first).c_str());
+		rmdir(tmpdir.c_str());
+		errno = saved_errno;
+		return build_error("add_persona: Error creating persona " + id, -1);
+	}
+	return 0;
+}
+
+
+bool dir_storage::exists(const string &id, const string &what)
+{
+	struct stat st;
+	int fd = pfd(id);
+	return fd >= 0 && fstatat(fd, what.c_str(), &st, 0) == 0;
+}
+
+
+// Files are replaced via rename() by put() or only appended to, so reading them
+// needs no lock
+int dir_storage::get(const string &id, const string &what, string &content)
+{
+	content = "";
+
+	int fd = pfd(id);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : build_error("get::open: " + id, -1);
+
+	int r = read_file(fd, what, content);
+	if (r < 0)
+		return build_error("get::read: " + what + " of " + id, -1);
+	return r;
+}
+
+
+int dir_storage::get(const string &id, const string &what, const function<int(off_t, const reader &)> &f)
+{
+	int dfd = pfd(id);
+	if (dfd < 0)
+		return errno == ENOENT ? 0 : build_error("get::open: " + id, -1);
+
+	int fd = openat(dfd, what.c_str(), O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : build_error("get::open: " + what + " of " + id, -1);
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return build_error("get::fstat: " + what + " of " + id, -1);
+	}
+
+	auto rd = [&](off_t off, size_t len, string &content) -> int {
+		content.resize(len);
+		ssize_t r = pread(fd, &content[0], len, off);
+		if (r < 0) {
+			content = "";
+			return build_error("get::pread: " + what + " of " + id, -1);
+		}
+		content.resize(r);
+		return 1;
+	};
+
+	int r = f(st.st_size, rd);
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return r;
+}
+
+
+int dir_storage::put(const string &id, const string &what, const string &content)
+{
+	int fd = pfd(id);
+	if (fd < 0)
+		return build_error("put::open: " + id, -1);
+
+	string tmp = what + "." + to_string(getpid()) + ".tmp";
+	unlinkat(fd, tmp.c_str(), 0);
+	if (write_new(fd, tmp, content) < 0 || renameat(fd, tmp.c_str(), fd, what.c_str()) < 0) {
+		int saved_errno = errno;
+		unlinkat(fd, tmp.c_str(), 0);
+		errno = saved_errno;
+		return build_error("put::write: " + what + " of " + id, -1);
+	}
+	return 0;
+}
+
+
+int dir_storage::append(const string &id, const string &what, const string &content)
+{
+	int dfd = pfd(id);
+	if (dfd < 0)
+		return build_error("append::open: " + id, -1);
+
+	int fd = openat(dfd, what.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0600);
+	if (fd < 0)
+		return build_error("append::open: " + what + " of " + id, -1);
+	wlockf(fd);
+	int r = write_all(fd, content);
+	int saved_errno = errno;
+	unlockf(fd);
+	close(fd);
+	if (r < 0) {
+		errno = saved_errno;
+		return build_error("append::write: " + what + " of " + id, -1);
+	}
+	return 0;
+}
+
+
+int dir_storage::update(const string &id, const string &what, const function<int(string &)> &f)
+{
+	int dfd = pfd(id);
+	if (dfd < 0)
+		return build_error("update::open: " + id, -1);
+
+	int fd = openat(dfd, what.c_str(), O_RDWR|O_CREAT, 0600);
+	if (fd < 0)
+		return build_error("update::open: " + what + " of " + id, -1);
+	wlockf(fd);
+
+	string content = "";
+	int r = 0;
+	if (read_fd(fd, content) < 0)
+		r = build_error("update::read: " + what + " of " + id, -1);
+	else if ((r = f(content)) == 0) {
+		if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0 || write_all(fd, content) < 0)
+			r = build_error("update::write: " + what + " of " + id, -1);
+	}
+	unlockf(fd);
+	close(fd);
+	return r;
+}
+
+
+int dir_storage::remove(const string &id, const string &what)
+{
+	int fd = pfd(id);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : build_error("remove::open: " + id, -1);
+	if (unlinkat(fd, what.c_str(), 0) < 0 && errno != ENOENT)
+		return build_error("remove::unlink: " + what + " of " + id, -1);
+	errno = 0;
+	return 0;
+}
+
+
+// Load a Kex directory. Try to be as relaxed as possible about missing keys, and
+// try to get one part of pub/priv if possible. 1 if any key was found, 0 if not.
+//
+// Note that 'dh' key can also be a EC_KEY for ECDH. Both, DH and EC keys are inside
+// the files named dh.{pub, priv}. This makes sense, as both keytypes are later used
+// for a DH Kex or ECDH Kex.
+int dir_storage::kex_load_dir(const string &id, const string &hex, kex_data &k)
+{
+	int dfd = pfd(id);
+	if (dfd < 0)
+		return build_error("kex_load::open: " + id, -1);
+
+	int kfd = openat(dfd, kdir(id, hex).c_str(), O_RDONLY|O_DIRECTORY);
+	if (kfd < 0)
+		return errno == ENOENT ? 0 : build_error("kex_load::open: " + hex, -1);
+
+	string pem = "";
+	int r = 1;
+
+	// up to 3 session keys per kex-id (kex-id is hexhash of first key)
+	for (unsigned int i = 0; i < 3; ++i) {
+		string suffix = i > 0 ? "." + to_string(i) + ".pem" : ".pem";
+
+		// Do not optimize by leaving the for loop if we dont find a pubkey.
+		// We may nevertheless hold a priv key in case we send test messages to ourselfs.
+		int r1 = read_file(kfd, "dh.pub" + suffix, pem);
+		k.pub.push_back(r1 > 0 ? pem : "");
+		int r2 = read_file(kfd, "dh.priv" + suffix, pem);
+		if (r2 < 0) {
+			r = build_error("kex_load::read: invalid (EC)DH privkey " + hex, -1);
+			break;
+		}
+		k.priv.push_back(r2 > 0 ? pem : "");
+
+		if (k.pub[i].empty() && k.priv[i].empty()) {
+			k.pub.pop_back();
+			k.priv.pop_back();
+
+			// this can happen, as we leave empty dir's for already imported (EC)DH keys, that
+			// are tried to be re-imported from old mails in opmsg versions before using "imported" file
+			if (i == 0)
+				r = 0;
+			break;
+		}
+	}
+
+	// check if there was a designated peer. No problem if there isn't.
+	if (r > 0 && read_file(kfd, "peer", pem) > 0) {
+		string::size_type nl = pem.find_first_of("\r\n");
+		if (nl != string::npos)
+			pem.erase(nl);
+		if (is_hex_hash(pem))
+			k.peer = pem;
+	}
+
+	struct stat st;
+	if (r > 0)
+		k.used = (fstatat(kfd, "used", &st, 0) == 0);
+	close(kfd);
+	return r;
+}
+
+
+int dir_storage::kex_load(const string &id, map<string, kex_data> &kexes, const string &hex)
+{
+	kexpack *kp = pack(id);
+	if (!kp)
+		return build_error("kex_load: OOM", -1);
+	if (kp->load(kexes, hex) < 0) {
+		errno = 0;
+		return build_error("kex_load::" + string(kp->why()), -1);
+	}
+
+	if (hex.size() > 0) {
+		if (kexes.count(hex) > 0)
+			return 0;
+		kex_data k;
+		int r = kex_load_dir(id, hex, k);
+		if (r > 0)
+			kexes[hex] = k;
+		return r < 0 ? -1 : 0;
+	}
+
+	int fd = pfd(id);
+	vector<string> hexes;
+	if (fd < 0 || scan(fd, ".", "", hexes) < 0)
+		return build_error("kex_load::opendir:", -1);
+
+	for (const string &h : hexes) {
+		if (kexes.count(h) > 0)
+			continue;
+
+		// stale keys are skipped, not fatal
+		kex_data k;
+		if (kex_load_dir(id, h, k) > 0)
+			kexes[h] = k;
+	}
+
+	errno = 0;
+	return 0;
+}
+
+
+bool dir_storage::kex_exists(const string &id, const string &hex)
+{
+	// stat() to check if an empty key directory exists. That'd mean that
+	// key was already imported and used once. (Later rename()
+	// would not fail on empty target dirs.)
+	bool found = 0;
+	kdir(id, hex, &found);
+	if (found)
+		return 1;
+
+	// Kex packs keep tombstones of deleted ids. If the pack cant be read,
+	// better refuse the id than import it twice.
+	kexpack *kp = pack(id);
+	return !kp || kp->exists(hex) != 0;
+}
+
+
+int dir_storage::kex_add(const string &id, const string &hex, const kex_data &k)
+{
+	if (config::kexpack) {
+		kexpack *kp = pack(id);
+		if (!kp)
+			return build_error("kex_add: OOM", -1);
+		if (kp->add(hex, k) < 0) {
+			errno = 0;
+			return build_error("kex_add::" + string(kp->why()), -1);
+		}
+		return 0;
+	}
+
+	int fd = pfd(id);
+	if (fd < 0)
+		return build_error("kex_add::open: " + id, -1);
+
+	string tmpdir = "", dir = pdir(id);
+	if (mkdir_helper(dir, tmpdir) < 0)
+		return build_error("kex_add::mkdir:", -1);
+	tmpdir = tmpdir.substr(dir.size() + 1);
+
+	int r = 0;
+	for (unsigned int i = 0; r == 0 && i < 3; ++i) {
+		string suffix = i > 0 ? "." + to_string(i) + ".pem" : ".pem";
+		if (i < k.pub.size() && k.pub[i].size() > 0)
+			r = write_new(fd, tmpdir + "/dh.pub" + suffix, k.pub[i]);
+		if (r == 0 && i < k.priv.size() && k.priv[i].size() > 0)
+			r = write_new(fd, tmpdir + "/dh.priv" + suffix, k.priv[i]);
+	}
+
+	// record any given designated peer. Errors here are non-fatal
+	if (r == 0 && is_hex_hash(k.peer)) {
+		if (write_new(fd, tmpdir + "/peer", k.peer + "\n") < 0)
+			unlinkat(fd, (tmpdir + "/peer").c_str(), 0);
+	}
+	if (r == 0 && k.used)
+		r = write_new(fd, tmpdir + "/used", "");
+
+	string hexdir = kdir(id, hex);
+	if (r == 0 && hexdir != hex)
+		r = mkdir_shard(fd, hex);
+	if (r < 0 || renameat(fd, tmpdir.c_str(), fd, hexdir.c_str()) < 0) {
+		int saved_errno = errno;
+		for (const string &s : kex_files)
+			unlinkat(fd, (tmpdir + "/" + s).c_str(), 0);
+		unlinkat(fd, tmpdir.c_str(), AT_REMOVEDIR);
+		errno = saved_errno;
+		return build_error("kex_add: Error storing (EC)DH keys " + hex, -1);
+	}
+	return 0;
+}
+
+
+int dir_storage::kex_used(const string &id, const string &hex, bool u)
+{
+	kexpack *kp = pack(id);
+	int r = kp ? kp->used(hex, u) : 0;
+	if (r < 0) {
+		errno = 0;
+		return build_error("kex_used::" + string(kp->why()), -1);
+	} else if (r > 0)
+		return 0;
+
+	int fd = pfd(id);
+	if (fd < 0)
+		return build_error("kex_used::open: " + id, -1);
+
+	string file = kdir(id, hex) + "/used";
+	if (!u)
+		unlinkat(fd, file.c_str(), 0);
+	else
+		close(openat(fd, file.c_str(), O_CREAT|O_EXCL, 0600));
+	errno = 0;
+	return 0;
+}
+
+
+int dir_storage::kex_del_pub(const string &id, const string &hex)
+{
+	kexpack *kp = pack(id);
+	int r = kp ? kp->del_pub(hex) : 0;
+	if (r < 0) {
+		errno = 0;
+		return build_error("kex_del_pub::" + string(kp->why()), -1);
+	} else if (r > 0)
+		return 0;
+
+	int fd = pfd(id);
+	if (fd < 0)
+		return build_error("kex_del_pub::open: " + id, -1);
+
+	string dir = kdir(id, hex);
+	for (const string &s : vector<string>{"/dh.pub.pem", "/dh.pub.1.pem", "/dh.pub.2.pem"})
+		unlinkat(fd, (dir + s).c_str(), 0);
+	errno = 0;
+	return 0;
+}
+
+
+int dir_storage::kex_del_priv(const string &id, const string &hex)
+{
+	kexpack *kp = pack(id);
+	int r = kp ? kp->del_priv(hex) : 0;
+	if (r < 0) {
+		errno = 0;
+		return build_error("kex_del_priv::" + string(kp->why()), -1);
+	} else if (r > 0)
+		return 0;
+
+	int dfd = pfd(id);
+	if (dfd < 0)
+		return build_error("kex_del_priv::open: " + id, -1);
+
+	string dir = kdir(id, hex);
+
+	if (mkdirat(dfd, ".burn", 0700) < 0 && errno != EEXIST)
+		return build_error("kex_del_priv::mkdir: Unable to create .burn dir.", -1);
+
+	int j = 0;
+	for (const string &s : vector<string>{"dh.priv.pem", "dh.priv.1.pem", "dh.priv.2.pem"}) {
+		string file = dir + "/" + s, to = ".burn/" + hex + "." + s + "." + to_string(getpid());
+
+		// ENOENT errors for (possibly not existing) subkeys are OK
+		if (renameat(dfd, file.c_str(), dfd, to.c_str()) < 0) {
+			if (j == 0 || errno != ENOENT)
+				return build_error("kex_del_priv: Unable to move keyfile for shredding.", -1);
+			else
+				continue;
+		}
+		++j;
+	}
+
+	int bfd = openat(dfd, ".burn", O_RDONLY|O_DIRECTORY);
+	if (bfd < 0)
+		return build_error("kex_del_priv: Unable to open .burn dir for shredding.", -1);
+	burner.add(bfd);
+
+	unlinkat(dfd, (dir + "/used").c_str(), 0);
+	unlinkat(dfd, (dir + "/peer").c_str(), 0);
+	errno = 0;
+	return 0;
+}
+
+
+int dir_storage::kex_del_id(const string &id, const string &hex)
+{
+	kexpack *kp = pack(id);
+	int r = kp ? kp->del_id(hex) : 0;
+	if (r < 0) {
+		errno = 0;
+		return build_error("kex_del_id::" + string(kp->why()), -1);
+	} else if (r > 0)
+		return 0;
+
+	int fd = pfd(id);
+	if (fd < 0 || unlinkat(fd, kdir(id, hex).c_str(), AT_REMOVEDIR) < 0)
+		return build_error("kex_del_id::rmdir:", -1);
+	return 0;
+}
+
+
+int dir_storage::kex_compact(const string &id)
+{
+	kexpack *kp = pack(id);
+	if (!kp)
+		return build_error("kex_compact: OOM", -1);
+	if (kp->compact() < 0) {
+		errno = 0;
+		return build_error("kex_compact::" + string(kp->why()), -1);
+	}
+	return 0;
+}
+
+
+// Move flat persona directories into their shards and, with shard_kex, also the Kex
+// directories inside. Each move is a single rename(), so opmsg may be used meanwhile.
+int dir_storage::shard()
+{
+	if (!config::shard && !config::shard_kex)
+		return build_error("shard: Neither shard nor shard_kex enabled in config.", -1);
+
+	vector<string> ids;
+	if (scan(AT_FDCWD, d_base, "", ids) < 0)
+		return build_error("shard::opendir:", -1);
+
+	int bfd = open(d_base.c_str(), O_RDONLY|O_DIRECTORY);
+	if (bfd < 0)
+		return build_error("shard::open:", -1);
+
+	struct stat st;
+	string err = "";
+	for (const string &id : ids) {
+		if (config::shard && fstatat(bfd, id.c_str(), &st, 0) == 0) {
+			if (mkdir_shard(bfd, id) < 0 || renameat(bfd, id.c_str(), bfd, (shard_of(id) + id).c_str()) < 0) {
+				err = "shard: Error moving persona " + id;
+				break;
+			}
+
+			// cached paths are stale now
+			forget(id);
+		}
+
+		if (!config::shard_kex)
+			continue;
+
+		int fd = pfd(id);
+		vector<string> hexes;
+		if (fd < 0 || scan(fd, ".", "", hexes) < 0) {
+			err = "shard::opendir:";
+			break;
+		}
+		for (const string &hex : hexes) {
+			if (fstatat(fd, hex.c_str(), &st, 0) < 0)
+				continue;
+			if (mkdir_shard(fd, hex) < 0 || renameat(fd, hex.c_str(), fd, (shard_of(hex) + hex).c_str()) < 0) {
+				err = "shard: Error moving Kex id " + hex + " of " + id;
+				break;
+			}
+		}
+		if (err.size() > 0)
+			break;
+	}
+
+	int saved_errno = errno;
+	close(bfd);
+	if (err.size() > 0) {
+		errno = saved_errno;
+		return build_error(err, -1);
+	}
+
+	errno = 0;
+	return 0;
+}
+
+
+static void wipe(string &s)
+{
+	if (s.size() > 0)
+		OPENSSL_cleanse(&s[0], s.size());
+	s.clear();
+}
+
+
+mem_storage::~mem_storage()
+{
+	for (auto &p : d_personas) {
+		for (auto &f : p.second.files)
+			wipe(f.second);
+		for (auto &k : p.second.keys) {
+			for (auto &s : k.second.priv)
+				wipe(s);
+		}
+	}
+}
+
+
+int mem_storage::personas(vector<string> &ids, const string &prefix)
+{
+	lock_guard<mutex> g(d_lock);
+
+	for (auto it = d_personas.lower_bound(prefix); it != d_personas.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+		ids.push_back(it->first);
+	return 0;
+}
+
+
+int mem_storage::add_persona(const string &id, const map<string, string> &files)
+{
+	lock_guard<mutex> g(d_lock);
+
+	if (d_personas.count(id) > 0) {
+		errno = EEXIST;
+		return build_error("add_persona: Error creating persona " + id, -1);
+	}
+	d_personas[id].files = files;
+	return 0;
+}
+
+
+bool mem_storage::exists(const string &id, const string &what)
+{
+	lock_guard<mutex> g(d_lock);
+
+	auto it = d_personas.find(id);
+	return it != d_personas.end() && it->second.files.count(what) > 0;
+}
+
+
+int mem_storage::get(const string &id, const string &what, string &content)
+{
+	lock_guard<mutex> g(d_lock);
+
+	content = "";
+	auto it = d_personas.find(id);
+	if (it == d_personas.end())
+		return 0;
+	auto f = it->second.files.find(what);
+	if (f == it->second.files.end())
+		return 0;
+	content = f->second;
+	return 1;
+}
+
+
+// f runs on a copy, so it may use the storage meanwhile
+int mem_storage::get(const string &id, const string &what, const function<int(off_t, const reader &)> &f)
+{
+	string file = "";
+	{
+		lock_guard<mutex> g(d_lock);
+		auto it = d_personas.find(id);
+		if (it == d_personas.end())
+			return 0;
+		auto i = it->second.files.find(what);
+		if (i == it->second.files.end())
+			return 0;
+		file = i->second;
+	}
+
+	auto rd = [&](off_t off, size_t len, string &content) -> int {
+		content = "";
+		if ((size_t)off < file.size())
+			content = file.substr(off, len);
+		return 1;
+	};
+
+	int r = f(file.size(), rd);
+	wipe(file);
+	return r;
+}
+
+
+int mem_storage::put(const string &id, const string &what, const string &content)
+{
+	lock_guard<mutex> g(d_lock);
+
+	auto it = d_personas.find(id);
+	if (it == d_personas.end()) {
+		errno = ENOENT;
+		return build_error("put: No such persona " + id, -1);
+	}
+	wipe(it->second.files[what]);
+	it->second.files[what] = content;
+	return 0;
+}
+
+
+int mem_storage::append(const string &id, const string &what, const string &content)
+{
+	lock_guard<mutex> g(d_lock);
+
+	auto it = d_personas.find(id);
+	if (it == d_personas.end()) {
+		errno = ENOENT;
+		return build_error("append: No such persona " + id, -1);
+	}
+	it->second.files[what] += content;
+	return 0;
+}
+
+
+// f may call back into the storage, so d_lock is not held while it runs. Whatever
+// was appended meanwhile is kept.
+int mem_storage::update(const string &id, const string &what, const function<int(string &)> &f)
+{
+	lock_guard<mutex> u(d_update_lock);
+
+	string old = "";
+	{
+		lock_guard<mutex> g(d_lock);
+		auto it = d_personas.find(id);
+		if (it == d_personas.end()) {
+			errno = ENOENT;
+			return build_error("update: No such persona " + id, -1);
+		}
+		old = it->second.files[what];
+	}
+
+	string content = old;
+	int r = f(content);
+	if (r != 0)
+		return r;
+
+	lock_guard<mutex> g(d_lock);
+	auto it = d_personas.find(id);
+	if (it == d_personas.end()) {
+		errno = ENOENT;
+		return build_error("update: No such persona " + id, -1);
+	}
+	string &cur = it->second.files[what];
+	if (cur.compare(0, old.size(), old) == 0)
+		content += cur.substr(old.size());
+	wipe(cur);
+	cur = content;
+	return 0;
+}
+
+
+int mem_storage::remove(const string &id, const string &what)
+{
+	lock_guard<mutex> g(d_lock);
+
+	auto it = d_personas.find(id);
+	if (it == d_personas.end())
+		return 0;
+	auto f = it->second.files.find(what);
+	if (f != it->second.files.end()) {
+		wipe(f->second);
+		it->second.files.erase(f);
+	}
+	return 0;
+}
+
+
+int mem_storage::kex_load(const string &id, map<string, kex_data> &kexes, const string &hex)
+{
+	lock_guard<mutex> g(d_lock);
+
+	auto it = d_personas.find(id);
+	if (it == d_personas.end())
+		return 0;
+
+	if (hex.size() > 0) {
+		auto k = it->second.keys.find(hex);
+		if (k != it->second.keys.end())
+			kexes[hex] = k->second;
+		return 0;
+	}
+
+	for (auto &k : it->second.keys) {
+		if (kexes.count(k.first) == 0)
+			kexes[k.first] = k.second;
+	}
+	return 0;
+}
+
+
+bool mem_storage::kex_exists(const string &id, const string &hex)
+{
+	lock_guard<mutex> g(d_lock);
+
+	auto it = d_personas.find(id);
+	return it != d_personas.end() && it->second.kex_ids.count(hex) > 0;
+}
+
+
+int mem_storage::kex_add(const string &id, const string &hex, const kex_data &k)
+{
+	lock_guard<mutex> g(d_lock);
+
+	auto it = d_personas.find(id);
+	if (it == d_personas.end()) {
+		errno = ENOENT;
+		return build_error("kex_add: No such persona " + id, -1);
+	}
+	if (it->second.kex_ids.count(hex) > 0) {
+		errno = EEXIST;
+		return build_error("kex_add: Error storing (EC)DH keys " + hex, -1);
+	}
+	it->second.kex_ids[hex] = 1;
+	it->second.keys[hex] = k;
+	return 0;
+}
+
+
+int mem_storage::kex_used(const string &id, const string &hex, bool u)
+{
+	lock_guard<mutex> g(d_lock);
+
+	auto it = d_personas.find(id);
+	if (it == d_personas.end())
+		return 0;
+	auto k = it->second.keys.find(hex);
+	if (k != it->second.keys.end())
+		k->second.used = u;
+	return 0;
+}
+
+
+int mem_storage::kex_del_pub(const string &id, const string &hex)
+{
+	lock_guard<mutex> g(d_lock);
+
+	auto it = d_personas.find(id);
+	if (it == d_personas.end())
+		return 0;
+	auto k = it->second.keys.find(hex);
+	if (k != it->second.keys.end())
+		k->second.pub.clear();
+	return 0;
+}
+
+
+int mem_storage::kex_del_priv(const string &id, const string &hex)
+{
+	lock_guard<mutex> g(d_lock);
+
+	auto it = d_personas.find(id);
+	if (it == d_personas.end()) {
+		errno = ENOENT;
+		return build_error("kex_del_priv: No such persona " + id, -1);
+	}
+	auto k = it->second.keys.find(hex);
+	if (k == it->second.keys.end()) {
+		errno = ENOENT;
+		return build_error("kex_del_priv: No such key " + hex, -1);
+	}
+	for (auto &s : k->second.priv)
+		wipe(s);
+	k->second.priv.clear();
+	k->second.peer = "";
+	k->second.used = 0;
+	return 0;
+}
+
+
+// Kex id stays known in kex_ids, so it cannot be re-imported
+int mem_storage::kex_del_id(const string &id, const string &hex)
+{
+	lock_guard<mutex> g(d_lock);
+
+	auto it = d_personas.find(id);
+	if (it == d_personas.end())
+		return 0;
+	auto k = it->second.keys.find(hex);
+	if (k != it->second.keys.end()) {
+		for (auto &s : k->second.priv)
+			wipe(s);
+		it->second.keys.erase(k);
+	}
+	return 0;
+}
+
+
+}
+
@@ -0,0 +1,304 @@
+/*
+ * This file is part of the opmsg crypto message framework.
+ *
+ * (C) 2015-2018 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * opmsg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * opmsg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with opmsg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef opmsg_storage_h
+#define opmsg_storage_h
+
+#include <map>
+#include <mutex>
+#include <functional>
+#include <vector>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <sys/types.h>
+
+extern "C" {
+#include <openssl/err.h>
+}
+
+
+namespace opmsg {
+
+class kexpack;
+
+// directory of a persona below the config dir, flat or sharded
+std::string persona_dir(const std::string &, const std::string &);
+
+// shred all Kex privkeys burned so far; to be called before the process exits
+void burn_drain();
+
+
+// what a Kex id holds: one pub/priv PEM per curve, designated peer and used flag
+struct kex_data {
+	std::vector<std::string> pub, priv;
+	std::string peer{""};
+	bool used{0};
+};
+
+
+// Where keystore and persona keep their data. Personas are addressed by their id,
+// their small files (name, srclink, imported, <type>.{pub,priv}.pem, dhparams.pem, dhgroup)
+// by name and their (EC)DH keys by Kex id. Unless noted otherwise, methods return
+// 0 on success and -1 on error.
+class storage {
+
+protected:
+
+	// last error of the calling thread, so parallel persona loads dont race on it
+	static thread_local std::string d_err;
+
+	template<class T>
+	T build_error(const std::string &msg, T r)
+	{
+		int e = 0;
+		d_err = "storage::";
+		d_err += msg;
+		if ((e = ERR_get_error())) {
+			ERR_load_crypto_strings();
+			d_err += ":";
+			d_err += ERR_error_string(e, nullptr);
+			ERR_clear_error();
+		} else if (errno) {
+			d_err += ":";
+			d_err += strerror(errno);
+		}
+		return r;
+	}
+
+public:
+
+	virtual ~storage()
+	{
+	}
+
+	// ids of all personas, or only of those starting with the given prefix
+	virtual int personas(std::vector<std::string> &, const std::string & = "") = 0;
+
+	// store a new persona along with its initial files at once. Fails if it already exists.
+	virtual int add_persona(const std::string &, const std::map<std::string, std::string> &) = 0;
+
+	virtual bool exists(const std::string &, const std::string &) = 0;
+
+	// 1 if found, 0 if not
+	virtual int get(const std::string &, const std::string &, std::string &) = 0;
+
+	// at most len bytes from offset off into the string, 1 on success
+	typedef std::function<int(off_t, size_t, std::string &)> reader;
+
+	// Ranged reads of a file as it was opened, even if it is replaced meanwhile: the function
+	// gets its size and a reader. 0 if the file is not found, otherwise the function's
+	// return value.
+	virtual int get(const std::string &, const std::string &, const std::function<int(off_t, const reader &)> &) = 0;
+
+	virtual int put(const std::string &, const std::string &, const std::string &) = 0;
+
+	virtual int append(const std::string &, const std::string &, const std::string &) = 0;
+
+	// Read-modify-write of a file under the lock append() takes. The function may change
+	// the content, which is written back if it returns 0, and may use the storage meanwhile.
+	// Otherwise its return value is passed on.
+	virtual int update(const std::string &, const std::string &, const std::function<int(std::string &)> &) = 0;
+
+	virtual int remove(const std::string &, const std::string &) = 0;
+
+	// Kex keys of a persona, only those of the given Kex id if not empty
+	virtual int kex_load(const std::string &, std::map<std::string, kex_data> &, const std::string & = "") = 0;
+
+	// whether the Kex id was stored once, even if deleted meanwhile
+	virtual bool kex_exists(const std::string &, const std::string &) = 0;
+
+	virtual int kex_add(const std::string &, const std::string &, const kex_data &) = 0;
+
+	virtual int kex_used(const std::string &, const std::string &, bool) = 0;
+
+	virtual int kex_del_pub(const std::string &, const std::string &) = 0;
+
+	// must not leave the private keys recoverable
+	virtual int kex_del_priv(const std::string &, const std::string &) = 0;
+
+	virtual int kex_del_id(const std::string &, const std::string &) = 0;
+
+	virtual int kex_compact(const std::string &)
+	{
+		return 0;
+	}
+
+	// directory for other per-persona files (DH precompute table), "" if there is none
+	virtual std::string dir(const std::string &)
+	{
+		return "";
+	}
+
+	// move personas (and Kex ids) into the configured sharded layout, if the backend has any
+	virtual int shard()
+	{
+		return 0;
+	}
+
+	// a thread starts/stops working on a persona; its cached resources must stay valid meanwhile
+	virtual void busy(const std::string &, bool)
+	{
+	}
+
+	const char *why()
+	{
+		return d_err.c_str();
+	}
+};
+
+
+// The classic ~/.opmsg layout: a directory per persona and per Kex id, or a Kex pack.
+// Persona and Kex directories may be sharded by the first two bytes of their id as
+// ab/cd/abcd..., both layouts can be mixed.
+class dir_storage : public storage {
+
+	std::string d_base{""};
+
+	// Kex packs, resolved directories and open directory fds by persona id, and
+	// personas in use by a thread whose fd must not be evicted
+	std::mutex d_lock;
+	std::map<std::string, kexpack *> d_packs;
+	std::map<std::string, std::string> d_pdirs;
+	std::map<std::string, int> d_pfds, d_busy;
+
+	kexpack *pack(const std::string &);
+
+	std::string pdir(const std::string &);
+
+	int pfd(const std::string &);
+
+	void forget(const std::string &);
+
+	std::string kdir(const std::string &, const std::string &, bool * = nullptr);
+
+	int scan(int, const std::string &, const std::string &, std::vector<std::string> &);
+
+	int kex_load_dir(const std::string &, const std::string &, kex_data &);
+
+public:
+
+	dir_storage(const std::string &base)
+		: d_base(base)
+	{
+	}
+
+	virtual ~dir_storage();
+
+	int personas(std::vector<std::string> &, const std::string & = "");
+
+	int add_persona(const std::string &, const std::map<std::string, std::string> &);
+
+	bool exists(const std::string &, const std::string &);
+
+	int get(const std::string &, const std::string &, std::string &);
+
+	int get(const std::string &, const std::string &, const std::function<int(off_t, const reader &)> &);
+
+	int put(const std::string &, const std::string &, const std::string &);
+
+	int append(const std::string &, const std::string &, const std::string &);
+
+	int update(const std::string &, const std::string &, const std::function<int(std::string &)> &);
+
+	int remove(const std::string &, const std::string &);
+
+	int kex_load(const std::string &, std::map<std::string, kex_data> &, const std::string & = "");
+
+	bool kex_exists(const std::string &, const std::string &);
+
+	int kex_add(const std::string &, const std::string &, const kex_data &);
+
+	int kex_used(const std::string &, const std::string &, bool);
+
+	int kex_del_pub(const std::string &, const std::string &);
+
+	int kex_del_priv(const std::string &, const std::string &);
+
+	int kex_del_id(const std::string &, const std::string &);
+
+	int kex_compact(const std::string &);
+
+	std::string dir(const std::string &id)
+	{
+		return pdir(id);
+	}
+
+	int shard();
+
+	void busy(const std::string &, bool);
+};
+
+
+// Everything in memory, nothing survives the process. For benchmarks, tests and
+// library users who dont want to touch the filesystem.
+class mem_storage : public storage {
+
+	struct mem_persona {
+		std::map<std::string, std::string> files;
+		std::map<std::string, kex_data> keys;
+		std::map<std::string, int> kex_ids;
+	};
+
+	std::mutex d_lock, d_update_lock;
+	std::map<std::string, mem_persona> d_personas;
+
+public:
+
+	virtual ~mem_storage();
+
+	int personas(std::vector<std::string> &, const std::string & = "");
+
+	int add_persona(const std::string &, const std::map<std::string, std::string> &);
+
+	bool exists(const std::string &, const std::string &);
+
+	int get(const std::string &, const std::string &, std::string &);
+
+	int get(const std::string &, const std::string &, const std::function<int(off_t, const reader &)> &);
+
+	int put(const std::string &, const std::string &, const std::string &);
+
+	int append(const std::string &, const std::string &, const std::string &);
+
+	int update(const std::string &, const std::string &, const std::function<int(std::string &)> &);
+
+	int remove(const std::string &, const std::string &);
+
+	int kex_load(const std::string &, std::map<std::string, kex_data> &, const std::string & = "");
+
+	bool kex_exists(const std::string &, const std::string &);
+
+	int kex_add(const std::string &, const std::string &, const kex_data &);
+
+	int kex_used(const std::string &, const std::string &, bool);
+
+	int kex_del_pub(const std::string &, const std::string &);
+
+	int kex_del_priv(const std::string &, const std::string &);
+
+	int kex_del_id(const std::string &, const std::string &);
+};
+
+
+}
+
+#endif
+